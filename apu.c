@@ -245,6 +245,7 @@ void apu_init(apu_t *apu, mem_t *mem)
   mem->apu = apu;
   mem->apu_read  = apu_read_hook;
   mem->apu_write = apu_write_hook;
+  mem_map_update(mem);
 
   /* Controller state: */
   for (i = 0; i < APU_CONTROLLERS; i++) {
@@ -542,6 +543,16 @@ void apu_execute(apu_t *apu)
 
 
 
+/* CPU cycles that can pass before apu_execute() updates the length counters.
+   The sequencer is stepped once per instruction, and since an instruction
+   takes at least 2 cycles this is a safe bound on the instructions run. */
+uint32_t apu_cycles_until_event(apu_t *apu)
+{
+  return ((7457 - apu->sequencer_divider) * 2) - 1;
+}
+
+
+
 void apu_dump(FILE *fh, apu_t *apu)
 {
   int i;
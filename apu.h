@@ -106,6 +106,7 @@ typedef struct apu_s {
 
 void apu_init(apu_t *apu, mem_t *mem);
 void apu_execute(apu_t *apu);
+uint32_t apu_cycles_until_event(apu_t *apu);
 void apu_dump(FILE *fh, apu_t *apu);
 
 #endif /* _APU_H */
@@ -754,21 +754,21 @@ void cli_update(void)
 
   /* Check for 400 to appear under TIME. */
   if (frame_start == 0 &&
-      ppu->name_table[0x7A] == 0x04) { /* '4' Symbol */
+      ppu->name_table[0][0x7A] == 0x04) { /* '4' Symbol */
     frame_start = ppu->frame_no;
   }
 
   /* Check for the axe at world 8-4. */
   if (axe84 == false &&
       mem->ram[0x75F] == 7 && /* World 8 */
-      ppu->name_table[0x21A] == 0x7B) { /* Top-Left Axe */
+      ppu->name_table[0][0x21A] == 0x7B) { /* Top-Left Axe */
     axe84 = true;
   }
 
   /* Check if the axe is gone. */
   if (frame_end == 0 &&
       axe84 == true &&
-      ppu->name_table[0x21A] == 0x24) { /* Empty Space */
+      ppu->name_table[0][0x21A] == 0x24) { /* Empty Space */
     frame_end = ppu->frame_no;
   }
 
@@ -7,6 +7,15 @@
 
 #include "mem.h"
 #include "panic.h"
+#include "trace.h"
+#ifdef CPU_FUSE
+#include "cpu_fuse.h"
+#else
+#define CPU_FUSE_TABLE(X)
+#endif
+#ifdef CPU_DYNAREC
+#include "dynarec.h"
+#endif
 
 
 
@@ -27,93 +36,401 @@ typedef enum {
   AM_NONE,
 } cpu_address_mode_t;
 
+/* Only what the dump prints, to keep large rings small. */
 typedef struct cpu_trace_s {
-  cpu_t cpu;
+  uint16_t pc;
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t sp;
+  uint8_t sr;
+  uint8_t n_result;
+  uint8_t z_result;
   uint8_t mc[3];
 } cpu_trace_t;
 
-#define CPU_TRACE_BUFFER_SIZE 20
-
-
+typedef struct cpu_decoded_s {
+  cpu_operation_func_t func; /* NULL when not decoded. */
+  uint8_t opcode;
+  uint8_t operand[2];
+  uint8_t cycles;
+  uint8_t size;
+  uint8_t idle; /* Instructions in the idle loop starting here, or 0. */
+  uint16_t key; /* Opcode, or UINT8_MAX + superinstruction starting here. */
+} cpu_decoded_t;
+
+typedef struct cpu_idle_s {
+  bool enabled;
+  cpu_t cpu; /* Registers on the last visit to an idle loop start. */
+  uint64_t visit_instructions; /* Position of the last visit. */
+  uint64_t visit_cycles;
+  uint32_t visit_window;
+  uint64_t instructions; /* Position at the start of the current run. */
+  uint64_t cycles;
+  uint32_t window; /* Device event windows passed. */
+  uint32_t loop_cycles; /* Of the last loop skipped. */
+  uint64_t skipped; /* Cycles skipped in total. */
+} cpu_idle_t;
+
+typedef struct cpu_histogram_s {
+  uint64_t count;
+  uint64_t cycles; /* Including page crossings and taken branches. */
+  uint64_t page_cross; /* Extra cycles from indexing across a page. */
+} cpu_histogram_t;
+
+/* Keeps rarely used paths out of the inlined run loop. */
+#ifdef __GNUC__
+#define CPU_COLD __attribute__((noinline))
+#else
+#define CPU_COLD
+#endif
+#define CPU_DECODE_START 0x6000 /* RAM and I/O below is never cached. */
+#define CPU_IDLE_LOOP_SIZE 16 /* Bytes, including the jump back. */
+#define CPU_IDLE_BREAK UINT8_MAX /* Decoded idle value for breakpoints. */
+#define CPU_FUSE_MAX 8 /* Superinstructions generated into cpu_fuse.h */
+#define CPU_FUSE_PROFILE_CSV "cpu_fuse.csv"
+#define CPU_FUSE_PROFILE_HEADER "cpu_fuse.h"
+#define CPU_HISTOGRAM_CSV "cpu_histogram.csv"
+#define CPU_RECOMP_START 0x8000 /* Cartridge ROM, translated ahead of time. */
+#define CPU_RECOMP_SIZE 0x8000
+#define CPU_RECOMP_LOG_FILE "cpu_recomp.cdl"
+#define CPU_RECOMP_HEADER "cpu_recomp.h"
+
+
+
+/* Every opcode with its mnemonic, operation, addressing mode, base cycles
+   when page boundary crossing is not considered, and class. The handlers,
+   the opcode tables and the dispatch of the run loop are all generated from
+   this. HOT handlers are inlined into the run loop. COLD ones are kept out
+   of it and run on the real state instead of the local registers. An ALIAS
+   uses the handler of another row, or of a jam, and is dispatched as COLD.
+   Undocumented opcodes are cold, so only the documented ones take up space
+   in the run loop. */
+#define CPU_OPCODE_TABLE(X) \
+  X(0x00, "BRK", brk, IMPL, 7, HOT)    \
+  X(0x01, "ORA", ora, ZPIX, 6, HOT)    \
+  X(0x02, "---", none, NONE, 0, ALIAS) \
+  X(0x03, "SLO", slo, ZPIX, 8, COLD)   \
+  X(0x04, "NOP", nop, ZP,   3, COLD)   \
+  X(0x05, "ORA", ora, ZP,   3, HOT)    \
+  X(0x06, "ASL", asl, ZP,   5, HOT)    \
+  X(0x07, "SLO", slo, ZP,   5, COLD)   \
+  X(0x08, "PHP", php, IMPL, 3, HOT)    \
+  X(0x09, "ORA", ora, IMM,  2, HOT)    \
+  X(0x0A, "ASL", asl, ACCU, 2, HOT)    \
+  X(0x0B, "ANC", anc, IMM,  2, COLD)   \
+  X(0x0C, "NOP", nop, ABS,  4, COLD)   \
+  X(0x0D, "ORA", ora, ABS,  4, HOT)    \
+  X(0x0E, "ASL", asl, ABS,  6, HOT)    \
+  X(0x0F, "SLO", slo, ABS,  6, COLD)   \
+  X(0x10, "BPL", bpl, REL,  2, HOT)    \
+  X(0x11, "ORA", ora, ZPYI, 5, HOT)    \
+  X(0x12, "---", none, NONE, 0, ALIAS) \
+  X(0x13, "SLO", slo, ZPYI, 8, COLD)   \
+  X(0x14, "NOP", nop, ZPX,  4, COLD)   \
+  X(0x15, "ORA", ora, ZPX,  4, HOT)    \
+  X(0x16, "ASL", asl, ZPX,  6, HOT)    \
+  X(0x17, "SLO", slo, ZPX,  6, COLD)   \
+  X(0x18, "CLC", clc, IMPL, 2, HOT)    \
+  X(0x19, "ORA", ora, ABSY, 4, HOT)    \
+  X(0x1A, "NOP", nop, IMPL, 2, ALIAS)  \
+  X(0x1B, "SLO", slo, ABSY, 7, COLD)   \
+  X(0x1C, "NOP", nop, ABSX, 4, COLD)   \
+  X(0x1D, "ORA", ora, ABSX, 4, HOT)    \
+  X(0x1E, "ASL", asl, ABSX, 7, HOT)    \
+  X(0x1F, "SLO", slo, ABSX, 7, COLD)   \
+  X(0x20, "JSR", jsr, ABS,  6, HOT)    \
+  X(0x21, "AND", and, ZPIX, 6, HOT)    \
+  X(0x22, "---", none, NONE, 0, ALIAS) \
+  X(0x23, "RLA", rla, ZPIX, 8, COLD)   \
+  X(0x24, "BIT", bit, ZP,   3, HOT)    \
+  X(0x25, "AND", and, ZP,   3, HOT)    \
+  X(0x26, "ROL", rol, ZP,   5, HOT)    \
+  X(0x27, "RLA", rla, ZP,   5, COLD)   \
+  X(0x28, "PLP", plp, IMPL, 4, HOT)    \
+  X(0x29, "AND", and, IMM,  2, HOT)    \
+  X(0x2A, "ROL", rol, ACCU, 2, HOT)    \
+  X(0x2B, "ANC", anc, IMM,  2, ALIAS)  \
+  X(0x2C, "BIT", bit, ABS,  4, HOT)    \
+  X(0x2D, "AND", and, ABS,  4, HOT)    \
+  X(0x2E, "ROL", rol, ABS,  6, HOT)    \
+  X(0x2F, "RLA", rla, ABS,  6, COLD)   \
+  X(0x30, "BMI", bmi, REL,  2, HOT)    \
+  X(0x31, "AND", and, ZPYI, 5, HOT)    \
+  X(0x32, "---", none, NONE, 0, ALIAS) \
+  X(0x33, "RLA", rla, ZPYI, 8, COLD)   \
+  X(0x34, "NOP", nop, ZPX,  4, ALIAS)  \
+  X(0x35, "AND", and, ZPX,  4, HOT)    \
+  X(0x36, "ROL", rol, ZPX,  6, HOT)    \
+  X(0x37, "RLA", rla, ZPX,  6, COLD)   \
+  X(0x38, "SEC", sec, IMPL, 2, HOT)    \
+  X(0x39, "AND", and, ABSY, 4, HOT)    \
+  X(0x3A, "NOP", nop, IMPL, 2, ALIAS)  \
+  X(0x3B, "RLA", rla, ABSY, 7, COLD)   \
+  X(0x3C, "NOP", nop, ABSX, 4, ALIAS)  \
+  X(0x3D, "AND", and, ABSX, 4, HOT)    \
+  X(0x3E, "ROL", rol, ABSX, 7, HOT)    \
+  X(0x3F, "RLA", rla, ABSX, 7, COLD)   \
+  X(0x40, "RTI", rti, IMPL, 6, HOT)    \
+  X(0x41, "EOR", eor, ZPIX, 6, HOT)    \
+  X(0x42, "---", none, NONE, 0, ALIAS) \
+  X(0x43, "SRE", sre, ZPIX, 8, COLD)   \
+  X(0x44, "NOP", nop, ZP,   3, ALIAS)  \
+  X(0x45, "EOR", eor, ZP,   3, HOT)    \
+  X(0x46, "LSR", lsr, ZP,   5, HOT)    \
+  X(0x47, "SRE", sre, ZP,   5, COLD)   \
+  X(0x48, "PHA", pha, IMPL, 3, HOT)    \
+  X(0x49, "EOR", eor, IMM,  2, HOT)    \
+  X(0x4A, "LSR", lsr, ACCU, 2, HOT)    \
+  X(0x4B, "ALR", alr, IMM,  2, COLD)   \
+  X(0x4C, "JMP", jmp, ABS,  3, HOT)    \
+  X(0x4D, "EOR", eor, ABS,  4, HOT)    \
+  X(0x4E, "LSR", lsr, ABS,  6, HOT)    \
+  X(0x4F, "SRE", sre, ABS,  6, COLD)   \
+  X(0x50, "BVC", bvc, REL,  2, HOT)    \
+  X(0x51, "EOR", eor, ZPYI, 5, HOT)    \
+  X(0x52, "---", none, NONE, 0, ALIAS) \
+  X(0x53, "SRE", sre, ZPYI, 8, COLD)   \
+  X(0x54, "NOP", nop, ZPX,  4, ALIAS)  \
+  X(0x55, "EOR", eor, ZPX,  4, HOT)    \
+  X(0x56, "LSR", lsr, ZPX,  6, HOT)    \
+  X(0x57, "SRE", sre, ZPX,  6, COLD)   \
+  X(0x58, "CLI", cli, IMPL, 2, HOT)    \
+  X(0x59, "EOR", eor, ABSY, 4, HOT)    \
+  X(0x5A, "NOP", nop, IMPL, 2, ALIAS)  \
+  X(0x5B, "SRE", sre, ABSY, 7, COLD)   \
+  X(0x5C, "NOP", nop, ABSX, 4, ALIAS)  \
+  X(0x5D, "EOR", eor, ABSX, 4, HOT)    \
+  X(0x5E, "LSR", lsr, ABSX, 7, HOT)    \
+  X(0x5F, "SRE", sre, ABSX, 7, COLD)   \
+  X(0x60, "RTS", rts, IMPL, 6, HOT)    \
+  X(0x61, "ADC", adc, ZPIX, 6, HOT)    \
+  X(0x62, "---", none, NONE, 0, ALIAS) \
+  X(0x63, "RRA", rra, ZPIX, 8, COLD)   \
+  X(0x64, "NOP", nop, ZP,   3, ALIAS)  \
+  X(0x65, "ADC", adc, ZP,   3, HOT)    \
+  X(0x66, "ROR", ror, ZP,   5, HOT)    \
+  X(0x67, "RRA", rra, ZP,   5, COLD)   \
+  X(0x68, "PLA", pla, IMPL, 4, HOT)    \
+  X(0x69, "ADC", adc, IMM,  2, HOT)    \
+  X(0x6A, "ROR", ror, ACCU, 2, HOT)    \
+  X(0x6B, "ARR", arr, IMM,  2, COLD)   \
+  X(0x6C, "JMP", jmp, ABSI, 5, HOT)    \
+  X(0x6D, "ADC", adc, ABS,  4, HOT)    \
+  X(0x6E, "ROR", ror, ABS,  6, HOT)    \
+  X(0x6F, "RRA", rra, ABS,  6, COLD)   \
+  X(0x70, "BVS", bvs, REL,  2, HOT)    \
+  X(0x71, "ADC", adc, ZPYI, 5, HOT)    \
+  X(0x72, "---", none, NONE, 0, ALIAS) \
+  X(0x73, "RRA", rra, ZPYI, 8, COLD)   \
+  X(0x74, "NOP", nop, ZPX,  4, ALIAS)  \
+  X(0x75, "ADC", adc, ZPX,  4, HOT)    \
+  X(0x76, "ROR", ror, ZPX,  6, HOT)    \
+  X(0x77, "RRA", rra, ZPX,  6, COLD)   \
+  X(0x78, "SEI", sei, IMPL, 2, HOT)    \
+  X(0x79, "ADC", adc, ABSY, 4, HOT)    \
+  X(0x7A, "NOP", nop, IMPL, 2, ALIAS)  \
+  X(0x7B, "RRA", rra, ABSY, 7, COLD)   \
+  X(0x7C, "NOP", nop, ABSX, 4, ALIAS)  \
+  X(0x7D, "ADC", adc, ABSX, 4, HOT)    \
+  X(0x7E, "ROR", ror, ABSX, 7, HOT)    \
+  X(0x7F, "RRA", rra, ABSX, 7, COLD)   \
+  X(0x80, "NOP", nop, IMM,  2, COLD)   \
+  X(0x81, "STA", sta, ZPIX, 6, HOT)    \
+  X(0x82, "NOP", nop, IMM,  2, ALIAS)  \
+  X(0x83, "SAX", sax, ZPIX, 6, COLD)   \
+  X(0x84, "STY", sty, ZP,   3, HOT)    \
+  X(0x85, "STA", sta, ZP,   3, HOT)    \
+  X(0x86, "STX", stx, ZP,   3, HOT)    \
+  X(0x87, "SAX", sax, ZP,   3, COLD)   \
+  X(0x88, "DEY", dey, IMPL, 2, HOT)    \
+  X(0x89, "NOP", nop, IMM,  2, ALIAS)  \
+  X(0x8A, "TXA", txa, IMPL, 2, HOT)    \
+  X(0x8B, "ANE", ane, IMM,  2, COLD)   \
+  X(0x8C, "STY", sty, ABS,  4, HOT)    \
+  X(0x8D, "STA", sta, ABS,  4, HOT)    \
+  X(0x8E, "STX", stx, ABS,  4, HOT)    \
+  X(0x8F, "SAX", sax, ABS,  4, COLD)   \
+  X(0x90, "BCC", bcc, REL,  2, HOT)    \
+  X(0x91, "STA", sta, ZPYI, 6, HOT)    \
+  X(0x92, "---", none, NONE, 0, ALIAS) \
+  X(0x93, "SHA", sha, ZPYI, 6, COLD)   \
+  X(0x94, "STY", sty, ZPX,  4, HOT)    \
+  X(0x95, "STA", sta, ZPX,  4, HOT)    \
+  X(0x96, "STX", stx, ZPY,  4, HOT)    \
+  X(0x97, "SAX", sax, ZPY,  4, COLD)   \
+  X(0x98, "TYA", tya, IMPL, 2, HOT)    \
+  X(0x99, "STA", sta, ABSY, 5, HOT)    \
+  X(0x9A, "TXS", txs, IMPL, 2, HOT)    \
+  X(0x9B, "TAS", tas, ABSY, 5, COLD)   \
+  X(0x9C, "SHY", shy, ABSX, 5, COLD)   \
+  X(0x9D, "STA", sta, ABSX, 5, HOT)    \
+  X(0x9E, "SHX", shx, ABSY, 5, COLD)   \
+  X(0x9F, "SHA", sha, ABSY, 5, COLD)   \
+  X(0xA0, "LDY", ldy, IMM,  2, HOT)    \
+  X(0xA1, "LDA", lda, ZPIX, 6, HOT)    \
+  X(0xA2, "LDX", ldx, IMM,  2, HOT)    \
+  X(0xA3, "LAX", lax, ZPIX, 6, COLD)   \
+  X(0xA4, "LDY", ldy, ZP,   3, HOT)    \
+  X(0xA5, "LDA", lda, ZP,   3, HOT)    \
+  X(0xA6, "LDX", ldx, ZP,   3, HOT)    \
+  X(0xA7, "LAX", lax, ZP,   3, COLD)   \
+  X(0xA8, "TAY", tay, IMPL, 2, HOT)    \
+  X(0xA9, "LDA", lda, IMM,  2, HOT)    \
+  X(0xAA, "TAX", tax, IMPL, 2, HOT)    \
+  X(0xAB, "LXA", lxa, IMM,  2, COLD)   \
+  X(0xAC, "LDY", ldy, ABS,  4, HOT)    \
+  X(0xAD, "LDA", lda, ABS,  4, HOT)    \
+  X(0xAE, "LDX", ldx, ABS,  4, HOT)    \
+  X(0xAF, "LAX", lax, ABS,  4, COLD)   \
+  X(0xB0, "BCS", bcs, REL,  2, HOT)    \
+  X(0xB1, "LDA", lda, ZPYI, 5, HOT)    \
+  X(0xB2, "---", none, NONE, 0, ALIAS) \
+  X(0xB3, "LAX", lax, ZPYI, 5, COLD)   \
+  X(0xB4, "LDY", ldy, ZPX,  4, HOT)    \
+  X(0xB5, "LDA", lda, ZPX,  4, HOT)    \
+  X(0xB6, "LDX", ldx, ZPY,  4, HOT)    \
+  X(0xB7, "LAX", lax, ZPY,  4, COLD)   \
+  X(0xB8, "CLV", clv, IMPL, 2, HOT)    \
+  X(0xB9, "LDA", lda, ABSY, 4, HOT)    \
+  X(0xBA, "TSX", tsx, IMPL, 2, HOT)    \
+  X(0xBB, "LAS", las, ABSY, 4, COLD)   \
+  X(0xBC, "LDY", ldy, ABSX, 4, HOT)    \
+  X(0xBD, "LDA", lda, ABSX, 4, HOT)    \
+  X(0xBE, "LDX", ldx, ABSY, 4, HOT)    \
+  X(0xBF, "LAX", lax, ABSY, 4, COLD)   \
+  X(0xC0, "CPY", cpy, IMM,  2, HOT)    \
+  X(0xC1, "CMP", cmp, ZPIX, 6, HOT)    \
+  X(0xC2, "NOP", nop, IMM,  2, ALIAS)  \
+  X(0xC3, "DCP", dcp, ZPIX, 8, COLD)   \
+  X(0xC4, "CPY", cpy, ZP,   3, HOT)    \
+  X(0xC5, "CMP", cmp, ZP,   3, HOT)    \
+  X(0xC6, "DEC", dec, ZP,   5, HOT)    \
+  X(0xC7, "DCP", dcp, ZP,   5, COLD)   \
+  X(0xC8, "INY", iny, IMPL, 2, HOT)    \
+  X(0xC9, "CMP", cmp, IMM,  2, HOT)    \
+  X(0xCA, "DEX", dex, IMPL, 2, HOT)    \
+  X(0xCB, "SBX", sbx, IMM,  2, COLD)   \
+  X(0xCC, "CPY", cpy, ABS,  4, HOT)    \
+  X(0xCD, "CMP", cmp, ABS,  4, HOT)    \
+  X(0xCE, "DEC", dec, ABS,  6, HOT)    \
+  X(0xCF, "DCP", dcp, ABS,  6, COLD)   \
+  X(0xD0, "BNE", bne, REL,  2, HOT)    \
+  X(0xD1, "CMP", cmp, ZPYI, 5, HOT)    \
+  X(0xD2, "---", none, NONE, 0, ALIAS) \
+  X(0xD3, "DCP", dcp, ZPYI, 8, COLD)   \
+  X(0xD4, "NOP", nop, ZPX,  4, ALIAS)  \
+  X(0xD5, "CMP", cmp, ZPX,  4, HOT)    \
+  X(0xD6, "DEC", dec, ZPX,  6, HOT)    \
+  X(0xD7, "DCP", dcp, ZPX,  6, COLD)   \
+  X(0xD8, "CLD", cld, IMPL, 2, HOT)    \
+  X(0xD9, "CMP", cmp, ABSY, 4, HOT)    \
+  X(0xDA, "NOP", nop, IMPL, 2, ALIAS)  \
+  X(0xDB, "DCP", dcp, ABSY, 7, COLD)   \
+  X(0xDC, "NOP", nop, ABSX, 4, ALIAS)  \
+  X(0xDD, "CMP", cmp, ABSX, 4, HOT)    \
+  X(0xDE, "DEC", dec, ABSX, 7, HOT)    \
+  X(0xDF, "DCP", dcp, ABSX, 7, COLD)   \
+  X(0xE0, "CPX", cpx, IMM,  2, HOT)    \
+  X(0xE1, "SBC", sbc, ZPIX, 6, HOT)    \
+  X(0xE2, "NOP", nop, IMM,  2, ALIAS)  \
+  X(0xE3, "ISC", isc, ZPIX, 8, COLD)   \
+  X(0xE4, "CPX", cpx, ZP,   3, HOT)    \
+  X(0xE5, "SBC", sbc, ZP,   3, HOT)    \
+  X(0xE6, "INC", inc, ZP,   5, HOT)    \
+  X(0xE7, "ISC", isc, ZP,   5, COLD)   \
+  X(0xE8, "INX", inx, IMPL, 2, HOT)    \
+  X(0xE9, "SBC", sbc, IMM,  2, HOT)    \
+  X(0xEA, "NOP", nop, IMPL, 2, HOT)    \
+  X(0xEB, "SBC", usbc, IMM,  2, COLD)  \
+  X(0xEC, "CPX", cpx, ABS,  4, HOT)    \
+  X(0xED, "SBC", sbc, ABS,  4, HOT)    \
+  X(0xEE, "INC", inc, ABS,  6, HOT)    \
+  X(0xEF, "ISC", isc, ABS,  6, COLD)   \
+  X(0xF0, "BEQ", beq, REL,  2, HOT)    \
+  X(0xF1, "SBC", sbc, ZPYI, 5, HOT)    \
+  X(0xF2, "---", none, NONE, 0, ALIAS) \
+  X(0xF3, "ISC", isc, ZPYI, 8, COLD)   \
+  X(0xF4, "NOP", nop, ZPX,  4, ALIAS)  \
+  X(0xF5, "SBC", sbc, ZPX,  4, HOT)    \
+  X(0xF6, "INC", inc, ZPX,  6, HOT)    \
+  X(0xF7, "ISC", isc, ZPX,  6, COLD)   \
+  X(0xF8, "SED", sed, IMPL, 2, HOT)    \
+  X(0xF9, "SBC", sbc, ABSY, 4, HOT)    \
+  X(0xFA, "NOP", nop, IMPL, 2, ALIAS)  \
+  X(0xFB, "ISC", isc, ABSY, 7, COLD)   \
+  X(0xFC, "NOP", nop, ABSX, 4, ALIAS)  \
+  X(0xFD, "SBC", sbc, ABSX, 4, HOT)    \
+  X(0xFE, "INC", inc, ABSX, 7, HOT)    \
+  X(0xFF, "ISC", isc, ABSX, 7, COLD)
+
+
+#define OPCODE_ADDRESS_MODE(opcode, mnemonic, operation, mode, cycles, class) \
+  [opcode] = AM_##mode,
+#define OPCODE_MNEMONIC(opcode, mnemonic, operation, mode, cycles, class) \
+  [opcode] = mnemonic,
 
 static cpu_address_mode_t opcode_address_mode[UINT8_MAX + 1] = {
-  AM_IMPL, AM_ZPIX, AM_NONE, AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_ACCU, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPX,  AM_ZPX,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSX, AM_ABSX,
-  AM_ABS,  AM_ZPIX, AM_NONE, AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_ACCU, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPX,  AM_ZPX,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSX, AM_ABSX,
-  AM_IMPL, AM_ZPIX, AM_NONE, AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_ACCU, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPX,  AM_ZPX,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSX, AM_ABSX,
-  AM_IMPL, AM_ZPIX, AM_NONE, AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_ACCU, AM_IMM,  AM_ABSI, AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPX,  AM_ZPX,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSX, AM_ABSX,
-  AM_IMM,  AM_ZPIX, AM_IMM,  AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_IMPL, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPY,  AM_ZPY,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSY, AM_ABSY,
-  AM_IMM,  AM_ZPIX, AM_IMM,  AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_IMPL, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPY,  AM_ZPY,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSY, AM_ABSY,
-  AM_IMM,  AM_ZPIX, AM_IMM,  AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_IMPL, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPX,  AM_ZPX,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSX, AM_ABSX,
-  AM_IMM,  AM_ZPIX, AM_IMM,  AM_ZPIX, AM_ZP,   AM_ZP,   AM_ZP,   AM_ZP,
-  AM_IMPL, AM_IMM,  AM_IMPL, AM_IMM,  AM_ABS,  AM_ABS,  AM_ABS,  AM_ABS,
-  AM_REL,  AM_ZPYI, AM_NONE, AM_ZPYI, AM_ZPX,  AM_ZPX,  AM_ZPX,  AM_ZPX,
-  AM_IMPL, AM_ABSY, AM_IMPL, AM_ABSY, AM_ABSX, AM_ABSX, AM_ABSX, AM_ABSX,
+  CPU_OPCODE_TABLE(OPCODE_ADDRESS_MODE)
 };
 
 static char *opcode_mnemonic[UINT8_MAX + 1] = {
-  "BRK", "ORA", "---", "SLO", "NOP", "ORA", "ASL", "SLO",
-  "PHP", "ORA", "ASL", "ANC", "NOP", "ORA", "ASL", "SLO",
-  "BPL", "ORA", "---", "SLO", "NOP", "ORA", "ASL", "SLO",
-  "CLC", "ORA", "NOP", "SLO", "NOP", "ORA", "ASL", "SLO",
-  "JSR", "AND", "---", "RLA", "BIT", "AND", "ROL", "RLA",
-  "PLP", "AND", "ROL", "ANC", "BIT", "AND", "ROL", "RLA",
-  "BMI", "AND", "---", "RLA", "NOP", "AND", "ROL", "RLA",
-  "SEC", "AND", "NOP", "RLA", "NOP", "AND", "ROL", "RLA",
-  "RTI", "EOR", "---", "SRE", "NOP", "EOR", "LSR", "SRE",
-  "PHA", "EOR", "LSR", "ALR", "JMP", "EOR", "LSR", "SRE",
-  "BVC", "EOR", "---", "SRE", "NOP", "EOR", "LSR", "SRE",
-  "CLI", "EOR", "NOP", "SRE", "NOP", "EOR", "LSR", "SRE",
-  "RTS", "ADC", "---", "RRA", "NOP", "ADC", "ROR", "RRA",
-  "PLA", "ADC", "ROR", "ARR", "JMP", "ADC", "ROR", "RRA",
-  "BVS", "ADC", "---", "RRA", "NOP", "ADC", "ROR", "RRA",
-  "SEI", "ADC", "NOP", "RRA", "NOP", "ADC", "ROR", "RRA",
-  "NOP", "STA", "NOP", "SAX", "STY", "STA", "STX", "SAX",
-  "DEY", "NOP", "TXA", "ANE", "STY", "STA", "STX", "SAX",
-  "BCC", "STA", "---", "SHA", "STY", "STA", "STX", "SAX",
-  "TYA", "STA", "TXS", "TAS", "SHY", "STA", "SHX", "SHA",
-  "LDY", "LDA", "LDX", "LAX", "LDY", "LDA", "LDX", "LAX",
-  "TAY", "LDA", "TAX", "LXA", "LDY", "LDA", "LDX", "LAX",
-  "BCS", "LDA", "---", "LAX", "LDY", "LDA", "LDX", "LAX",
-  "CLV", "LDA", "TSX", "LAS", "LDY", "LDA", "LDX", "LAX",
-  "CPY", "CMP", "NOP", "DCP", "CPY", "CMP", "DEC", "DCP",
-  "INY", "CMP", "DEX", "SBX", "CPY", "CMP", "DEC", "DCP",
-  "BNE", "CMP", "---", "DCP", "NOP", "CMP", "DEC", "DCP",
-  "CLD", "CMP", "NOP", "DCP", "NOP", "CMP", "DEC", "DCP",
-  "CPX", "SBC", "NOP", "ISC", "CPX", "SBC", "INC", "ISC",
-  "INX", "SBC", "NOP", "SBC", "CPX", "SBC", "INC", "ISC",
-  "BEQ", "SBC", "---", "ISC", "NOP", "SBC", "INC", "ISC",
-  "SED", "SBC", "NOP", "ISC", "NOP", "SBC", "INC", "ISC",
+  CPU_OPCODE_TABLE(OPCODE_MNEMONIC)
 };
 
 static cpu_opcode_handler_t cpu_trap_opcode_handler = NULL;
 
-static cpu_trace_t cpu_trace_buffer[CPU_TRACE_BUFFER_SIZE];
-static int cpu_trace_index = 0;
+static uint8_t cpu_break_map[(UINT16_MAX + 1) / 8];
+static bool cpu_break_page[UINT8_MAX + 1]; /* Pages with any breakpoint. */
+static uint32_t cpu_break_count = 0;
+static uint16_t cpu_break_pc; /* Where the last run was stopped. */
+static bool cpu_break_resume = false; /* Not stopping there again at once. */
+static bool cpu_break_stopped = false;
+
+static cpu_trace_t *cpu_trace_buffer = NULL;
+static uint32_t cpu_trace_size = 0;
+static uint32_t cpu_trace_index = 0;
+static uint32_t cpu_trace_count = 0; /* Entries filled so far. */
+static bool cpu_trace_ring = false;
+static bool cpu_trace_stream = false;
+static bool cpu_trace_on = false; /* To the ring or the stream. */
+
+static cpu_decoded_t cpu_decoded[UINT16_MAX + 1];
+
+static cpu_idle_t cpu_idle;
+
+#ifdef CPU_RECOMP
+static bool cpu_recomp_enabled = false;
+static void cpu_recomp_check(mem_t *mem);
+#endif
+
+#ifdef CPU_HISTOGRAM
+static cpu_histogram_t cpu_histogram[UINT8_MAX + 1];
+static bool cpu_histogram_crossed = false;
+
+static const char *address_mode_name[AM_NONE + 1] = {
+  "accu", "impl", "imm", "abs", "absi", "absx", "absy",
+  "rel", "zp", "zpx", "zpy", "zpyi", "zpix", "none",
+};
+
+/* The cycles of an instruction are counted when its handler returns, as
+   the difference to the cycle count at the start of it. */
+#define CPU_HISTOGRAM_PAGE_CROSS cpu_histogram_crossed = true;
+#define CPU_HISTOGRAM_COUNT(opcode, start) \
+  cpu_histogram[opcode].count++; \
+  cpu_histogram[opcode].cycles += cpu->cycles - (start); \
+  if (cpu_histogram_crossed) { \
+    cpu_histogram[opcode].page_cross++; \
+    cpu_histogram_crossed = false; \
+  }
+#else
+#define CPU_HISTOGRAM_PAGE_CROSS
+#define CPU_HISTOGRAM_COUNT(opcode, start)
+#endif /* CPU_HISTOGRAM */
 
 
 
-static void cpu_dump_disassemble(FILE *fh, uint16_t pc, uint8_t mc[3])
+static void cpu_dump_disassemble(FILE *fh, uint16_t pc, const uint8_t mc[3])
 {
   uint16_t address;
   int8_t relative;
@@ -223,7 +540,7 @@ void cpu_trap_opcode(uint8_t opcode, cpu_opcode_handler_t handler)
 
 
 
-static void cpu_register_dump(FILE *fh, cpu_t *cpu, uint8_t mc[3])
+void cpu_register_dump(FILE *fh, cpu_t *cpu, const uint8_t mc[3])
 {
   fprintf(fh, ".C:%04x  ", cpu->pc);
   cpu_dump_disassemble(fh, cpu->pc, mc);
@@ -232,135 +549,301 @@ static void cpu_register_dump(FILE *fh, cpu_t *cpu, uint8_t mc[3])
   fprintf(fh, "X:%02X ", cpu->x);
   fprintf(fh, "Y:%02X ", cpu->y);
   fprintf(fh, "SP:%02x ", cpu->sp);
-  fprintf(fh, "%c", (cpu->sr.n) ? 'N' : '.');
-  fprintf(fh, "%c", (cpu->sr.v) ? 'V' : '.');
+  fprintf(fh, "%c", (cpu->n_result & CPU_FLAG_N) ? 'N' : '.');
+  fprintf(fh, "%c", (cpu->sr & CPU_FLAG_V) ? 'V' : '.');
   fprintf(fh, "-");
-  fprintf(fh, "%c", (cpu->sr.b) ? 'B' : '.');
-  fprintf(fh, "%c", (cpu->sr.d) ? 'D' : '.');
-  fprintf(fh, "%c", (cpu->sr.i) ? 'I' : '.');
-  fprintf(fh, "%c", (cpu->sr.z) ? 'Z' : '.');
-  fprintf(fh, "%c", (cpu->sr.c) ? 'C' : '.');
+  fprintf(fh, "%c", (cpu->sr & CPU_FLAG_B) ? 'B' : '.');
+  fprintf(fh, "%c", (cpu->sr & CPU_FLAG_D) ? 'D' : '.');
+  fprintf(fh, "%c", (cpu->sr & CPU_FLAG_I) ? 'I' : '.');
+  fprintf(fh, "%c", (cpu->z_result == 0) ? 'Z' : '.');
+  fprintf(fh, "%c", (cpu->sr & CPU_FLAG_C) ? 'C' : '.');
   fprintf(fh, "\n");
 }
 
 
 
-void cpu_trace_init(void)
+int cpu_trace_init(uint32_t size)
+{
+  /* Idle loop skipping repeats whole iterations from the ring. */
+  if (size < CPU_IDLE_LOOP_SIZE) {
+    size = CPU_IDLE_LOOP_SIZE;
+  }
+
+  free(cpu_trace_buffer);
+  cpu_trace_buffer = calloc(size, sizeof(cpu_trace_t));
+  cpu_trace_size = 0;
+  cpu_trace_index = 0;
+  cpu_trace_count = 0;
+  if (cpu_trace_buffer == NULL) {
+    cpu_trace_ring = false;
+    cpu_trace_on = cpu_trace_stream;
+    return -1;
+  }
+  cpu_trace_size = size;
+  return 0;
+}
+
+
+
+/* The run loops only check the flag, and translated code only calls the
+   trace when it was enabled at translation, so blocks are flushed. */
+void cpu_trace_enable(bool enable)
+{
+  cpu_trace_ring = enable && (cpu_trace_buffer != NULL);
+  cpu_trace_on = cpu_trace_ring || cpu_trace_stream;
+#ifdef CPU_DYNAREC
+  dynarec_flush();
+#endif
+}
+
+
+
+/* Same as cpu_trace_enable() but for the stream to trace_write(). */
+void cpu_trace_stream_enable(bool enable)
+{
+  cpu_trace_stream = enable;
+  cpu_trace_on = cpu_trace_ring || cpu_trace_stream;
+#ifdef CPU_DYNAREC
+  dynarec_flush();
+#endif
+}
+
+
+
+bool cpu_trace_enabled(void)
+{
+  return cpu_trace_ring;
+}
+
+
+
+bool cpu_trace_active(void)
+{
+  return cpu_trace_on;
+}
+
+
+
+uint32_t cpu_trace_entries(void)
 {
-  memset(cpu_trace_buffer, 0, CPU_TRACE_BUFFER_SIZE * sizeof(cpu_trace_t));
+  return cpu_trace_size;
 }
 
 
 
 void cpu_trace_dump(FILE *fh)
 {
-  int i;
+  cpu_trace_t *trace;
+  cpu_t cpu;
+  uint32_t index;
+  uint32_t i;
+
+  if (cpu_trace_count == 0) {
+    fprintf(fh, "(Empty, %s)\n", cpu_trace_on ? "enabled" : "disabled");
+    return;
+  }
+
+  memset(&cpu, 0, sizeof(cpu_t));
+  index = (cpu_trace_index + cpu_trace_size - cpu_trace_count + 1) %
+    cpu_trace_size;
+  for (i = 0; i < cpu_trace_count; i++) {
+    trace = &cpu_trace_buffer[index];
+    cpu.pc = trace->pc;
+    cpu.a = trace->a;
+    cpu.x = trace->x;
+    cpu.y = trace->y;
+    cpu.sp = trace->sp;
+    cpu.sr = trace->sr;
+    cpu.n_result = trace->n_result;
+    cpu.z_result = trace->z_result;
+    cpu_register_dump(fh, &cpu, trace->mc);
+    index++;
+    if (index >= cpu_trace_size) {
+      index = 0;
+    }
+  }
+}
+
 
-  for (i = 0; i < CPU_TRACE_BUFFER_SIZE; i++) {
+
+/* Adds to the ring and the stream, whichever is enabled. */
+static void cpu_trace_store(cpu_t *cpu, const uint8_t mc[3])
+{
+  cpu_trace_t *trace;
+
+  if (cpu_trace_ring) {
     cpu_trace_index++;
-    if (cpu_trace_index >= CPU_TRACE_BUFFER_SIZE) {
+    if (cpu_trace_index >= cpu_trace_size) {
       cpu_trace_index = 0;
     }
-    cpu_register_dump(fh, &cpu_trace_buffer[cpu_trace_index].cpu,
-                           cpu_trace_buffer[cpu_trace_index].mc);
+    if (cpu_trace_count < cpu_trace_size) {
+      cpu_trace_count++;
+    }
+
+    trace = &cpu_trace_buffer[cpu_trace_index];
+    trace->pc = cpu->pc;
+    trace->a = cpu->a;
+    trace->x = cpu->x;
+    trace->y = cpu->y;
+    trace->sp = cpu->sp;
+    trace->sr = cpu->sr;
+    trace->n_result = cpu->n_result;
+    trace->z_result = cpu->z_result;
+    trace->mc[0] = mc[0];
+    trace->mc[1] = mc[1];
+    trace->mc[2] = mc[2];
+  }
+
+  if (cpu_trace_stream) {
+    trace_write(cpu, mc);
   }
 }
 
 
 
-void cpu_trace_add(cpu_t *cpu, mem_t *mem)
+/* For translated code, with the bytes taken straight from the memory it
+   was translated from. Only the bytes of the instruction are read. */
+void cpu_trace_bytes(cpu_t *cpu, const uint8_t *code)
+{
+  uint8_t mc[3];
+  int size;
+
+  size = cpu_opcode_size(code[0]);
+  mc[0] = code[0];
+  mc[1] = (size > 1) ? code[1] : 0;
+  mc[2] = (size > 2) ? code[2] : 0;
+  cpu_trace_store(cpu, mc);
+}
+
+
+
+void cpu_state_dump(FILE *fh, cpu_t *cpu, mem_t *mem)
 {
   uint8_t mc[3];
 
-  cpu_trace_index++;
-  if (cpu_trace_index >= CPU_TRACE_BUFFER_SIZE) {
-    cpu_trace_index = 0;
+  mc[0] = mem_read_code(mem, cpu->pc);
+  mc[1] = mem_read_code(mem, cpu->pc + 1);
+  mc[2] = mem_read_code(mem, cpu->pc + 2);
+  cpu_register_dump(fh, cpu, mc);
+}
+
+
+
+bool cpu_break_at(uint16_t address)
+{
+  return cpu_break_page[address / 256] &&
+    (cpu_break_map[address / 8] & (1 << (address % 8)));
+}
+
+
+
+/* Called before an instruction with a breakpoint, returns true if the run
+   stops there. Continuing from a stop runs the instruction, and when the
+   PC was moved by an interrupt, it is run on the return instead. */
+CPU_COLD static bool cpu_break_stop(cpu_t *cpu)
+{
+  if (! cpu_break_at(cpu->pc)) {
+    return false;
+  }
+
+  if (cpu_break_resume && cpu->pc == cpu_break_pc) {
+    cpu_break_resume = false;
+    return false;
   }
 
-  memcpy(&cpu_trace_buffer[cpu_trace_index].cpu, cpu, sizeof(cpu_t));
-  mc[0] = mem_read(mem, cpu->pc);
-  mc[1] = mem_read(mem, cpu->pc + 1);
-  mc[2] = mem_read(mem, cpu->pc + 2);
-  memcpy(&cpu_trace_buffer[cpu_trace_index].mc, mc, sizeof(uint8_t) * 3);
+  cpu_break_pc = cpu->pc;
+  cpu_break_resume = true;
+  cpu_break_stopped = true;
+  return true;
 }
 
 
 
-static uint8_t cpu_status_get(cpu_t *cpu, bool b_flag)
+/* Returns true if the last run stopped at a breakpoint. */
+bool cpu_break_hit(void)
 {
-  return ((cpu->sr.n << 7) +
-          (cpu->sr.v << 6) +
-          (1         << 5) +
-          (b_flag    << 4) +
-          (cpu->sr.d << 3) +
-          (cpu->sr.i << 2) +
-          (cpu->sr.z << 1) +
-           cpu->sr.c);
+  bool stopped;
+
+  stopped = cpu_break_stopped;
+  cpu_break_stopped = false;
+  return stopped;
 }
 
 
 
-static void cpu_status_set(cpu_t *cpu, uint8_t flags)
+void cpu_break_dump(FILE *fh)
 {
-  cpu->sr.n = (flags >> 7) & 0x1;
-  cpu->sr.v = (flags >> 6) & 0x1;
-  cpu->sr.b = 0;
-  cpu->sr.d = (flags >> 3) & 0x1;
-  cpu->sr.i = (flags >> 2) & 0x1;
-  cpu->sr.z = (flags >> 1) & 0x1;
-  cpu->sr.c =  flags       & 0x1;
+  int i;
+
+  for (i = 0; i <= UINT16_MAX; i++) {
+    if (cpu_break_at(i)) {
+      fprintf(fh, "Breakpoint: $%04x\n", i);
+    }
+  }
 }
 
 
 
-static inline void cpu_flag_zero_other(cpu_t *cpu, uint8_t value)
+static inline void cpu_flag_set(cpu_t *cpu, uint8_t flag, bool value)
 {
-  if (value == 0) {
-    cpu->sr.z = 1;
+  if (value) {
+    cpu->sr |= flag;
   } else {
-    cpu->sr.z = 0;
+    cpu->sr &= ~flag;
   }
 }
 
+
+
+/* N and Z are only evaluated here, from the last results that set them. */
+static inline uint8_t cpu_status_get(cpu_t *cpu, bool b_flag)
+{
+  return (cpu->sr & (CPU_FLAG_V | CPU_FLAG_D | CPU_FLAG_I | CPU_FLAG_C)) |
+         (cpu->n_result & CPU_FLAG_N) |
+         ((cpu->z_result == 0) ? CPU_FLAG_Z : 0) |
+         (1 << 5) |
+         (b_flag << 4);
+}
+
+
+
+static inline void cpu_status_set(cpu_t *cpu, uint8_t flags)
+{
+  cpu->sr = flags & (CPU_FLAG_V | CPU_FLAG_D | CPU_FLAG_I | CPU_FLAG_C);
+  cpu->n_result = flags;
+  cpu->z_result = (flags & CPU_FLAG_Z) ? 0 : 1;
+}
+
+
+
+static inline void cpu_flag_zero_other(cpu_t *cpu, uint8_t value)
+{
+  cpu->z_result = value;
+}
+
 static inline void cpu_flag_negative_other(cpu_t *cpu, uint8_t value)
 {
-  if ((value >> 7) == 1) {
-    cpu->sr.n = 1;
-  } else {
-    cpu->sr.n = 0;
-  }
+  cpu->n_result = value;
 }
 
 static inline void cpu_flag_zero_compare(cpu_t *cpu, uint8_t a, uint8_t b)
 {
-  if (a == b) {
-    cpu->sr.z = 1;
-  } else {
-    cpu->sr.z = 0;
-  }
+  cpu->z_result = a - b;
 }
 
 static inline void cpu_flag_negative_compare(cpu_t *cpu, uint8_t a, uint8_t b)
 {
-  if (((uint8_t)(a - b) >> 7) == 1) {
-    cpu->sr.n = 1;
-  } else {
-    cpu->sr.n = 0;
-  }
+  cpu->n_result = a - b;
 }
 
 static inline void cpu_flag_carry_compare(cpu_t *cpu, uint8_t a, uint8_t b)
 {
-  if (a >= b) {
-    cpu->sr.c = 1;
-  } else {
-    cpu->sr.c = 0;
-  }
+  cpu_flag_set(cpu, CPU_FLAG_C, a >= b);
 }
 
 static inline bool cpu_flag_carry_add(cpu_t *cpu, uint8_t value)
 {
-  if (cpu->a + value + cpu->sr.c > 0xFF) {
+  if (cpu->a + value + (cpu->sr & CPU_FLAG_C) > 0xFF) {
     return 1;
   } else {
     return 0;
@@ -370,7 +853,7 @@ static inline bool cpu_flag_carry_add(cpu_t *cpu, uint8_t value)
 static inline bool cpu_flag_carry_sub(cpu_t *cpu, uint8_t value)
 {
   bool borrow;
-  if (cpu->sr.c == 0) {
+  if ((cpu->sr & CPU_FLAG_C) == 0) {
     borrow = 1;
   } else {
     borrow = 0;
@@ -384,116 +867,175 @@ static inline bool cpu_flag_carry_sub(cpu_t *cpu, uint8_t value)
 
 static inline void cpu_flag_overflow_add(cpu_t *cpu, uint8_t a, uint8_t b)
 {
-  if (a >> 7 == b >> 7) {
-    if (cpu->a >> 7 != a >> 7) {
-      cpu->sr.v = 1;
-    } else {
-      cpu->sr.v = 0;
-    }
-  } else {
-    cpu->sr.v = 0;
-  }
+  cpu_flag_set(cpu, CPU_FLAG_V, (a >> 7 == b >> 7) && (cpu->a >> 7 != a >> 7));
 }
 
 static inline void cpu_flag_overflow_sub(cpu_t *cpu, uint8_t a, uint8_t b)
 {
-  if (a >> 7 != b >> 7) {
-    if (cpu->a >> 7 != a >> 7) {
-      cpu->sr.v = 1;
-    } else {
-      cpu->sr.v = 0;
-    }
-  } else {
-    cpu->sr.v = 0;
-  }
+  cpu_flag_set(cpu, CPU_FLAG_V, (a >> 7 != b >> 7) && (cpu->a >> 7 != a >> 7));
 }
 
 static inline void cpu_flag_overflow_bit(cpu_t *cpu, uint8_t value)
 {
-  if (((value >> 6) & 0x1) == 1) {
-    cpu->sr.v = 1;
-  } else {
-    cpu->sr.v = 0;
-  }
+  cpu_flag_set(cpu, CPU_FLAG_V, (value >> 6) & 0x1);
+}
+
+
+
+/* Operand bytes come from the decoded instruction, not from memory. */
+static inline uint8_t cpu_fetch(cpu_t *cpu, mem_t *mem)
+{
+  (void)mem;
+  cpu->pc++;
+  return *cpu->operand++;
 }
 
 
 
 #define OP_PROLOGUE_ABS \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256;
+  absolute  = cpu_fetch(cpu, mem); \
+  absolute += cpu_fetch(cpu, mem) * 256;
 
 #define OP_PROLOGUE_ABSX \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
+  absolute  = cpu_fetch(cpu, mem); \
+  absolute += cpu_fetch(cpu, mem) * 256; \
   absolute += cpu->x;
 
 #define OP_PROLOGUE_ABSY \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
+  absolute  = cpu_fetch(cpu, mem); \
+  absolute += cpu_fetch(cpu, mem) * 256; \
   absolute += cpu->y; \
 
 #define OP_PROLOGUE_ZP \
   uint8_t zeropage; \
-  zeropage = mem_read(mem, cpu->pc++); \
+  zeropage = cpu_fetch(cpu, mem); \
 
 #define OP_PROLOGUE_ZPX \
   uint8_t zeropage; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = cpu_fetch(cpu, mem); \
   zeropage += cpu->x;
 
 #define OP_PROLOGUE_ZPY \
   uint8_t zeropage; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = cpu_fetch(cpu, mem); \
   zeropage += cpu->y;
 
 #define OP_PROLOGUE_ZPYI \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
-  absolute  = mem_read(mem, zeropage); \
+  zeropage  = cpu_fetch(cpu, mem); \
+  absolute  = mem_read_zp(mem, zeropage); \
   zeropage += 1; \
-  absolute += mem_read(mem, zeropage) * 256; \
+  absolute += mem_read_zp(mem, zeropage) * 256; \
   absolute += cpu->y;
 
 #define OP_PROLOGUE_ZPIX \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
+  zeropage  = cpu_fetch(cpu, mem); \
   zeropage += cpu->x; \
-  absolute  = mem_read(mem, zeropage); \
+  absolute  = mem_read_zp(mem, zeropage); \
   zeropage += 1; \
-  absolute += mem_read(mem, zeropage) * 256;
+  absolute += mem_read_zp(mem, zeropage) * 256;
 
 #define OP_PROLOGUE_ABSX_BOUNDARY_CHECK \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
-  if ((absolute & 0xFF00) != ((absolute + cpu->x) & 0xFF00)) cpu->cycles++; \
+  absolute  = cpu_fetch(cpu, mem); \
+  absolute += cpu_fetch(cpu, mem) * 256; \
+  if ((absolute & 0xFF00) != ((absolute + cpu->x) & 0xFF00)) { \
+    cpu->cycles++; \
+    CPU_HISTOGRAM_PAGE_CROSS \
+  } \
   absolute += cpu->x;
 
 #define OP_PROLOGUE_ABSY_BOUNDARY_CHECK \
   uint16_t absolute; \
-  absolute  = mem_read(mem, cpu->pc++); \
-  absolute += mem_read(mem, cpu->pc++) * 256; \
-  if ((absolute & 0xFF00) != ((absolute + cpu->y) & 0xFF00)) cpu->cycles++; \
+  absolute  = cpu_fetch(cpu, mem); \
+  absolute += cpu_fetch(cpu, mem) * 256; \
+  if ((absolute & 0xFF00) != ((absolute + cpu->y) & 0xFF00)) { \
+    cpu->cycles++; \
+    CPU_HISTOGRAM_PAGE_CROSS \
+  } \
   absolute += cpu->y; \
 
 #define OP_PROLOGUE_ZPYI_BOUNDARY_CHECK \
   uint8_t zeropage; \
   uint16_t absolute; \
-  zeropage  = mem_read(mem, cpu->pc++); \
-  absolute  = mem_read(mem, zeropage); \
+  zeropage  = cpu_fetch(cpu, mem); \
+  absolute  = mem_read_zp(mem, zeropage); \
   zeropage += 1; \
-  absolute += mem_read(mem, zeropage) * 256; \
-  if ((absolute & 0xFF00) != ((absolute + cpu->y) & 0xFF00)) cpu->cycles++; \
+  absolute += mem_read_zp(mem, zeropage) * 256; \
+  if ((absolute & 0xFF00) != ((absolute + cpu->y) & 0xFF00)) { \
+    cpu->cycles++; \
+    CPU_HISTOGRAM_PAGE_CROSS \
+  } \
   absolute += cpu->y;
 
 
 
+#define OP_PROLOGUE_IMPL \
+  (void)mem;
+
+#define OP_PROLOGUE_ACCU \
+  (void)mem;
+
+#define OP_PROLOGUE_IMM \
+  uint8_t immediate = cpu_fetch(cpu, mem);
+
+#define OP_PROLOGUE_REL \
+  int8_t relative = cpu_fetch(cpu, mem);
+
+#define OP_PROLOGUE_ABSI OP_PROLOGUE_ABS
+
+/* Only the indexed modes above can cross a page boundary. */
+#define OP_PROLOGUE_IMPL_BOUNDARY_CHECK OP_PROLOGUE_IMPL
+#define OP_PROLOGUE_IMM_BOUNDARY_CHECK OP_PROLOGUE_IMM
+#define OP_PROLOGUE_ABS_BOUNDARY_CHECK OP_PROLOGUE_ABS
+#define OP_PROLOGUE_ZP_BOUNDARY_CHECK OP_PROLOGUE_ZP
+#define OP_PROLOGUE_ZPX_BOUNDARY_CHECK OP_PROLOGUE_ZPX
+#define OP_PROLOGUE_ZPY_BOUNDARY_CHECK OP_PROLOGUE_ZPY
+#define OP_PROLOGUE_ZPIX_BOUNDARY_CHECK OP_PROLOGUE_ZPIX
+
+#define OP_PROLOGUE(mode) OP_PROLOGUE_##mode
+#define OP_PROLOGUE_BOUNDARY_CHECK(mode) OP_PROLOGUE_##mode##_BOUNDARY_CHECK
+
+/* The operand of each addressing mode, once its prologue has run. */
+#define OP_READ(mode) OP_READ_##mode
+#define OP_READ_ACCU cpu->a
+#define OP_READ_IMM immediate
+#define OP_READ_ABS mem_read(mem, absolute)
+#define OP_READ_ABSX mem_read(mem, absolute)
+#define OP_READ_ABSY mem_read(mem, absolute)
+#define OP_READ_ZP mem_read_zp(mem, zeropage)
+#define OP_READ_ZPX mem_read_zp(mem, zeropage)
+#define OP_READ_ZPY mem_read_zp(mem, zeropage)
+#define OP_READ_ZPYI mem_read(mem, absolute)
+#define OP_READ_ZPIX mem_read(mem, absolute)
+
+#define OP_WRITE(mode, value) OP_WRITE_##mode(value)
+#define OP_WRITE_ACCU(value) cpu->a = (value)
+#define OP_WRITE_ABS(value) mem_write(mem, absolute, value)
+#define OP_WRITE_ABSX(value) mem_write(mem, absolute, value)
+#define OP_WRITE_ABSY(value) mem_write(mem, absolute, value)
+#define OP_WRITE_ZP(value) mem_write_zp(mem, zeropage, value)
+#define OP_WRITE_ZPX(value) mem_write_zp(mem, zeropage, value)
+#define OP_WRITE_ZPY(value) mem_write_zp(mem, zeropage, value)
+#define OP_WRITE_ZPYI(value) mem_write(mem, absolute, value)
+#define OP_WRITE_ZPIX(value) mem_write(mem, absolute, value)
+
+#define OP_UNUSED(mode) OP_UNUSED_##mode
+#define OP_UNUSED_IMPL (void)cpu;
+#define OP_UNUSED_IMM (void)immediate;
+#define OP_UNUSED_ABS (void)absolute;
+#define OP_UNUSED_ABSX (void)absolute;
+#define OP_UNUSED_ZP (void)zeropage;
+#define OP_UNUSED_ZPX (void)zeropage;
+
+
+
 static inline void cpu_logic_adc(cpu_t *cpu, uint8_t value)
 {
   uint8_t initial;
@@ -501,8 +1043,8 @@ static inline void cpu_logic_adc(cpu_t *cpu, uint8_t value)
   initial = cpu->a;
   bit = cpu_flag_carry_add(cpu, value);
   cpu->a += value;
-  cpu->a += cpu->sr.c;
-  cpu->sr.c = bit;
+  cpu->a += cpu->sr & CPU_FLAG_C;
+  cpu_flag_set(cpu, CPU_FLAG_C, bit);
   cpu_flag_overflow_add(cpu, initial, value);
   cpu_flag_negative_other(cpu, cpu->a);
   cpu_flag_zero_other(cpu, cpu->a);
@@ -515,10 +1057,10 @@ static inline void cpu_logic_sbc(cpu_t *cpu, uint8_t value)
   initial = cpu->a;
   bit = cpu_flag_carry_sub(cpu, value);
   cpu->a -= value;
-  if (cpu->sr.c == 0) {
+  if ((cpu->sr & CPU_FLAG_C) == 0) {
     cpu->a -= 1;
   }
-  cpu->sr.c = bit;
+  cpu_flag_set(cpu, CPU_FLAG_C, bit);
   cpu_flag_overflow_sub(cpu, initial, value);
   cpu_flag_negative_other(cpu, cpu->a);
   cpu_flag_zero_other(cpu, cpu->a);
@@ -526,2182 +1068,1987 @@ static inline void cpu_logic_sbc(cpu_t *cpu, uint8_t value)
 
 
 
-/* Documented Opcodes */
+/* Each operation below is expanded once for every addressing mode it is
+   used with in the opcode table. Reads use the prologue with the page
+   boundary check, writes and read-modify-writes always take the extra
+   cycle and have it in their base cycles. */
 
-static void op_adc_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_LOAD(mode, reg) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  cpu->reg = OP_READ(mode); \
+  cpu_flag_negative_other(cpu, cpu->reg); \
+  cpu_flag_zero_other(cpu, cpu->reg);
 
-static void op_adc_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_STORE(mode, value) \
+  OP_PROLOGUE(mode) \
+  OP_WRITE(mode, value);
 
-static void op_adc_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_LOGIC(mode, operator) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  cpu->a operator OP_READ(mode); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
 
-static void op_adc_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_COMPARE(mode, reg) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu_flag_negative_compare(cpu, cpu->reg, value); \
+  cpu_flag_zero_compare(cpu, cpu->reg, value); \
+  cpu_flag_carry_compare(cpu, cpu->reg, value);
 
-static void op_adc_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_BRANCH(mode, condition) \
+  OP_PROLOGUE(mode) \
+  if (condition) { \
+    cpu->cycles++; \
+    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) { \
+      cpu->cycles++; /* Crossed a page boundary. */ \
+    } \
+    cpu->pc += relative; \
+  }
 
-static void op_adc_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_FLAG_CLEAR(mode, flag) \
+  OP_PROLOGUE(mode) \
+  cpu->sr &= ~flag;
 
-static void op_adc_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_FLAG_SET(mode, flag) \
+  OP_PROLOGUE(mode) \
+  cpu->sr |= flag;
 
-static void op_adc_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_adc(cpu, value);
-}
+#define OP_STEP(mode, reg, operator) \
+  OP_PROLOGUE(mode) \
+  cpu->reg operator; \
+  cpu_flag_negative_other(cpu, cpu->reg); \
+  cpu_flag_zero_other(cpu, cpu->reg);
 
-static void op_and_imm(cpu_t *cpu, mem_t *mem)
-{
-  cpu->a &= mem_read(mem, cpu->pc++);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OP_TRANSFER(mode, from, to) \
+  OP_PROLOGUE(mode) \
+  cpu->to = cpu->from; \
+  cpu_flag_negative_other(cpu, cpu->to); \
+  cpu_flag_zero_other(cpu, cpu->to);
 
-static void op_and_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_and_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_and_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+/* Documented Opcodes */
 
-static void op_and_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->a &= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OP_adc(mode) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu_logic_adc(cpu, value);
 
-static void op_and_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  cpu->a &= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OP_and(mode) OP_LOGIC(mode, &=)
 
-static void op_and_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OP_asl(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b10000000; \
+  value = value << 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_flag_negative_other(cpu, value); \
+  cpu_flag_zero_other(cpu, value);
 
-static void op_and_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OP_bcc(mode) OP_BRANCH(mode, (cpu->sr & CPU_FLAG_C) == 0)
+#define OP_bcs(mode) OP_BRANCH(mode, cpu->sr & CPU_FLAG_C)
+#define OP_beq(mode) OP_BRANCH(mode, cpu->z_result == 0)
 
-static void op_asl_accu(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  uint8_t value = cpu->a;
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  cpu->a = value;
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
+#define OP_bit(mode) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu_flag_overflow_bit(cpu, value); \
+  cpu_flag_negative_other(cpu, value); \
+  value &= cpu->a; \
   cpu_flag_zero_other(cpu, value);
-}
 
-static void op_asl_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+#define OP_bmi(mode) OP_BRANCH(mode, cpu->n_result & CPU_FLAG_N)
+#define OP_bne(mode) OP_BRANCH(mode, cpu->z_result != 0)
+#define OP_bpl(mode) OP_BRANCH(mode, (cpu->n_result & CPU_FLAG_N) == 0)
+
+#define OP_brk(mode) \
+  OP_PROLOGUE(mode) \
+  mem_write_stack(mem, cpu->sp--, (cpu->pc + 1) / 256); \
+  mem_write_stack(mem, cpu->sp--, (cpu->pc + 1) % 256); \
+  mem_write_stack(mem, cpu->sp--, cpu_status_get(cpu, 1)); \
+  cpu->sr |= CPU_FLAG_I; \
+  cpu->sr |= CPU_FLAG_B; \
+  cpu->pc  = mem_read(mem, MEM_VECTOR_IRQ_LOW); \
+  cpu->pc += mem_read(mem, MEM_VECTOR_IRQ_HIGH) * 256;
 
-static void op_asl_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
+#define OP_bvc(mode) OP_BRANCH(mode, (cpu->sr & CPU_FLAG_V) == 0)
+#define OP_bvs(mode) OP_BRANCH(mode, cpu->sr & CPU_FLAG_V)
+#define OP_clc(mode) OP_FLAG_CLEAR(mode, CPU_FLAG_C)
+#define OP_cld(mode) OP_FLAG_CLEAR(mode, CPU_FLAG_D)
+#define OP_cli(mode) OP_FLAG_CLEAR(mode, CPU_FLAG_I)
+#define OP_clv(mode) OP_FLAG_CLEAR(mode, CPU_FLAG_V)
+#define OP_cmp(mode) OP_COMPARE(mode, a)
+#define OP_cpx(mode) OP_COMPARE(mode, x)
+#define OP_cpy(mode) OP_COMPARE(mode, y)
+
+#define OP_dec(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  value -= 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_negative_other(cpu, value); \
   cpu_flag_zero_other(cpu, value);
-}
 
-static void op_asl_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+#define OP_dex(mode) OP_STEP(mode, x, --)
+#define OP_dey(mode) OP_STEP(mode, y, --)
+#define OP_eor(mode) OP_LOGIC(mode, ^=)
 
-static void op_asl_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
+#define OP_inc(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  value += 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_negative_other(cpu, value); \
   cpu_flag_zero_other(cpu, value);
-}
 
-static void op_bcc(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.c == 0) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_inx(mode) OP_STEP(mode, x, ++)
+#define OP_iny(mode) OP_STEP(mode, y, ++)
 
-static void op_bcs(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.c == 1) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_jmp(mode) OP_JMP_##mode
+#define OP_JMP_ABS \
+  OP_PROLOGUE_ABS \
+  cpu->pc = absolute;
+#define OP_JMP_ABSI \
+  OP_PROLOGUE_ABSI \
+  uint16_t address = mem_read(mem, absolute); \
+  absolute += 1; \
+  if ((absolute & 0xFF) == 0) { /* Page crossing bug. */ \
+    absolute -= 0x100; \
+  } \
+  address += mem_read(mem, absolute) * 256; \
+  cpu->pc = address;
 
-static void op_beq(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.z == 1) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_jsr(mode) \
+  OP_PROLOGUE(mode) \
+  mem_write_stack(mem, cpu->sp--, (cpu->pc - 1) / 256); \
+  mem_write_stack(mem, cpu->sp--, (cpu->pc - 1) % 256); \
+  cpu->pc = absolute;
 
-static void op_bit_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_overflow_bit(cpu, value);
-  cpu_flag_negative_other(cpu, value);
-  value &= cpu->a;
+#define OP_lda(mode) OP_LOAD(mode, a)
+#define OP_ldx(mode) OP_LOAD(mode, x)
+#define OP_ldy(mode) OP_LOAD(mode, y)
+
+#define OP_lsr(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b00000001; \
+  value = value >> 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_flag_negative_other(cpu, value); \
   cpu_flag_zero_other(cpu, value);
-}
 
-static void op_bit_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_flag_overflow_bit(cpu, value);
-  cpu_flag_negative_other(cpu, value);
-  value &= cpu->a;
+/* The undocumented variants read nothing but the operand bytes. */
+#define OP_nop(mode) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  OP_UNUSED(mode)
+
+#define OP_ora(mode) OP_LOGIC(mode, |=)
+
+#define OP_pha(mode) \
+  OP_PROLOGUE(mode) \
+  mem_write_stack(mem, cpu->sp--, cpu->a);
+
+#define OP_php(mode) \
+  OP_PROLOGUE(mode) \
+  mem_write_stack(mem, cpu->sp--, cpu_status_get(cpu, 1));
+
+#define OP_pla(mode) \
+  OP_PROLOGUE(mode) \
+  cpu->a = mem_read_stack(mem, ++cpu->sp); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_plp(mode) \
+  OP_PROLOGUE(mode) \
+  cpu_status_set(cpu, mem_read_stack(mem, ++cpu->sp));
+
+#define OP_rol(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b10000000; \
+  value = value << 1; \
+  if (cpu->sr & CPU_FLAG_C) { \
+    value |= 0b00000001; \
+  } \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_flag_negative_other(cpu, value); \
   cpu_flag_zero_other(cpu, value);
-}
 
-static void op_bmi(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.n == 1) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_ror(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b00000001; \
+  value = value >> 1; \
+  if (cpu->sr & CPU_FLAG_C) { \
+    value |= 0b10000000; \
+  } \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_flag_negative_other(cpu, value); \
+  cpu_flag_zero_other(cpu, value);
 
-static void op_bne(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.z == 0) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_rti(mode) \
+  OP_PROLOGUE(mode) \
+  cpu_status_set(cpu, mem_read_stack(mem, ++cpu->sp)); \
+  cpu->pc  = mem_read_stack(mem, ++cpu->sp); \
+  cpu->pc += mem_read_stack(mem, ++cpu->sp) * 256;
 
-static void op_bpl(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.n == 0) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_rts(mode) \
+  OP_PROLOGUE(mode) \
+  cpu->pc  = mem_read_stack(mem, ++cpu->sp); \
+  cpu->pc += mem_read_stack(mem, ++cpu->sp) * 256; \
+  cpu->pc += 1;
 
-static void op_brk(cpu_t *cpu, mem_t *mem)
-{
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, (cpu->pc + 1) / 256);
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, (cpu->pc + 1) % 256);
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu_status_get(cpu, 1));
-  cpu->sr.i = 1;
-  cpu->sr.b = 1;
-  cpu->pc  = mem_read(mem, MEM_VECTOR_IRQ_LOW);
-  cpu->pc += mem_read(mem, MEM_VECTOR_IRQ_HIGH) * 256;
-}
+#define OP_sbc(mode) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu_logic_sbc(cpu, value);
 
-static void op_bvc(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.v == 0) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_sec(mode) OP_FLAG_SET(mode, CPU_FLAG_C)
+#define OP_sed(mode) OP_FLAG_SET(mode, CPU_FLAG_D)
+#define OP_sei(mode) OP_FLAG_SET(mode, CPU_FLAG_I)
+#define OP_sta(mode) OP_STORE(mode, cpu->a)
+#define OP_stx(mode) OP_STORE(mode, cpu->x)
+#define OP_sty(mode) OP_STORE(mode, cpu->y)
+#define OP_tax(mode) OP_TRANSFER(mode, a, x)
+#define OP_tay(mode) OP_TRANSFER(mode, a, y)
+#define OP_tsx(mode) OP_TRANSFER(mode, sp, x)
+#define OP_txa(mode) OP_TRANSFER(mode, x, a)
+
+#define OP_txs(mode) \
+  OP_PROLOGUE(mode) \
+  cpu->sp = cpu->x;
 
-static void op_bvs(cpu_t *cpu, mem_t *mem)
-{
-  int8_t relative = mem_read(mem, cpu->pc++);
-  if (cpu->sr.v == 1) {
-    cpu->cycles++;
-    if ((cpu->pc & 0xFF00) != ((cpu->pc + relative) & 0xFF00)) {
-      cpu->cycles++; /* Crossed a page boundary. */
-    }
-    cpu->pc += relative;
-  }
-}
+#define OP_tya(mode) OP_TRANSFER(mode, y, a)
 
-static void op_clc(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sr.c = 0;
-}
 
-static void op_cld(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sr.d = 0;
-}
 
-static void op_cli(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sr.i = 0;
-}
+/* Undocumented Opcodes */
 
-static void op_clv(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sr.v = 0;
-}
+#define OP_alr(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu->a &= value; \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a); \
+  value = cpu->a; \
+  bool bit = value & 0b00000001; \
+  value = value >> 1; \
+  cpu->a = value; \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_flag_negative_other(cpu, value); \
+  cpu_flag_zero_other(cpu, value);
 
-static void op_cmp_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+#define OP_anc(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu->a &= value; \
+  cpu_flag_set(cpu, CPU_FLAG_C, cpu->a >> 7); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
 
-static void op_cmp_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+/* Not even the operand is fetched. */
+#define OP_ane(mode) \
+  (void)cpu; \
+  (void)mem; \
+  panic("ANE undocumented opcode not implemented!\n");
 
-static void op_cmp_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
+#define OP_arr(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit; \
+  cpu->a &= value; \
+  cpu_flag_set(cpu, CPU_FLAG_V, (cpu->a ^ (cpu->a >> 1)) & 0x40); \
+  bit = cpu->a >> 7; \
+  cpu->a >>= 1; \
+  cpu->a |= (cpu->sr & CPU_FLAG_C) << 7; \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_dcp(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  value -= 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_negative_compare(cpu, cpu->a, value); \
+  cpu_flag_zero_compare(cpu, cpu->a, value); \
   cpu_flag_carry_compare(cpu, cpu->a, value);
-}
 
-static void op_cmp_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+#define OP_isc(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  value += 1; \
+  OP_WRITE(mode, value); \
+  cpu_logic_sbc(cpu, value);
 
-static void op_cmp_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+#define OP_las(mode) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  panic("LAS undocumented opcode not implemented!\n");
 
-static void op_cmp_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+#define OP_lax(mode) \
+  OP_PROLOGUE_BOUNDARY_CHECK(mode) \
+  cpu->a = OP_READ(mode); \
+  cpu->x = OP_READ(mode); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_lxa(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  cpu->a |= 0xFF; /* The magic constant. */ \
+  cpu->a &= value; \
+  cpu->x = cpu->a; \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_rla(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b10000000; \
+  value = value << 1; \
+  if (cpu->sr & CPU_FLAG_C) { \
+    value |= 0b00000001; \
+  } \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu->a &= OP_READ(mode); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_rra(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b00000001; \
+  value = value >> 1; \
+  if (cpu->sr & CPU_FLAG_C) { \
+    value |= 0b10000000; \
+  } \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu_logic_adc(cpu, value);
 
-static void op_cmp_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+#define OP_sax(mode) OP_STORE(mode, cpu->a & cpu->x)
 
-static void op_cmp_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+#define OP_sbx(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  uint16_t temp; \
+  temp = (cpu->a & cpu->x) - value; \
+  cpu->x = temp; \
+  cpu_flag_set(cpu, CPU_FLAG_C, (temp >> 8) == 0); \
+  cpu_flag_negative_other(cpu, cpu->x); \
+  cpu_flag_zero_other(cpu, cpu->x);
 
-static void op_cpx_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu_flag_negative_compare(cpu, cpu->x, value);
-  cpu_flag_zero_compare(cpu, cpu->x, value);
-  cpu_flag_carry_compare(cpu, cpu->x, value);
-}
+#define OP_sha(mode) \
+  OP_PROLOGUE(mode) \
+  panic("SHA (" #mode ") undocumented opcode not implemented!\n");
 
-static void op_cpx_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->x, value);
-  cpu_flag_zero_compare(cpu, cpu->x, value);
-  cpu_flag_carry_compare(cpu, cpu->x, value);
-}
+#define OP_SH(mode, reg) \
+  OP_PROLOGUE(mode) \
+  absolute = ((cpu->reg & ((absolute >> 8) + 1)) << 8) | (absolute & 0xff); \
+  mem_write(mem, absolute, absolute >> 8);
 
-static void op_cpx_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_flag_negative_compare(cpu, cpu->x, value);
-  cpu_flag_zero_compare(cpu, cpu->x, value);
-  cpu_flag_carry_compare(cpu, cpu->x, value);
-}
+#define OP_shx(mode) OP_SH(mode, x)
+#define OP_shy(mode) OP_SH(mode, y)
+
+#define OP_slo(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b10000000; \
+  value = value << 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu->a |= OP_READ(mode); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_sre(mode) \
+  OP_PROLOGUE(mode) \
+  uint8_t value = OP_READ(mode); \
+  bool bit = value & 0b00000001; \
+  value = value >> 1; \
+  OP_WRITE(mode, value); \
+  cpu_flag_set(cpu, CPU_FLAG_C, bit); \
+  cpu->a ^= OP_READ(mode); \
+  cpu_flag_negative_other(cpu, cpu->a); \
+  cpu_flag_zero_other(cpu, cpu->a);
+
+#define OP_tas(mode) \
+  OP_PROLOGUE(mode) \
+  panic("TAS undocumented opcode not implemented!\n");
 
-static void op_cpy_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu_flag_negative_compare(cpu, cpu->y, value);
-  cpu_flag_zero_compare(cpu, cpu->y, value);
-  cpu_flag_carry_compare(cpu, cpu->y, value);
-}
+#define OP_usbc(mode) OP_sbc(mode)
 
-static void op_cpy_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  cpu_flag_negative_compare(cpu, cpu->y, value);
-  cpu_flag_zero_compare(cpu, cpu->y, value);
-  cpu_flag_carry_compare(cpu, cpu->y, value);
-}
 
-static void op_cpy_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_flag_negative_compare(cpu, cpu->y, value);
-  cpu_flag_zero_compare(cpu, cpu->y, value);
-  cpu_flag_carry_compare(cpu, cpu->y, value);
-}
 
-static void op_dec_abs(cpu_t *cpu, mem_t *mem)
+CPU_COLD static void op_none(cpu_t *cpu, mem_t *mem)
 {
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+  uint8_t opcode;
+  opcode = mem_read(mem, cpu->pc - 1);
 
-static void op_dec_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
+  if (cpu_trap_opcode_handler != NULL) {
+    if (true == (cpu_trap_opcode_handler)(opcode, cpu, mem)) {
+      /* Request was handled...  */
+      return;
+    }
+  }
+  panic("CPU jam due to unhandled opcode: %02x\n", opcode);
 }
 
-static void op_dec_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  value -= 1;
-  mem_write(mem, zeropage, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_dec_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  value -= 1;
-  mem_write(mem, zeropage, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_dex(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->x--;
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
+#define OP_NAME(operation, mode) OP_NAME_##mode(operation)
+#define OP_NAME_ACCU(operation) op_##operation##_accu
+#define OP_NAME_IMPL(operation) op_##operation
+#define OP_NAME_IMM(operation) op_##operation##_imm
+#define OP_NAME_ABS(operation) op_##operation##_abs
+#define OP_NAME_ABSI(operation) op_##operation##_absi
+#define OP_NAME_ABSX(operation) op_##operation##_absx
+#define OP_NAME_ABSY(operation) op_##operation##_absy
+#define OP_NAME_REL(operation) op_##operation
+#define OP_NAME_ZP(operation) op_##operation##_zp
+#define OP_NAME_ZPX(operation) op_##operation##_zpx
+#define OP_NAME_ZPY(operation) op_##operation##_zpy
+#define OP_NAME_ZPYI(operation) op_##operation##_zpyi
+#define OP_NAME_ZPIX(operation) op_##operation##_zpix
+#define OP_NAME_NONE(operation) op_##operation
+#define OP_NAME_STRING(name) OP_STRING(name)
+#define OP_STRING(name) #name
+
+#define OPCODE_HANDLER(opcode, mnemonic, operation, mode, cycles, class) \
+  OPCODE_HANDLER_##class(OP_NAME(operation, mode), operation, mode)
+#define OPCODE_HANDLER_HOT(name, operation, mode) \
+  static void name(cpu_t *cpu, mem_t *mem) \
+  { \
+    OP_##operation(mode) \
+  }
+#define OPCODE_HANDLER_COLD(name, operation, mode) \
+  CPU_COLD OPCODE_HANDLER_HOT(name, operation, mode)
+#define OPCODE_HANDLER_ALIAS(name, operation, mode)
 
-static void op_dey(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->y--;
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
+CPU_OPCODE_TABLE(OPCODE_HANDLER)
 
-static void op_eor_imm(cpu_t *cpu, mem_t *mem)
-{
-  cpu->a ^= mem_read(mem, cpu->pc++);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OPCODE_FUNCTION(opcode, mnemonic, operation, mode, cycles, class) \
+  [opcode] = OP_NAME(operation, mode),
 
-static void op_eor_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+static cpu_operation_func_t opcode_function[UINT8_MAX + 1] = {
+  CPU_OPCODE_TABLE(OPCODE_FUNCTION)
+};
 
-static void op_eor_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+/* The handlers again, going through the page table for the zero page and
+   stack as well, used only while there are watchpoints on them. */
+#define mem_read_zp(mem, address) mem_read(mem, address)
+#define mem_write_zp(mem, address, value) mem_write(mem, address, value)
+#define mem_read_stack(mem, sp) mem_read(mem, MEM_PAGE_STACK + (sp))
+#define mem_write_stack(mem, sp, value) \
+  mem_write(mem, MEM_PAGE_STACK + (sp), value)
+
+#define OP_WATCHED(name) OP_WATCHED_(name)
+#define OP_WATCHED_(name) name##_watched
+#define op_none_watched op_none
+
+#define OPCODE_WATCHED(opcode, mnemonic, operation, mode, cycles, class) \
+  OPCODE_WATCHED_##class(OP_WATCHED(OP_NAME(operation, mode)), \
+  operation, mode)
+#define OPCODE_WATCHED_HOT(name, operation, mode) \
+  OPCODE_HANDLER_COLD(name, operation, mode)
+#define OPCODE_WATCHED_COLD(name, operation, mode) \
+  OPCODE_HANDLER_COLD(name, operation, mode)
+#define OPCODE_WATCHED_ALIAS(name, operation, mode)
+
+CPU_OPCODE_TABLE(OPCODE_WATCHED)
+
+#define OPCODE_FUNCTION_WATCHED(opcode, mnemonic, operation, mode, cycles, \
+  class) [opcode] = OP_WATCHED(OP_NAME(operation, mode)),
+
+static cpu_operation_func_t opcode_function_watched[UINT8_MAX + 1] = {
+  CPU_OPCODE_TABLE(OPCODE_FUNCTION_WATCHED)
+};
 
-static void op_eor_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#undef mem_read_zp
+#undef mem_write_zp
+#undef mem_read_stack
+#undef mem_write_stack
 
-static void op_eor_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->a ^= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+/* Base cycles when page boundary crossing is not considered. */
+#define OPCODE_CYCLES(opcode, mnemonic, operation, mode, cycles, class) \
+  [opcode] = cycles,
 
-static void op_eor_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  cpu->a ^= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+static uint8_t opcode_cycles[UINT8_MAX + 1] = {
+  CPU_OPCODE_TABLE(OPCODE_CYCLES)
+};
 
-static void op_eor_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+#define OPCODE_HOT(opcode, mnemonic, operation, mode, cycles, class) \
+  [opcode] = OPCODE_HOT_##class,
+#define OPCODE_HOT_HOT true
+#define OPCODE_HOT_COLD false
+#define OPCODE_HOT_ALIAS false
 
-static void op_eor_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+static const bool opcode_hot[UINT8_MAX + 1] = {
+  CPU_OPCODE_TABLE(OPCODE_HOT)
+};
 
-static void op_inc_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+/* Writes the local copy of the registers back to the real state. Devices
+   raise and clear interrupt lines on the real state during a run, through
+   mem->sync or mapper register writes, so those are kept. */
+#define CPU_RUN_STORE \
+  registers.interrupt = state->interrupt; \
+  *state = registers;
 
-static void op_inc_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+/* Runs a handler kept out of a run loop on the real state, which it may
+   also look at, like jams and traps do. */
+#define CPU_RUN_COLD(func) \
+  registers.sync_cycles = state->sync_cycles; \
+  registers.sync_instructions = state->sync_instructions; \
+  CPU_RUN_STORE \
+  func(state, mem); \
+  registers = *state;
 
-static void op_inc_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  value += 1;
-  mem_write(mem, zeropage, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_inc_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  value += 1;
-  mem_write(mem, zeropage, value);
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_inx(cpu_t *cpu, mem_t *mem)
+cpu_operation_func_t cpu_opcode_function(uint8_t opcode)
 {
-  (void)mem;
-  cpu->x++;
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
+  return opcode_function[opcode];
 }
 
-static void op_iny(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->y++;
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
 
-static void op_jmp_abs(cpu_t *cpu, mem_t *mem)
+
+uint8_t cpu_opcode_cycles(uint8_t opcode)
 {
-  OP_PROLOGUE_ABS
-  cpu->pc = absolute;
+  return opcode_cycles[opcode];
 }
 
-static void op_jmp_absi(cpu_t *cpu, mem_t *mem)
+
+
+/* Instruction size in bytes, or 0 for opcodes that jam or are trapped. */
+int cpu_opcode_size(uint8_t opcode)
 {
-  OP_PROLOGUE_ABS
-  uint16_t address = mem_read(mem, absolute);
-  absolute += 1;
-  if ((absolute & 0xFF) == 0) { /* Page crossing bug. */
-    absolute -= 0x100;
+  if (opcode_function[opcode] == op_none) {
+    return 0;
   }
-  address += mem_read(mem, absolute) * 256;
-  cpu->pc = address;
-}
 
-static void op_jsr(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, (cpu->pc - 1) / 256);
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, (cpu->pc - 1) % 256);
-  cpu->pc = absolute;
-}
+  switch (opcode_address_mode[opcode]) {
+  case AM_ACCU:
+  case AM_IMPL:
+    return 1;
 
-static void op_lda_imm(cpu_t *cpu, mem_t *mem)
-{
-  cpu->a = mem_read(mem, cpu->pc++);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  case AM_IMM:
+  case AM_REL:
+  case AM_ZP:
+  case AM_ZPX:
+  case AM_ZPY:
+  case AM_ZPYI:
+  case AM_ZPIX:
+    return 2;
 
-static void op_lda_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  cpu->a = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  case AM_ABS:
+  case AM_ABSI:
+  case AM_ABSX:
+  case AM_ABSY:
+    return 3;
 
-static void op_lda_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  cpu->a = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  case AM_NONE:
+  default:
+    return 0;
+  }
 }
 
-static void op_lda_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  cpu->a = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_lda_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->a = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_lda_zpx(cpu_t *cpu, mem_t *mem)
+CPU_COLD static void cpu_decode_at(mem_t *mem, uint16_t pc,
+  cpu_decoded_t *decoded)
 {
-  OP_PROLOGUE_ZPX
-  cpu->a = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  int i;
 
-static void op_lda_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  cpu->a = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  decoded->opcode = mem_read_code(mem, pc);
+  decoded->key = decoded->opcode;
+  decoded->func = opcode_function[decoded->opcode];
+  decoded->cycles = opcode_cycles[decoded->opcode];
+  decoded->size = cpu_opcode_size(decoded->opcode);
+  for (i = 1; i < decoded->size; i++) {
+    decoded->operand[i - 1] = mem_read_code(mem, pc + i);
+  }
 }
 
-static void op_lda_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  cpu->a = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_ldx_imm(cpu_t *cpu, mem_t *mem)
-{
-  cpu->x = mem_read(mem, cpu->pc++);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
 
-static void op_ldx_abs(cpu_t *cpu, mem_t *mem)
+/* Instructions allowed in an idle loop only read memory, so repeating one
+   changes nothing but the registers. Reads are limited to RAM, cartridge
+   memory and the PPU status register. Reading the status register is not
+   free of side effects: it clears vblank and the address latch, and ends
+   the run through mem_end_run(). Skipping is still right because a loop is
+   only skipped after one whole iteration without a device event. So
+   vblank is already clear and the latch already reset, and reading again
+   gives the same value and changes nothing until the next PPU event. */
+static bool cpu_idle_read_only(uint8_t opcode, uint16_t operand)
 {
-  OP_PROLOGUE_ABS
-  cpu->x = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
+  switch (opcode) {
+  case 0xEA: /* NOP */
+    return true;
 
-static void op_ldx_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  cpu->x = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
+  case 0x09: case 0x29: case 0x49: case 0xA0: case 0xA2: case 0xA9:
+  case 0xC0: case 0xC9: case 0xE0:
+    return true; /* Immediate */
 
-static void op_ldx_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->x = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
+  case 0x05: case 0x24: case 0x25: case 0x45: case 0xA4: case 0xA5:
+  case 0xA6: case 0xC4: case 0xC5: case 0xE4:
+  case 0x15: case 0x35: case 0x55: case 0xB4: case 0xB5: case 0xB6:
+  case 0xD5:
+    return true; /* Zero page, possibly indexed. */
 
-static void op_ldx_zpy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPY
-  cpu->x = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
+  case 0x0D: case 0x2C: case 0x2D: case 0x4D: case 0xAC: case 0xAD:
+  case 0xAE: case 0xCC: case 0xCD: case 0xEC:
+    return (operand <= 0x07FF || operand >= 0x6000 || operand == 0x2002);
 
-static void op_ldy_imm(cpu_t *cpu, mem_t *mem)
-{
-  cpu->y = mem_read(mem, cpu->pc++);
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
+  case 0x19: case 0x1D: case 0x39: case 0x3D: case 0x59: case 0x5D:
+  case 0xB9: case 0xBC: case 0xBD: case 0xBE: case 0xD9: case 0xDD:
+    return (operand + 0xFF <= 0x07FF || operand >= 0x6000);
 
-static void op_ldy_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  cpu->y = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
+  default:
+    return false;
+  }
 }
 
-static void op_ldy_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  cpu->y = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
 
-static void op_ldy_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->y = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
 
-static void op_ldy_zpx(cpu_t *cpu, mem_t *mem)
+/* Returns the number of instructions in the loop starting at pc if it is
+   made of read only instructions jumping back to the start, otherwise 0. */
+CPU_COLD static uint8_t cpu_idle_loop_at(mem_t *mem, uint16_t pc)
 {
-  OP_PROLOGUE_ZPX
-  cpu->y = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
+  cpu_decoded_t decoded;
+  uint32_t address;
+  uint16_t operand;
+  uint8_t n;
 
-static void op_lsr_accu(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  uint8_t value = cpu->a;
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  cpu->a = value;
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+  address = pc;
+  for (n = 1; address + 3 <= (uint32_t)pc + CPU_IDLE_LOOP_SIZE; n++) {
+    if (address + 3 > UINT16_MAX + 1 || cpu_break_at(address)) {
+      return 0;
+    }
+    cpu_decode_at(mem, address, &decoded);
+    operand = decoded.operand[0] + (decoded.operand[1] * 256);
 
-static void op_lsr_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+    if (decoded.opcode == 0x4C) { /* JMP */
+      return (operand == pc) ? n : 0;
+    }
+    if ((decoded.opcode & 0x1F) == 0x10) { /* Branch */
+      operand = address + 2 + (int8_t)decoded.operand[0];
+      return (operand == pc) ? n : 0;
+    }
+    if (decoded.size == 0 || ! cpu_idle_read_only(decoded.opcode, operand)) {
+      return 0;
+    }
+    address += decoded.size;
+  }
 
-static void op_lsr_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
+  return 0;
 }
 
-static void op_lsr_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_lsr_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_nop(cpu_t *cpu, mem_t *mem)
+static bool cpu_fuse_writes(uint8_t opcode)
 {
-  (void)cpu;
-  (void)mem;
-}
+  static const char *mnemonics[] = {
+    "STA", "STX", "STY", "SAX", "SHA", "SHX", "SHY", "TAS", "ASL", "LSR",
+    "ROL", "ROR", "INC", "DEC", "SLO", "RLA", "SRE", "RRA", "DCP", "ISC",
+  };
+  size_t i;
 
-static void op_ora_imm(cpu_t *cpu, mem_t *mem)
-{
-  cpu->a |= mem_read(mem, cpu->pc++);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  for (i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+    if (strcmp(opcode_mnemonic[opcode], mnemonics[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
 }
 
-static void op_ora_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_ora_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_ora_absy(cpu_t *cpu, mem_t *mem)
+/* Instructions may only be fused into a superinstruction when none of their
+   accesses can reach the I/O registers or the FDS hooks, so the devices
+   never need to see the CPU in between. The first one must not jump, and
+   must not write outside of RAM where it could change the second one.
+   Cold handlers are left out, as they are not inlined into the run loop. */
+static bool cpu_fuse_allowed(uint16_t pc, cpu_decoded_t *decoded, bool first)
 {
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  uint16_t operand;
+  bool safe_write;
 
-static void op_ora_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->a |= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  if (pc < CPU_DECODE_START || decoded->size == 0 ||
+      ! opcode_hot[decoded->opcode]) {
+    return false;
+  }
 
-static void op_ora_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  cpu->a |= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  switch (decoded->opcode) {
+  case 0x00: /* BRK */
+  case 0x40: /* RTI */
+  case 0x6C: /* JMP (a) */
+    return false;
 
-static void op_ora_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  case 0x20: /* JSR */
+  case 0x4C: /* JMP */
+  case 0x60: /* RTS */
+    return ! first;
 
-static void op_ora_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  default:
+    break;
+  }
 
-static void op_pha(cpu_t *cpu, mem_t *mem)
-{
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu->a);
-}
+  operand = decoded->operand[0] + (decoded->operand[1] * 256);
+  safe_write = ! (first && cpu_fuse_writes(decoded->opcode));
 
-static void op_php(cpu_t *cpu, mem_t *mem)
-{
-  mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu_status_get(cpu, 1));
-}
+  switch (opcode_address_mode[decoded->opcode]) {
+  case AM_REL:
+    return ! first;
 
-static void op_pla(cpu_t *cpu, mem_t *mem)
-{
-  cpu->a = mem_read(mem, MEM_PAGE_STACK + (++cpu->sp));
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  case AM_ACCU:
+  case AM_IMPL:
+  case AM_IMM:
+  case AM_ZP:
+  case AM_ZPX:
+  case AM_ZPY:
+    return true;
 
-static void op_plp(cpu_t *cpu, mem_t *mem)
-{
-  cpu_status_set(cpu, mem_read(mem, MEM_PAGE_STACK + (++cpu->sp)));
-}
+  case AM_ABS:
+    return (operand <= 0x07FF || (operand >= 0x6000 && safe_write));
 
-static void op_rol_accu(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  uint8_t value = cpu->a;
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
-  }
-  cpu->a = value;
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+  case AM_ABSX:
+  case AM_ABSY:
+    return (operand + 0xFF <= 0x07FF || (operand >= 0x6000 && safe_write));
 
-static void op_rol_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  default:
+    return false;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
 }
 
-static void op_rol_absx(cpu_t *cpu, mem_t *mem)
+
+
+/* Returns the dispatch key for the instruction at pc, which is either the
+   superinstruction from the generated table for the pair starting there, or
+   just the opcode. */
+CPU_COLD static uint16_t cpu_fuse_key(mem_t *mem, uint16_t pc,
+  cpu_decoded_t *first)
 {
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+#define FUSE_PAIR(n, a, fa, b, fb) { a, b },
+  static const uint8_t pairs[][2] = {
+    CPU_FUSE_TABLE(FUSE_PAIR)
+    { 0, 0 }, /* Terminator, BRK is never fused. */
+  };
+#undef FUSE_PAIR
+  cpu_decoded_t second;
+  uint8_t n;
+
+#ifdef CPU_FUSE_PROFILE
+  return first->opcode; /* Count all pairs, not just the ones left. */
+#endif
+
+  if (! cpu_fuse_allowed(pc, first, true) ||
+      pc + first->size + 3 > UINT16_MAX + 1 ||
+      cpu_break_at(pc + first->size)) {
+    return first->opcode;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_rol_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  cpu_decode_at(mem, pc + first->size, &second);
+  if (! cpu_fuse_allowed(pc + first->size, &second, false)) {
+    return first->opcode;
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_rol_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  for (n = 0; pairs[n][0] != 0; n++) {
+    if (pairs[n][0] == first->opcode && pairs[n][1] == second.opcode) {
+      if (cpu_decoded[pc + first->size].func == NULL) {
+        cpu_predecode(mem, pc + first->size, pc + first->size);
+      }
+      return UINT8_MAX + n + 1;
+    }
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
+  return first->opcode;
 }
 
-static void op_ror_accu(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  uint8_t value = cpu->a;
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
-  }
-  cpu->a = value;
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_ror_abs(cpu_t *cpu, mem_t *mem)
+
+#if defined(CPU_FUSE_PROFILE) || defined(CPU_RECOMP_LOG)
+#define OPCODE_FUNCTION_NAME(opcode, mnemonic, operation, mode, cycles, \
+  class) [opcode] = OP_NAME_STRING(OP_NAME(operation, mode)),
+static const char *opcode_function_name[UINT8_MAX + 1] = {
+  CPU_OPCODE_TABLE(OPCODE_FUNCTION_NAME)
+};
+#endif
+
+#ifdef CPU_FUSE_PROFILE
+static uint64_t cpu_fuse_histogram[UINT8_MAX + 1][UINT8_MAX + 1];
+
+
+
+/* Counts pairs of instructions that follow each other and may be fused. */
+CPU_COLD static void cpu_fuse_count(uint16_t pc, cpu_decoded_t *decoded)
 {
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  static int previous = -1;
+  static uint32_t next = 0;
+
+  if (previous >= 0 && pc == next && cpu_fuse_allowed(pc, decoded, false)) {
+    cpu_fuse_histogram[previous][decoded->opcode]++;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_ror_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  if (cpu_fuse_allowed(pc, decoded, true)) {
+    previous = decoded->opcode;
+    next = pc + decoded->size;
+  } else {
+    previous = -1;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
 }
 
-static void op_ror_zp(cpu_t *cpu, mem_t *mem)
+
+
+/* Adds the counts to the ones kept from earlier profiling runs, then
+   generates the superinstruction table from the most frequent pairs. */
+static void cpu_fuse_profile_write(void)
 {
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  FILE *fh;
+  unsigned int a, b;
+  unsigned long long count;
+  int best_a, best_b;
+  int n;
+
+  fh = fopen(CPU_FUSE_PROFILE_CSV, "r");
+  if (fh != NULL) {
+    while (fscanf(fh, "%x,%x,%llu\n", &a, &b, &count) == 3) {
+      if (a <= UINT8_MAX && b <= UINT8_MAX) {
+        cpu_fuse_histogram[a][b] += count;
+      }
+    }
+    fclose(fh);
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
 
-static void op_ror_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  fh = fopen(CPU_FUSE_PROFILE_CSV, "w");
+  if (fh == NULL) {
+    return;
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+  for (a = 0; a <= UINT8_MAX; a++) {
+    for (b = 0; b <= UINT8_MAX; b++) {
+      if (cpu_fuse_histogram[a][b] > 0) {
+        fprintf(fh, "%02x,%02x,%llu\n", a, b,
+          (unsigned long long)cpu_fuse_histogram[a][b]);
+      }
+    }
+  }
+  fclose(fh);
 
-static void op_rti(cpu_t *cpu, mem_t *mem)
-{
-  cpu_status_set(cpu, mem_read(mem, MEM_PAGE_STACK + (++cpu->sp)));
-  cpu->pc  = mem_read(mem, MEM_PAGE_STACK + (++cpu->sp));
-  cpu->pc += mem_read(mem, MEM_PAGE_STACK + (++cpu->sp)) * 256;
+  fh = fopen(CPU_FUSE_PROFILE_HEADER, "w");
+  if (fh == NULL) {
+    return;
+  }
+  fprintf(fh, "#ifndef _CPU_FUSE_H\n");
+  fprintf(fh, "#define _CPU_FUSE_H\n\n");
+  fprintf(fh, "/* Generated by a CPU_FUSE_PROFILE build from the opcode pair "
+    "counts in\n   " CPU_FUSE_PROFILE_CSV ", use \"make fuse ROM=...\" "
+    "to update. */\n\n");
+  fprintf(fh, "#define CPU_FUSE_TABLE(X) \\\n");
+  for (n = 1; n <= CPU_FUSE_MAX; n++) {
+    best_a = 0;
+    best_b = 0;
+    for (a = 0; a <= UINT8_MAX; a++) {
+      for (b = 0; b <= UINT8_MAX; b++) {
+        if (cpu_fuse_histogram[a][b] > cpu_fuse_histogram[best_a][best_b]) {
+          best_a = a;
+          best_b = b;
+        }
+      }
+    }
+    if (cpu_fuse_histogram[best_a][best_b] == 0) {
+      break;
+    }
+    fprintf(fh, "  X(%d, 0x%02X, %s, 0x%02X, %s) \\\n", n,
+      best_a, opcode_function_name[best_a],
+      best_b, opcode_function_name[best_b]);
+    cpu_fuse_histogram[best_a][best_b] = 0;
+  }
+  fprintf(fh, "\n#endif /* _CPU_FUSE_H */\n");
+  fclose(fh);
 }
 
-static void op_rts(cpu_t *cpu, mem_t *mem)
+static void cpu_fuse_profile_start(void)
 {
-  cpu->pc  = mem_read(mem, MEM_PAGE_STACK + (++cpu->sp));
-  cpu->pc += mem_read(mem, MEM_PAGE_STACK + (++cpu->sp)) * 256;
-  cpu->pc += 1;
-}
+  static bool started = false;
 
-static void op_sbc_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu_logic_sbc(cpu, value);
+  if (! started) {
+    atexit(cpu_fuse_profile_write);
+    started = true;
+  }
 }
 
-static void op_sbc_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_sbc(cpu, value);
-}
+#define CPU_FUSE_COUNT(pc, decoded) cpu_fuse_count(pc, decoded);
+#else
+#define CPU_FUSE_COUNT(pc, decoded)
+#endif /* CPU_FUSE_PROFILE */
 
-static void op_sbc_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_sbc(cpu, value);
-}
 
-static void op_sbc_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_sbc(cpu, value);
-}
 
-static void op_sbc_zp(cpu_t *cpu, mem_t *mem)
+#ifdef CPU_HISTOGRAM
+/* Totals of the opcodes using each addressing mode. */
+static void cpu_histogram_modes(cpu_histogram_t modes[AM_NONE + 1])
 {
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_logic_sbc(cpu, value);
-}
+  int i;
 
-static void op_sbc_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  cpu_logic_sbc(cpu, value);
+  memset(modes, 0, sizeof(cpu_histogram_t) * (AM_NONE + 1));
+  for (i = 0; i <= UINT8_MAX; i++) {
+    modes[opcode_address_mode[i]].count += cpu_histogram[i].count;
+    modes[opcode_address_mode[i]].cycles += cpu_histogram[i].cycles;
+    modes[opcode_address_mode[i]].page_cross += cpu_histogram[i].page_cross;
+  }
 }
 
-static void op_sbc_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_sbc(cpu, value);
-}
 
-static void op_sbc_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  cpu_logic_sbc(cpu, value);
-}
 
-static void op_sec(cpu_t *cpu, mem_t *mem)
+void cpu_histogram_dump(FILE *fh)
 {
-  (void)mem;
-  cpu->sr.c = 1;
-}
+  cpu_histogram_t modes[AM_NONE + 1];
+  int i;
 
-static void op_sed(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sr.d = 1;
-}
+  fprintf(fh, "OP  MNE  MODE         COUNT           CYCLES       PAGE X\n");
+  for (i = 0; i <= UINT8_MAX; i++) {
+    if (cpu_histogram[i].count == 0) {
+      continue;
+    }
+    fprintf(fh, "%02x  %s  %-4s  %12llu  %15llu  %11llu\n", i,
+      opcode_mnemonic[i], address_mode_name[opcode_address_mode[i]],
+      (unsigned long long)cpu_histogram[i].count,
+      (unsigned long long)cpu_histogram[i].cycles,
+      (unsigned long long)cpu_histogram[i].page_cross);
+  }
 
-static void op_sei(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sr.i = 1;
+  cpu_histogram_modes(modes);
+  fprintf(fh, "\nMODE         COUNT           CYCLES       PAGE X\n");
+  for (i = 0; i <= AM_NONE; i++) {
+    if (modes[i].count == 0) {
+      continue;
+    }
+    fprintf(fh, "%-4s  %12llu  %15llu  %11llu\n", address_mode_name[i],
+      (unsigned long long)modes[i].count,
+      (unsigned long long)modes[i].cycles,
+      (unsigned long long)modes[i].page_cross);
+  }
 }
 
-static void op_sta_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  mem_write(mem, absolute, cpu->a);
-}
 
-static void op_sta_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  mem_write(mem, absolute, cpu->a);
-}
 
-static void op_sta_absy(cpu_t *cpu, mem_t *mem)
+/* Opcodes first, then the totals per addressing mode with no opcode. */
+static void cpu_histogram_write(void)
 {
-  OP_PROLOGUE_ABSY
-  mem_write(mem, absolute, cpu->a);
-}
+  cpu_histogram_t modes[AM_NONE + 1];
+  FILE *fh;
+  int i;
 
-static void op_sta_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  mem_write(mem, zeropage, cpu->a);
-}
+  fh = fopen(CPU_HISTOGRAM_CSV, "w");
+  if (fh == NULL) {
+    return;
+  }
 
-static void op_sta_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  mem_write(mem, zeropage, cpu->a);
-}
+  fprintf(fh, "opcode,mnemonic,mode,count,cycles,page_cross\n");
+  for (i = 0; i <= UINT8_MAX; i++) {
+    fprintf(fh, "%02x,%s,%s,%llu,%llu,%llu\n", i,
+      opcode_mnemonic[i], address_mode_name[opcode_address_mode[i]],
+      (unsigned long long)cpu_histogram[i].count,
+      (unsigned long long)cpu_histogram[i].cycles,
+      (unsigned long long)cpu_histogram[i].page_cross);
+  }
 
-static void op_sta_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI
-  mem_write(mem, absolute, cpu->a);
+  cpu_histogram_modes(modes);
+  for (i = 0; i <= AM_NONE; i++) {
+    fprintf(fh, ",,%s,%llu,%llu,%llu\n", address_mode_name[i],
+      (unsigned long long)modes[i].count,
+      (unsigned long long)modes[i].cycles,
+      (unsigned long long)modes[i].page_cross);
+  }
+  fclose(fh);
 }
 
-static void op_sta_zpix(cpu_t *cpu, mem_t *mem)
+static void cpu_histogram_start(void)
 {
-  OP_PROLOGUE_ZPIX
-  mem_write(mem, absolute, cpu->a);
-}
+  static bool started = false;
 
-static void op_stx_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  mem_write(mem, absolute, cpu->x);
+  if (! started) {
+    atexit(cpu_histogram_write);
+    started = true;
+  }
 }
+#endif /* CPU_HISTOGRAM */
 
-static void op_stx_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  mem_write(mem, zeropage, cpu->x);
-}
 
-static void op_stx_zpy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPY
-  mem_write(mem, zeropage, cpu->x);
-}
 
-static void op_sty_abs(cpu_t *cpu, mem_t *mem)
+#if defined(CPU_RECOMP) || defined(CPU_RECOMP_LOG)
+/* Identifies the cartridge ROM the translated code belongs to, as mapped
+   in by the mapper if any. */
+static uint32_t cpu_recomp_checksum(mem_t *mem)
 {
-  OP_PROLOGUE_ABS
-  mem_write(mem, absolute, cpu->y);
-}
+  uint32_t checksum;
+  int i;
 
-static void op_sty_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  mem_write(mem, zeropage, cpu->y);
+  checksum = 2166136261u; /* FNV-1a */
+  for (i = 0; i < CPU_RECOMP_SIZE; i++) {
+    checksum ^= mem_read_code(mem, CPU_RECOMP_START + i);
+    checksum *= 16777619u;
+  }
+  return checksum;
 }
+#endif
 
-static void op_sty_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  mem_write(mem, zeropage, cpu->y);
-}
+#ifdef CPU_RECOMP_LOG
+static mem_t *cpu_recomp_log_mem = NULL;
+static uint32_t cpu_recomp_log_checksum;
+static bool cpu_recomp_logged[CPU_RECOMP_SIZE]; /* Instruction starts. */
 
-static void op_tax(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->x = cpu->a;
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
 
-static void op_tay(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->y = cpu->a;
-  cpu_flag_negative_other(cpu, cpu->y);
-  cpu_flag_zero_other(cpu, cpu->y);
-}
 
-static void op_tsx(cpu_t *cpu, mem_t *mem)
+/* The instruction at pc is translated if it was run and is complete in
+   cartridge ROM. Jams and traps are always left to the interpreter. */
+static bool cpu_recomp_translated(uint32_t pc)
 {
-  (void)mem;
-  cpu->x = cpu->sp;
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
+  cpu_decoded_t decoded;
 
-static void op_txa(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->a = cpu->x;
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  if (pc < CPU_RECOMP_START || pc > UINT16_MAX ||
+      ! cpu_recomp_logged[pc - CPU_RECOMP_START]) {
+    return false;
+  }
+  cpu_decode_at(cpu_recomp_log_mem, pc, &decoded);
+  return decoded.func != op_none && decoded.size > 0 &&
+    pc + decoded.size <= UINT16_MAX + 1;
 }
 
-static void op_txs(cpu_t *cpu, mem_t *mem)
-{
-  (void)mem;
-  cpu->sp = cpu->x;
-}
 
-static void op_tya(cpu_t *cpu, mem_t *mem)
+
+/* Emits the jump to the instruction at pc, directly if translated. */
+static void cpu_recomp_write_goto(FILE *fh, uint32_t pc)
 {
-  (void)mem;
-  cpu->a = cpu->y;
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  if (cpu_recomp_translated(pc)) {
+    fprintf(fh, "  goto label_%04x;\n", pc);
+  } else {
+    fprintf(fh, "  goto dispatch;\n");
+  }
 }
 
 
 
-/* Undocumented Opcodes */
-
-static void op_alr_imm(cpu_t *cpu, mem_t *mem)
+/* Translates every logged instruction into the C code of one function. Each
+   instruction gets a label, control flow to known targets is done with
+   goto, and everything else goes through a switch on the PC, which returns
+   to the interpreter when the PC is not translated. */
+static void cpu_recomp_write_function(FILE *fh)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu->a &= value;
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-  value = cpu->a;
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  cpu->a = value;
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, value);
-  cpu_flag_zero_other(cpu, value);
-}
+  cpu_decoded_t decoded;
+  uint32_t pc, next, target;
 
-static void op_anc_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu->a &= value;
-  cpu->sr.c = (cpu->a >> 7);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
-
-static void op_ane_imm(cpu_t *cpu, mem_t *mem)
-{
-  (void)cpu;
-  (void)mem;
-  panic("ANE undocumented opcode not implemented!\n");
-}
+  fprintf(fh, "#ifdef __GNUC__\n__attribute__((flatten))\n#endif\n");
+  fprintf(fh, "static uint32_t cpu_recomp_run(cpu_t *state, mem_t *mem, "
+    "uint32_t budget,\n  uint32_t count)\n{\n");
+  fprintf(fh, "  CPU_RECOMP_PROLOGUE\n  goto dispatch;\n\n");
 
-static void op_arr_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  bool bit;
-  cpu->a &= value;
-  cpu->sr.v = ((cpu->a ^ (cpu->a >> 1)) & 0x40) >> 6;
-  bit = cpu->a >> 7;
-  cpu->a >>= 1;
-  cpu->a |= (cpu->sr.c) << 7;
-  cpu->sr.c = bit;
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  for (pc = CPU_RECOMP_START; pc <= UINT16_MAX; pc++) {
+    if (! cpu_recomp_translated(pc)) {
+      continue;
+    }
+    cpu_decode_at(cpu_recomp_log_mem, pc, &decoded);
+    next = pc + decoded.size;
+    target = decoded.operand[0] + (decoded.operand[1] * 256);
+
+    fprintf(fh, "label_%04x:\n", pc);
+    fprintf(fh, "  CPU_RECOMP_FETCH(0x%04x, %d, %d)\n", pc, decoded.cycles,
+      cpu_idle_loop_at(cpu_recomp_log_mem, pc));
+    if (opcode_hot[decoded.opcode]) {
+      fprintf(fh, "  %s(cpu, mem);\n", opcode_function_name[decoded.opcode]);
+    } else {
+      fprintf(fh, "  CPU_RUN_COLD(%s)\n", opcode_function_name[decoded.opcode]);
+    }
 
-static void op_dcp_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+    switch (decoded.opcode) {
+    case 0x4C: /* JMP */
+    case 0x20: /* JSR */
+      cpu_recomp_write_goto(fh, target);
+      continue;
+
+    case 0x00: /* BRK */
+    case 0x40: /* RTI */
+    case 0x60: /* RTS */
+    case 0x6C: /* JMP (a) */
+      fprintf(fh, "  goto dispatch;\n");
+      continue;
+
+    default:
+      break;
+    }
 
-static void op_dcp_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+    if ((decoded.opcode & 0x1F) == 0x10) { /* Branch */
+      target = (uint16_t)(next + (int8_t)decoded.operand[0]);
+      if (cpu_recomp_translated(target)) {
+        fprintf(fh, "  if (cpu->pc == 0x%04x) goto label_%04x;\n",
+          target, target);
+      } else {
+        fprintf(fh, "  if (cpu->pc != 0x%04x) goto dispatch;\n", next);
+      }
+    }
 
-static void op_dcp_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+    /* Falls through when the next instruction is also the next label. */
+    for (target = pc + 1; target < next; target++) {
+      if (cpu_recomp_translated(target)) {
+        break;
+      }
+    }
+    if (target != next || ! cpu_recomp_translated(next)) {
+      cpu_recomp_write_goto(fh, next);
+    }
+  }
 
-static void op_dcp_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  value -= 1;
-  mem_write(mem, zeropage, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
+  fprintf(fh, "\ndispatch:\n  switch (cpu->pc) {\n");
+  for (pc = CPU_RECOMP_START; pc <= UINT16_MAX; pc++) {
+    if (cpu_recomp_translated(pc)) {
+      fprintf(fh, "  case 0x%04x: goto label_%04x;\n", pc, pc);
+    }
+  }
+  fprintf(fh, "  default: goto done;\n  }\n\n");
+  fprintf(fh, "done:\n  CPU_RECOMP_EPILOGUE\n}\n");
 }
 
-static void op_dcp_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  value -= 1;
-  mem_write(mem, zeropage, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
 
-static void op_dcp_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
 
-static void op_dcp_zpix(cpu_t *cpu, mem_t *mem)
+/* Adds the instructions run to the ones logged earlier for the same ROM,
+   then translates all of them. */
+static void cpu_recomp_log_write(void)
 {
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  value -= 1;
-  mem_write(mem, absolute, value);
-  cpu_flag_negative_compare(cpu, cpu->a, value);
-  cpu_flag_zero_compare(cpu, cpu->a, value);
-  cpu_flag_carry_compare(cpu, cpu->a, value);
-}
+  FILE *fh;
+  uint8_t header[4];
+  uint8_t flag;
+  uint32_t checksum;
+  int i;
 
-static void op_isc_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_logic_sbc(cpu, value);
-}
+  checksum = cpu_recomp_checksum(cpu_recomp_log_mem);
+  if (checksum != cpu_recomp_log_checksum) {
+    fprintf(stderr, "Cartridge ROM changed, not translated.\n");
+    return;
+  }
 
-static void op_isc_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_logic_sbc(cpu, value);
-}
+  fh = fopen(CPU_RECOMP_LOG_FILE, "rb");
+  if (fh != NULL) {
+    if (fread(header, sizeof(uint8_t), 4, fh) == 4 &&
+        header[0] + (header[1] << 8) + (header[2] << 16) +
+        ((uint32_t)header[3] << 24) == checksum) {
+      for (i = 0; i < CPU_RECOMP_SIZE; i++) {
+        if (fread(&flag, sizeof(uint8_t), 1, fh) != 1) {
+          break;
+        }
+        cpu_recomp_logged[i] |= (flag != 0);
+      }
+    }
+    fclose(fh);
+  }
 
-static void op_isc_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_logic_sbc(cpu, value);
-}
+  fh = fopen(CPU_RECOMP_LOG_FILE, "wb");
+  if (fh == NULL) {
+    return;
+  }
+  for (i = 0; i < 4; i++) {
+    fputc((checksum >> (i * 8)) & 0xFF, fh);
+  }
+  for (i = 0; i < CPU_RECOMP_SIZE; i++) {
+    fputc(cpu_recomp_logged[i], fh);
+  }
+  fclose(fh);
 
-static void op_isc_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  value += 1;
-  mem_write(mem, zeropage, value);
-  cpu_logic_sbc(cpu, value);
+  fh = fopen(CPU_RECOMP_HEADER, "w");
+  if (fh == NULL) {
+    return;
+  }
+  fprintf(fh, "#ifndef _CPU_RECOMP_H\n");
+  fprintf(fh, "#define _CPU_RECOMP_H\n\n");
+  fprintf(fh, "/* Generated by a CPU_RECOMP_LOG build from the code log in\n"
+    "   " CPU_RECOMP_LOG_FILE ", use \"make recomp ROM=...\" "
+    "to update. */\n\n");
+  fprintf(fh, "#define CPU_RECOMP_CHECKSUM 0x%08x\n\n", checksum);
+  fprintf(fh, "static const uint8_t cpu_recomp_code[CPU_RECOMP_SIZE + 2] = {");
+  for (i = 0; i < CPU_RECOMP_SIZE; i++) {
+    fprintf(fh, "%s0x%02x,", (i % 12 == 0) ? "\n  " : " ",
+      mem_read_code(cpu_recomp_log_mem, CPU_RECOMP_START + i));
+  }
+  fprintf(fh, "\n};\n\n");
+  cpu_recomp_write_function(fh);
+  fprintf(fh, "\n#endif /* _CPU_RECOMP_H */\n");
+  fclose(fh);
 }
 
-static void op_isc_zpx(cpu_t *cpu, mem_t *mem)
+static void cpu_recomp_log_start(mem_t *mem)
 {
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  value += 1;
-  mem_write(mem, zeropage, value);
-  cpu_logic_sbc(cpu, value);
+  if (cpu_recomp_log_mem == NULL) {
+    atexit(cpu_recomp_log_write);
+  }
+  cpu_recomp_log_mem = mem;
+  cpu_recomp_log_checksum = cpu_recomp_checksum(mem);
 }
 
-static void op_isc_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_logic_sbc(cpu, value);
-}
+#define CPU_RECOMP_MARK(pc) \
+  if (pc >= CPU_RECOMP_START) { \
+    cpu_recomp_logged[pc - CPU_RECOMP_START] = true; \
+  }
+#else
+#define CPU_RECOMP_MARK(pc)
+#endif /* CPU_RECOMP_LOG */
 
-static void op_isc_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  value += 1;
-  mem_write(mem, absolute, value);
-  cpu_logic_sbc(cpu, value);
-}
 
-static void op_las_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  panic("LAS undocumented opcode not implemented!\n");
-}
 
-static void op_lax_abs(cpu_t *cpu, mem_t *mem)
+/* Decode instructions in cartridge memory, watching the pages they are in
+   for writes that invalidate them. */
+CPU_COLD void cpu_predecode(mem_t *mem, uint16_t start, uint16_t end)
 {
-  OP_PROLOGUE_ABS
-  cpu->a = mem_read(mem, absolute);
-  cpu->x = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  uint32_t pc;
 
-static void op_lax_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY_BOUNDARY_CHECK
-  cpu->a = mem_read(mem, absolute);
-  cpu->x = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  if (start < CPU_DECODE_START) {
+    start = CPU_DECODE_START;
+  }
 
-static void op_lax_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  cpu->a = mem_read(mem, zeropage);
-  cpu->x = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
+  for (pc = start; pc <= end; pc++) {
+    cpu_decode_at(mem, pc, &cpu_decoded[pc]);
+    if (cpu_break_at(pc)) {
+      cpu_decoded[pc].idle = CPU_IDLE_BREAK;
+    } else {
+      cpu_decoded[pc].idle = cpu_idle_loop_at(mem, pc);
+    }
+    cpu_decoded[pc].key = cpu_fuse_key(mem, pc, &cpu_decoded[pc]);
+    if (pc + cpu_decoded[pc].size > UINT16_MAX + 1) {
+      cpu_decoded[pc].func = NULL; /* Wraps around to RAM. */
+      continue;
+    }
+    mem_code_page_set(mem, pc / 256, true);
+    mem_code_page_set(mem, (pc + 2) / 256 % 256, true);
+  }
 }
 
-static void op_lax_zpy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPY
-  cpu->a = mem_read(mem, zeropage);
-  cpu->x = mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
-}
 
-static void op_lax_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI_BOUNDARY_CHECK
-  cpu->a = mem_read(mem, absolute);
-  cpu->x = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_lax_zpix(cpu_t *cpu, mem_t *mem)
+static inline cpu_decoded_t *cpu_decode(cpu_t *cpu, mem_t *mem)
 {
-  OP_PROLOGUE_ZPIX
-  cpu->a = mem_read(mem, absolute);
-  cpu->x = mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  static cpu_decoded_t uncached;
 
-static void op_lxa_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu->a |= 0xFF; /* The magic constant. */
-  cpu->a &= value;
-  cpu->x = cpu->a;
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  if (cpu_decoded[cpu->pc].func != NULL) {
+    return &cpu_decoded[cpu->pc];
+  }
 
-static void op_nop_imm(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t value = mem_read(mem, cpu->pc++);
-  (void)value;
-}
+  if (cpu->pc >= CPU_DECODE_START) {
+    cpu_predecode(mem, cpu->pc, cpu->pc);
+    if (cpu_decoded[cpu->pc].func != NULL) {
+      return &cpu_decoded[cpu->pc];
+    }
+  }
 
-static void op_nop_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  (void)zeropage;
+  cpu_decode_at(mem, cpu->pc, &uncached);
+  uncached.idle = cpu_break_at(cpu->pc) ? CPU_IDLE_BREAK : 0;
+  return &uncached;
 }
 
-static void op_nop_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-}
 
-static void op_nop_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-}
 
-static void op_nop_absx(cpu_t *cpu, mem_t *mem)
+static void cpu_code_invalidate(void *mem, uint16_t address)
 {
-  OP_PROLOGUE_ABSX_BOUNDARY_CHECK
-}
+  int i;
 
-static void op_rla_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  /* Instructions are up to 3 bytes, but idle loops starting further back
+     may also cover the address. */
+  for (i = 0; i < CPU_IDLE_LOOP_SIZE; i++) {
+    cpu_decoded[(uint16_t)(address - i)].func = NULL;
+    cpu_decoded[(uint16_t)(address - i)].idle = 0;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+#ifdef CPU_DYNAREC
+  dynarec_invalidate(mem, address);
+#else
+  (void)mem;
+#endif
 }
 
-static void op_rla_absx(cpu_t *cpu, mem_t *mem)
+
+
+static void cpu_code_write(void *mem, uint16_t address)
 {
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  cpu_code_invalidate(mem, address);
+#ifdef CPU_RECOMP
+  if (address >= CPU_RECOMP_START) {
+    cpu_recomp_enabled = false; /* Not ROM after all. */
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+#endif
 }
 
-static void op_rla_absy(cpu_t *cpu, mem_t *mem)
+
+
+/* Same as cpu_code_write() but for the whole page, switched to another
+   bank by the mapper. */
+static void cpu_code_bank(void *mem, uint16_t address)
 {
-  OP_PROLOGUE_ABSY
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  int i;
+
+  for (i = 1 - CPU_IDLE_LOOP_SIZE; i < 256; i++) {
+    cpu_decoded[(uint16_t)(address + i)].func = NULL;
+    cpu_decoded[(uint16_t)(address + i)].idle = 0;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+#ifdef CPU_DYNAREC
+  dynarec_invalidate(mem, address);
+#else
+  (void)mem;
+#endif
+#ifdef CPU_RECOMP
+  if (address >= CPU_RECOMP_START) {
+    cpu_recomp_enabled = false; /* Not fixed ROM after all. */
+  }
+#endif
 }
 
-static void op_rla_zp(cpu_t *cpu, mem_t *mem)
+
+
+void cpu_code_flush(mem_t *mem)
 {
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
-  }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  memset(cpu_decoded, 0, sizeof(cpu_decoded));
+  memset(mem->code_page, false, sizeof(mem->code_page));
+  mem_map_update(mem);
+#ifdef CPU_RECOMP
+  cpu_recomp_check(mem);
+#endif
+  cpu_idle.visit_window = cpu_idle.window - 1; /* Forget the last visit. */
+#ifdef CPU_DYNAREC
+  dynarec_flush();
+#endif
 }
 
-static void op_rla_zpx(cpu_t *cpu, mem_t *mem)
+
+
+/* Breakpoints are decoded into the instructions, so code covering the
+   address is decoded and translated again. */
+void cpu_break_set(mem_t *mem, uint16_t address, bool set)
 {
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  int page;
+  int i;
+
+  if (set == cpu_break_at(address)) {
+    return;
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_rla_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  if (set) {
+    cpu_break_map[address / 8] |= (1 << (address % 8));
+    cpu_break_count++;
+  } else {
+    cpu_break_map[address / 8] &= ~(1 << (address % 8));
+    cpu_break_count--;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_rla_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b00000001;
+  page = address / 256;
+  cpu_break_page[page] = false;
+  for (i = 0; i < 256 / 8; i++) {
+    if (cpu_break_map[(page * 256 / 8) + i] != 0) {
+      cpu_break_page[page] = true;
+      break;
+    }
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a &= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+
+  cpu_code_invalidate(mem, address);
 }
 
-static void op_rra_abs(cpu_t *cpu, mem_t *mem)
+
+
+/* Traces with the raw bytes from the decoded instruction instead of
+   reading memory again. Disabled tracing costs only the flag check. */
+static inline void cpu_trace_decoded(cpu_t *cpu, cpu_decoded_t *decoded)
 {
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  uint8_t mc[3];
+
+  if (! cpu_trace_on) {
+    return;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
+
+  mc[0] = decoded->opcode;
+  mc[1] = decoded->operand[0];
+  mc[2] = decoded->operand[1];
+  cpu_trace_store(cpu, mc);
 }
 
-static void op_rra_absx(cpu_t *cpu, mem_t *mem)
+
+
+/* Same as cpu_trace_decoded() but for instruction bytes in an array. */
+static inline void cpu_trace_code(cpu_t *cpu, const uint8_t mc[3])
 {
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  if (! cpu_trace_on) {
+    return;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
+
+  cpu_trace_store(cpu, mc);
 }
 
-static void op_rra_absy(cpu_t *cpu, mem_t *mem)
+
+
+/* Adds the trace of the last loop iteration again for skipped ones. Only
+   the last entries are kept, so no more than needed are added. The stream
+   is only used with idle loop skipping disabled. */
+static void cpu_trace_repeat(uint8_t length, uint32_t instructions)
 {
-  OP_PROLOGUE_ABSY
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  uint32_t source;
+
+  if (! cpu_trace_ring || cpu_trace_count < length) {
+    return;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
-}
 
-static void op_rra_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  if (instructions > cpu_trace_size) {
+    instructions = cpu_trace_size +
+      ((instructions - cpu_trace_size) % length);
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
-}
 
-static void op_rra_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  while (instructions > 0) {
+    cpu_trace_index++;
+    if (cpu_trace_index >= cpu_trace_size) {
+      cpu_trace_index = 0;
+    }
+    if (cpu_trace_count < cpu_trace_size) {
+      cpu_trace_count++;
+    }
+    source = (cpu_trace_index + cpu_trace_size - length) % cpu_trace_size;
+    cpu_trace_buffer[cpu_trace_index] = cpu_trace_buffer[source];
+    instructions--;
   }
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
 }
 
-static void op_rra_zpyi(cpu_t *cpu, mem_t *mem)
+
+
+/* Skips whole iterations of a loop found idle, given the cycles left of
+   the budget. The last one must start before the budget is spent. */
+CPU_COLD static uint32_t cpu_idle_skip(uint8_t length, uint32_t remaining,
+  uint64_t cycles)
 {
-  OP_PROLOGUE_ZPYI
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  uint32_t iterations;
+
+  cpu_idle.loop_cycles = cycles - cpu_idle.visit_cycles;
+  if (cpu_idle.loop_cycles == 0 || remaining == 0) {
+    return 0;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
-}
 
-static void op_rra_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  if (cpu->sr.c == 1) {
-    value |= 0b10000000;
+  iterations = (remaining - 1) / cpu_idle.loop_cycles;
+  if (iterations > 0) {
+    cpu_trace_repeat(length, iterations * length);
+    cpu_idle.skipped += iterations * cpu_idle.loop_cycles;
+  }
+  return iterations;
+}
+
+
+
+/* Called before the first instruction of an idle loop. If the registers are
+   the same as on the last visit, exactly one iteration ago and with no
+   device event since, then every iteration until the next event is the
+   same too. Returns the number of iterations that can be skipped before
+   the cycle budget is spent, with cpu_idle.loop_cycles set to the cycles of
+   each. Only the rare skip is done out of line, so the registers of the
+   run loop are never passed by reference to other functions.
+
+   The budget ends at the next device event of any kind, not at the next
+   NMI. Most of those events are scanlines, which can set sprite 0 hit
+   and overflow in the status register or raise an MMC3 IRQ, and the APU
+   sequencer steps change the length counters in 0x4015. Not knowing
+   which of them the program can see, a waiting loop is skipped one
+   scanline at a time, and after each event it runs one iteration to
+   check itself again. */
+static inline uint32_t cpu_idle_check(cpu_t *cpu, uint8_t length,
+  uint32_t budget, uint32_t count)
+{
+  uint64_t instructions;
+  uint64_t cycles;
+  uint32_t iterations;
+
+  instructions = cpu_idle.instructions + count;
+  cycles = cpu_idle.cycles + cpu->cycles;
+  iterations = 0;
+
+  if (cpu_idle.enabled &&
+      cpu_idle.visit_window == cpu_idle.window &&
+      cpu_idle.visit_instructions + length == instructions &&
+      cpu_idle.cpu.pc == cpu->pc &&
+      cpu_idle.cpu.a == cpu->a &&
+      cpu_idle.cpu.x == cpu->x &&
+      cpu_idle.cpu.y == cpu->y &&
+      cpu_idle.cpu.sp == cpu->sp &&
+      cpu_idle.cpu.sr == cpu->sr &&
+      cpu_idle.cpu.n_result == cpu->n_result &&
+      cpu_idle.cpu.z_result == cpu->z_result &&
+      cpu->cycles < budget) {
+    iterations = cpu_idle_skip(length, budget - cpu->cycles, cycles);
+    instructions += iterations * length;
+    cycles += iterations * cpu_idle.loop_cycles;
   }
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu_logic_adc(cpu, value);
-}
 
-static void op_sax_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  mem_write(mem, absolute, cpu->a & cpu->x);
+  cpu_idle.cpu = *cpu;
+  cpu_idle.visit_instructions = instructions;
+  cpu_idle.visit_cycles = cycles;
+  cpu_idle.visit_window = cpu_idle.window;
+  return iterations;
 }
 
-static void op_sax_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  mem_write(mem, zeropage, cpu->a & cpu->x);
-}
 
-static void op_sax_zpy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPY
-  mem_write(mem, zeropage, cpu->a & cpu->x);
-}
 
-static void op_sax_zpix(cpu_t *cpu, mem_t *mem)
+/* Keeps the position of the CPU across runs for idle loop detection. A run
+   ending on a spent budget means a device event may have happened. */
+static inline void cpu_idle_run_start(uint32_t cycles)
 {
-  OP_PROLOGUE_ZPIX
-  mem_write(mem, absolute, cpu->a & cpu->x);
+  cpu_idle.cycles -= cycles;
 }
 
-static void op_sbx_imm(cpu_t *cpu, mem_t *mem)
+static inline void cpu_idle_run_end(uint32_t cycles, uint32_t budget,
+  uint32_t count)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
-  uint16_t temp;
-  temp = (cpu->a & cpu->x) - value;
-  cpu->x = temp;
-  cpu->sr.c = ~(temp >> 8);
-  cpu_flag_negative_other(cpu, cpu->x);
-  cpu_flag_zero_other(cpu, cpu->x);
+  cpu_idle.cycles += cycles;
+  cpu_idle.instructions += count;
+  if (cycles >= budget) {
+    cpu_idle.window++;
+  }
 }
 
-static void op_sha_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY
-  panic("SHA (absy) undocumented opcode not implemented!\n");
-}
 
-static void op_sha_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI
-  panic("SHA (zpyi) undocumented opcode not implemented!\n");
-}
 
-static void op_shx_absy(cpu_t *cpu, mem_t *mem)
+void cpu_idle_enable(bool enable)
 {
-  OP_PROLOGUE_ABSY
-  absolute = ((cpu->x & ((absolute >> 8) + 1)) << 8) | (absolute & 0xff);
-  mem_write(mem, absolute, absolute >> 8);
+  cpu_idle.enabled = enable;
 }
 
-static void op_shy_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  absolute = ((cpu->y & ((absolute >> 8) + 1)) << 8) | (absolute & 0xff);
-  mem_write(mem, absolute, absolute >> 8);
-}
 
-static void op_slo_abs(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_slo_absx(cpu_t *cpu, mem_t *mem)
+uint64_t cpu_idle_skipped(void)
 {
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  return cpu_idle.skipped;
 }
 
-static void op_slo_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_slo_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_slo_zpx(cpu_t *cpu, mem_t *mem)
+/* The run loop built in, for benchmark reports. */
+const char *cpu_core_name(void)
 {
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+#if defined(CPU_DYNAREC)
+  return "dynarec";
+#elif defined(CPU_RECOMP)
+  return "recomp";
+#elif defined(CPU_TABLE)
+  return "table";
+#elif defined(CPU_THREADED) && defined(__GNUC__)
+  return "threaded";
+#else
+  return "switch";
+#endif
 }
 
-static void op_slo_zpyi(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPYI
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_slo_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b10000000;
-  value = value << 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a |= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_sre_abs(cpu_t *cpu, mem_t *mem)
+/* Runs with watchpoints on the zero page or stack, which the normal
+   handlers access directly, using the handlers that do not. Idle loops are
+   not skipped and instructions are not fused. */
+CPU_COLD static uint32_t cpu_run_watched(cpu_t *cpu, mem_t *mem,
+  uint32_t budget)
 {
-  OP_PROLOGUE_ABS
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  cpu_decoded_t *decoded;
+  uint32_t count = 0;
 
-static void op_sre_absx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  mem->break_run = false;
+  cpu_idle_run_start(cpu->cycles);
 
-static void op_sre_absy(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ABSY
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  while (cpu->cycles < budget && ! mem->break_run) {
+    if (cpu_break_page[cpu->pc / 256] && cpu_break_stop(cpu)) {
+      break;
+    }
+    decoded = cpu_decode(cpu, mem);
+    HEATMAP_CPU(execute, cpu->pc)
+    cpu->sync_cycles = cpu->cycles;
+    cpu->sync_instructions = count;
+    cpu_trace_decoded(cpu, decoded);
+    cpu->pc++;
+    cpu->cycles += decoded->cycles;
+    cpu->operand = decoded->operand;
+    (opcode_function_watched[decoded->opcode])(cpu, mem);
+    count++;
+  }
+  cpu_idle_run_end(cpu->cycles, budget, count);
+  mem->break_run = true;
+  return count;
 }
 
-static void op_sre_zp(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZP
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_sre_zpx(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPX
-  uint8_t value = mem_read(mem, zeropage);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, zeropage, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, zeropage);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
 
-static void op_sre_zpyi(cpu_t *cpu, mem_t *mem)
+void cpu_execute(cpu_t *cpu, mem_t *mem)
 {
-  OP_PROLOGUE_ZPYI
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
-}
+  cpu_decoded_t *decoded;
+#ifdef CPU_HISTOGRAM
+  uint32_t start = cpu->cycles;
+#endif
 
-static void op_sre_zpix(cpu_t *cpu, mem_t *mem)
-{
-  OP_PROLOGUE_ZPIX
-  uint8_t value = mem_read(mem, absolute);
-  bool bit = value & 0b00000001;
-  value = value >> 1;
-  mem_write(mem, absolute, value);
-  cpu->sr.c = bit;
-  cpu->a ^= mem_read(mem, absolute);
-  cpu_flag_negative_other(cpu, cpu->a);
-  cpu_flag_zero_other(cpu, cpu->a);
+  decoded = cpu_decode(cpu, mem);
+  CPU_RECOMP_MARK(cpu->pc)
+  HEATMAP_CPU(execute, cpu->pc)
+  cpu->pc++;
+  cpu->cycles += decoded->cycles;
+  cpu->operand = decoded->operand;
+  (decoded->func)(cpu, mem);
+  CPU_HISTOGRAM_COUNT(decoded->opcode, start)
 }
 
-static void op_tas_absy(cpu_t *cpu, mem_t *mem)
+
+
+/* Executes one instruction straight from the opcode tables, bypassing the
+   decode cache and every optimization of the run loops, as a reference. */
+void cpu_execute_reference(cpu_t *cpu, mem_t *mem)
 {
-  OP_PROLOGUE_ABSY
-  panic("TAS undocumented opcode not implemented!\n");
+  cpu_decoded_t decoded;
+
+  cpu_decode_at(mem, cpu->pc, &decoded);
+  cpu->pc++;
+  cpu->cycles += decoded.cycles;
+  cpu->operand = decoded.operand;
+  (decoded.func)(cpu, mem);
 }
 
-static void op_usbc_imm(cpu_t *cpu, mem_t *mem)
+
+
+#if defined(CPU_DYNAREC)
+/* Runs translated blocks from the dynamic recompiler where available and
+   interprets single instructions everywhere else. */
+uint32_t cpu_run_cycles(cpu_t *cpu, mem_t *mem, uint32_t budget)
 {
-  uint8_t value = mem_read(mem, cpu->pc++);
-  cpu_logic_sbc(cpu, value);
+  dynarec_block_t block;
+  uint32_t iterations;
+  uint32_t count = 0;
+
+  if (mem->watch_page[0x00] || mem->watch_page[0x01]) {
+    return cpu_run_watched(cpu, mem, budget);
+  }
+
+  mem->break_run = false;
+  cpu_idle_run_start(cpu->cycles);
+
+  while (cpu->cycles < budget && ! mem->break_run) {
+    /* Blocks end before breakpoints, so checking at the start is enough. */
+    if (cpu_break_page[cpu->pc / 256] && cpu_break_stop(cpu)) {
+      break;
+    }
+    if (cpu_decoded[cpu->pc].idle != 0 &&
+        cpu_decoded[cpu->pc].idle != CPU_IDLE_BREAK) {
+      iterations = cpu_idle_check(cpu, cpu_decoded[cpu->pc].idle,
+        budget, count);
+      cpu->cycles += iterations * cpu_idle.loop_cycles;
+      count += iterations * cpu_decoded[cpu->pc].idle;
+    }
+#if defined(CPU_HISTOGRAM) || defined(CPU_RECOMP_LOG) || defined(HEATMAP)
+    block = NULL; /* Interpret everything to see every instruction. */
+#else
+    block = dynarec_block(cpu->pc, mem);
+#endif
+    if (block != NULL) {
+      count = (block)(cpu, mem, budget, count);
+    } else {
+      cpu->sync_cycles = cpu->cycles;
+      cpu->sync_instructions = count;
+      cpu_trace_decoded(cpu, cpu_decode(cpu, mem));
+      cpu_execute(cpu, mem);
+      count++;
+    }
+  }
+  cpu_idle_run_end(cpu->cycles, budget, count);
+  mem->break_run = true;
+  return count;
+}
+
+#elif defined(CPU_RECOMP)
+/* The code translated ahead of time works like the run loop below, on a
+   local copy of the registers, with the instruction bytes taken from the
+   copy of the ROM it was translated from. */
+#define CPU_RECOMP_PROLOGUE \
+  cpu_t registers; \
+  cpu_t *cpu = &registers; \
+  uint32_t iterations; \
+  registers = *state;
+
+#define CPU_RECOMP_FETCH(address, base, length) \
+  if (cpu->cycles >= budget || mem->break_run) { \
+    goto done; \
+  } \
+  if (length != 0) { \
+    iterations = cpu_idle_check(cpu, length, budget, count); \
+    cpu->cycles += iterations * cpu_idle.loop_cycles; \
+    count += iterations * length; \
+  } \
+  state->sync_cycles = cpu->cycles; \
+  state->sync_instructions = count; \
+  cpu->pc = address; \
+  HEATMAP_CPU(execute, address) \
+  cpu_trace_code(cpu, &cpu_recomp_code[address - CPU_RECOMP_START]); \
+  cpu->pc = address + 1; \
+  cpu->cycles += base; \
+  cpu->operand = &cpu_recomp_code[address + 1 - CPU_RECOMP_START]; \
+  count++;
+
+#define CPU_RECOMP_EPILOGUE \
+  CPU_RUN_STORE \
+  return count;
+
+#include "cpu_recomp.h"
+
+
+
+/* Translated code is only used while the ROM mapped in is the one it was
+   translated from. Its pages are watched as code, so that a mapper
+   switching banks there turns it off through cpu_code_bank(). */
+static void cpu_recomp_check(mem_t *mem)
+{
+  int page;
+
+  if (cpu_recomp_checksum(mem) != CPU_RECOMP_CHECKSUM) {
+    cpu_recomp_enabled = false;
+    return;
+  }
+  for (page = CPU_RECOMP_START / 256; page <= UINT8_MAX; page++) {
+    mem_code_page_set(mem, page, true);
+  }
 }
 
 
 
-static void op_none(cpu_t *cpu, mem_t *mem)
+/* Runs the code translated ahead of time when the PC is in it and the ROM
+   is the one it was translated from, and interprets single instructions
+   everywhere else. */
+uint32_t cpu_run_cycles(cpu_t *cpu, mem_t *mem, uint32_t budget)
 {
-  uint8_t opcode;
-  opcode = mem_read(mem, cpu->pc - 1);
+  uint32_t iterations;
+  uint32_t translated;
+  uint32_t count = 0;
 
-  if (cpu_trap_opcode_handler != NULL) {
-    if (true == (cpu_trap_opcode_handler)(opcode, cpu, mem)) {
-      /* Request was handled...  */
-      return;
+  if (mem->watch_page[0x00] || mem->watch_page[0x01]) {
+    return cpu_run_watched(cpu, mem, budget);
+  }
+
+  mem->break_run = false;
+  cpu_idle_run_start(cpu->cycles);
+
+  while (cpu->cycles < budget && ! mem->break_run) {
+    /* The translated code has no breakpoint checks. */
+    if (cpu_recomp_enabled && cpu_break_count == 0 &&
+        cpu->pc >= CPU_RECOMP_START) {
+      translated = cpu_recomp_run(cpu, mem, budget, count);
+      if (translated != count) {
+        count = translated;
+        continue;
+      }
     }
+    if (cpu_break_page[cpu->pc / 256] && cpu_break_stop(cpu)) {
+      break;
+    }
+    if (cpu_decoded[cpu->pc].idle != 0 &&
+        cpu_decoded[cpu->pc].idle != CPU_IDLE_BREAK) {
+      iterations = cpu_idle_check(cpu, cpu_decoded[cpu->pc].idle,
+        budget, count);
+      cpu->cycles += iterations * cpu_idle.loop_cycles;
+      count += iterations * cpu_decoded[cpu->pc].idle;
+    }
+    cpu->sync_cycles = cpu->cycles;
+    cpu->sync_instructions = count;
+    cpu_trace_decoded(cpu, cpu_decode(cpu, mem));
+    cpu_execute(cpu, mem);
+    count++;
   }
-  panic("CPU jam due to unhandled opcode: %02x\n", opcode);
+  cpu_idle_run_end(cpu->cycles, budget, count);
+  mem->break_run = true;
+  return count;
 }
 
-typedef void (*cpu_operation_func_t)(cpu_t *, mem_t *);
+#elif defined(CPU_TABLE)
+/* Calls cpu_execute() for every instruction, which dispatches through the
+   opcode function table with the registers in memory. This is how the CPU
+   ran before the switch and threaded cores, kept to measure them against. */
+uint32_t cpu_run_cycles(cpu_t *cpu, mem_t *mem, uint32_t budget)
+{
+  uint32_t iterations;
+  uint32_t count = 0;
 
-static cpu_operation_func_t opcode_function[UINT8_MAX + 1] = {
-  op_brk,      op_ora_zpix, op_none,     op_slo_zpix, /* 0x00 -> 0x03 */
-  op_nop_zp,   op_ora_zp,   op_asl_zp,   op_slo_zp,   /* 0x04 -> 0x07 */
-  op_php,      op_ora_imm,  op_asl_accu, op_anc_imm,  /* 0x08 -> 0x0B */
-  op_nop_abs,  op_ora_abs,  op_asl_abs,  op_slo_abs,  /* 0x0C -> 0x0F */
-  op_bpl,      op_ora_zpyi, op_none,     op_slo_zpyi, /* 0x10 -> 0x13 */
-  op_nop_zpx,  op_ora_zpx,  op_asl_zpx,  op_slo_zpx,  /* 0x14 -> 0x17 */
-  op_clc,      op_ora_absy, op_nop,      op_slo_absy, /* 0x18 -> 0x1B */
-  op_nop_absx, op_ora_absx, op_asl_absx, op_slo_absx, /* 0x1C -> 0x1F */
-  op_jsr,      op_and_zpix, op_none,     op_rla_zpix, /* 0x20 -> 0x23 */
-  op_bit_zp,   op_and_zp,   op_rol_zp,   op_rla_zp,   /* 0x24 -> 0x27 */
-  op_plp,      op_and_imm,  op_rol_accu, op_anc_imm,  /* 0x28 -> 0x2B */
-  op_bit_abs,  op_and_abs,  op_rol_abs,  op_rla_abs,  /* 0x2C -> 0x2F */
-  op_bmi,      op_and_zpyi, op_none,     op_rla_zpyi, /* 0x30 -> 0x33 */
-  op_nop_zpx,  op_and_zpx,  op_rol_zpx,  op_rla_zpx,  /* 0x34 -> 0x37 */
-  op_sec,      op_and_absy, op_nop,      op_rla_absy, /* 0x38 -> 0x3B */
-  op_nop_absx, op_and_absx, op_rol_absx, op_rla_absx, /* 0x3C -> 0x3F */
-  op_rti,      op_eor_zpix, op_none,     op_sre_zpix, /* 0x40 -> 0x43 */
-  op_nop_zp,   op_eor_zp,   op_lsr_zp,   op_sre_zp,   /* 0x44 -> 0x47 */
-  op_pha,      op_eor_imm,  op_lsr_accu, op_alr_imm,  /* 0x48 -> 0x4B */
-  op_jmp_abs,  op_eor_abs,  op_lsr_abs,  op_sre_abs,  /* 0x4C -> 0x4F */
-  op_bvc,      op_eor_zpyi, op_none,     op_sre_zpyi, /* 0x50 -> 0x53 */
-  op_nop_zpx,  op_eor_zpx,  op_lsr_zpx,  op_sre_zpx,  /* 0x54 -> 0x57 */
-  op_cli,      op_eor_absy, op_nop,      op_sre_absy, /* 0x58 -> 0x5B */
-  op_nop_absx, op_eor_absx, op_lsr_absx, op_sre_absx, /* 0x5C -> 0x5F */
-  op_rts,      op_adc_zpix, op_none,     op_rra_zpix, /* 0x60 -> 0x63 */
-  op_nop_zp,   op_adc_zp,   op_ror_zp,   op_rra_zp,   /* 0x64 -> 0x67 */
-  op_pla,      op_adc_imm,  op_ror_accu, op_arr_imm,  /* 0x68 -> 0x6B */
-  op_jmp_absi, op_adc_abs,  op_ror_abs,  op_rra_abs,  /* 0x6C -> 0x6F */
-  op_bvs,      op_adc_zpyi, op_none,     op_rra_zpyi, /* 0x70 -> 0x73 */
-  op_nop_zpx,  op_adc_zpx,  op_ror_zpx,  op_rra_zpx,  /* 0x74 -> 0x77 */
-  op_sei,      op_adc_absy, op_nop,      op_rra_absy, /* 0x78 -> 0x7B */
-  op_nop_absx, op_adc_absx, op_ror_absx, op_rra_absx, /* 0x7C -> 0x7F */
-  op_nop_imm,  op_sta_zpix, op_nop_imm,  op_sax_zpix, /* 0x80 -> 0x83 */
-  op_sty_zp,   op_sta_zp,   op_stx_zp,   op_sax_zp,   /* 0x84 -> 0x87 */
-  op_dey,      op_nop_imm,  op_txa,      op_ane_imm,  /* 0x88 -> 0x8B */
-  op_sty_abs,  op_sta_abs,  op_stx_abs,  op_sax_abs,  /* 0x8C -> 0x8F */
-  op_bcc,      op_sta_zpyi, op_none,     op_sha_zpyi, /* 0x90 -> 0x93 */
-  op_sty_zpx,  op_sta_zpx,  op_stx_zpy,  op_sax_zpy,  /* 0x94 -> 0x97 */
-  op_tya,      op_sta_absy, op_txs,      op_tas_absy, /* 0x98 -> 0x9B */
-  op_shy_absx, op_sta_absx, op_shx_absy, op_sha_absy, /* 0x9C -> 0x9F */
-  op_ldy_imm,  op_lda_zpix, op_ldx_imm,  op_lax_zpix, /* 0xA0 -> 0xA3 */
-  op_ldy_zp,   op_lda_zp,   op_ldx_zp,   op_lax_zp,   /* 0xA4 -> 0xA7 */
-  op_tay,      op_lda_imm,  op_tax,      op_lxa_imm,  /* 0xA8 -> 0xAB */
-  op_ldy_abs,  op_lda_abs,  op_ldx_abs,  op_lax_abs,  /* 0xAC -> 0xAF */
-  op_bcs,      op_lda_zpyi, op_none,     op_lax_zpyi, /* 0xB0 -> 0xB3 */
-  op_ldy_zpx,  op_lda_zpx,  op_ldx_zpy,  op_lax_zpy,  /* 0xB4 -> 0xB7 */
-  op_clv,      op_lda_absy, op_tsx,      op_las_absy, /* 0xB8 -> 0xBB */
-  op_ldy_absx, op_lda_absx, op_ldx_absy, op_lax_absy, /* 0xBC -> 0xBF */
-  op_cpy_imm,  op_cmp_zpix, op_nop_imm,  op_dcp_zpix, /* 0xC0 -> 0xC3 */
-  op_cpy_zp,   op_cmp_zp,   op_dec_zp,   op_dcp_zp,   /* 0xC4 -> 0xC7 */
-  op_iny,      op_cmp_imm,  op_dex,      op_sbx_imm,  /* 0xC8 -> 0xCB */
-  op_cpy_abs,  op_cmp_abs,  op_dec_abs,  op_dcp_abs,  /* 0xCC -> 0xCF */
-  op_bne,      op_cmp_zpyi, op_none,     op_dcp_zpyi, /* 0xD0 -> 0xD3 */
-  op_nop_zpx,  op_cmp_zpx,  op_dec_zpx,  op_dcp_zpx,  /* 0xD4 -> 0xD7 */
-  op_cld,      op_cmp_absy, op_nop,      op_dcp_absy, /* 0xD8 -> 0xDB */
-  op_nop_absx, op_cmp_absx, op_dec_absx, op_dcp_absx, /* 0xDC -> 0xDF */
-  op_cpx_imm,  op_sbc_zpix, op_nop_imm,  op_isc_zpix, /* 0xE0 -> 0xE3 */
-  op_cpx_zp,   op_sbc_zp,   op_inc_zp,   op_isc_zp,   /* 0xE4 -> 0xE7 */
-  op_inx,      op_sbc_imm,  op_nop,      op_usbc_imm, /* 0xE8 -> 0xEB */
-  op_cpx_abs,  op_sbc_abs,  op_inc_abs,  op_isc_abs,  /* 0xEC -> 0xEF */
-  op_beq,      op_sbc_zpyi, op_none,     op_isc_zpyi, /* 0xF0 -> 0xF3 */
-  op_nop_zpx,  op_sbc_zpx,  op_inc_zpx,  op_isc_zpx,  /* 0xF4 -> 0xF7 */
-  op_sed,      op_sbc_absy, op_nop,      op_isc_absy, /* 0xF8 -> 0xFB */
-  op_nop_absx, op_sbc_absx, op_inc_absx, op_isc_absx, /* 0xFC -> 0xFF */
-};
+  if (mem->watch_page[0x00] || mem->watch_page[0x01]) {
+    return cpu_run_watched(cpu, mem, budget);
+  }
 
+  mem->break_run = false;
+  cpu_idle_run_start(cpu->cycles);
 
+  while (cpu->cycles < budget && ! mem->break_run) {
+    if (cpu_break_page[cpu->pc / 256] && cpu_break_stop(cpu)) {
+      break;
+    }
+    if (cpu_decoded[cpu->pc].idle != 0 &&
+        cpu_decoded[cpu->pc].idle != CPU_IDLE_BREAK) {
+      iterations = cpu_idle_check(cpu, cpu_decoded[cpu->pc].idle,
+        budget, count);
+      cpu->cycles += iterations * cpu_idle.loop_cycles;
+      count += iterations * cpu_decoded[cpu->pc].idle;
+    }
+    cpu->sync_cycles = cpu->cycles;
+    cpu->sync_instructions = count;
+    cpu_trace_decoded(cpu, cpu_decode(cpu, mem));
+    cpu_execute(cpu, mem);
+    count++;
+  }
+  cpu_idle_run_end(cpu->cycles, budget, count);
+  mem->break_run = true;
+  return count;
+}
+
+#else
+/* Runs instructions until the cycle budget is spent or the run is broken.
+   The handlers work on a local copy of the registers, written back at the
+   end. Since all handlers are inlined here and the copy never escapes, the
+   compiler is free to keep it in host registers across memory accesses.
+   With CPU_THREADED each handler jumps directly to the handler of the next
+   opcode using computed goto, otherwise a switch is used. Instruction pairs
+   with a superinstruction are dispatched together, stopping in between only
+   if the first one spends the budget or ends the run, like a watchpoint
+   hit does. Breakpoints are decoded like idle loops, so they cost nothing
+   more until one is reached. */
+#ifdef __GNUC__
+__attribute__((flatten))
+#endif
+uint32_t cpu_run_cycles(cpu_t *state, mem_t *mem, uint32_t budget)
+{
+  cpu_t registers;
+  cpu_t *cpu = &registers;
+  cpu_decoded_t *decoded;
+  uint32_t iterations;
+  uint32_t count = 0;
+
+  if (mem->watch_page[0x00] || mem->watch_page[0x01]) {
+    return cpu_run_watched(state, mem, budget);
+  }
 
-/* Base cycles when page boundary crossing is not considered. */
-static uint8_t opcode_cycles[UINT8_MAX + 1] = {
-/* -0 -1 -2 -3 -4 -5 -6 -7 -8 -9 -A -B -C -D -E -F */
-    7, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6, /* 0x0- */
-    2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, /* 0x1- */
-    6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6, /* 0x2- */
-    2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, /* 0x3- */
-    6, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6, /* 0x4- */
-    2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, /* 0x5- */
-    6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6, /* 0x6- */
-    2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, /* 0x7- */
-    2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4, /* 0x8- */
-    2, 6, 0, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5, /* 0x9- */
-    2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4, /* 0xA- */
-    2, 5, 0, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, /* 0xB- */
-    2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, /* 0xC- */
-    2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, /* 0xD- */
-    2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, /* 0xE- */
-    2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, /* 0xF- */
-};
+  registers = *state;
+  mem->break_run = false;
+  cpu_idle_run_start(cpu->cycles);
+
+/* All cold handlers share a single call through the decoded instruction,
+   which also covers jams and traps. */
+#define OPCODE_CALL_HOT(func) func(cpu, mem);
+#define OPCODE_CALL_COLD(func) goto cold;
+#define OPCODE_CALL_ALIAS(func) goto cold;
+
+#define CPU_RUN_FETCH \
+  decoded = cpu_decode(cpu, mem); \
+  CPU_FUSE_COUNT(cpu->pc, decoded) \
+  CPU_RECOMP_MARK(cpu->pc) \
+  HEATMAP_CPU(execute, cpu->pc) \
+  if (decoded->idle != 0) { \
+    if (decoded->idle == CPU_IDLE_BREAK) { \
+      if (cpu_break_stop(cpu)) { \
+        goto done; \
+      } \
+    } else { \
+      iterations = cpu_idle_check(cpu, decoded->idle, budget, count); \
+      cpu->cycles += iterations * cpu_idle.loop_cycles; \
+      count += iterations * decoded->idle; \
+    } \
+  } \
+  state->sync_cycles = cpu->cycles; \
+  state->sync_instructions = count; \
+  cpu_trace_decoded(cpu, decoded); \
+  cpu->pc++; \
+  cpu->cycles += decoded->cycles; \
+  cpu->operand = decoded->operand; \
+  count++;
+
+/* The second instruction of a pair was decoded along with the first and its
+   bytes can not change without invalidating the first, so it is taken from
+   the table directly. Skipping the idle loop check is always safe. */
+#define CPU_RUN_FETCH_FUSED \
+  decoded = &cpu_decoded[cpu->pc]; \
+  CPU_RECOMP_MARK(cpu->pc) \
+  HEATMAP_CPU(execute, cpu->pc) \
+  state->sync_cycles = cpu->cycles; \
+  state->sync_instructions = count; \
+  cpu_trace_decoded(cpu, decoded); \
+  cpu->pc++; \
+  cpu->cycles += decoded->cycles; \
+  cpu->operand = decoded->operand; \
+  count++;
+
+#if defined(CPU_THREADED) && defined(__GNUC__)
+#define OPCODE_LABEL(opcode, mnemonic, operation, mode, cycles, class) \
+  [opcode] = &&label_##opcode,
+#define OPCODE_THREADED(opcode, mnemonic, operation, mode, cycles, class) \
+  label_##opcode: \
+    OPCODE_CALL_##class(OP_NAME(operation, mode)) \
+    CPU_HISTOGRAM_COUNT(opcode, state->sync_cycles) \
+    CPU_THREADED_DISPATCH
+#define FUSE_LABEL(n, a, fa, b, fb) [UINT8_MAX + n] = &&label_fuse_##n,
+#define FUSE_THREADED(n, a, fa, b, fb) \
+  label_fuse_##n: \
+    fa(cpu, mem); \
+    CPU_HISTOGRAM_COUNT(a, state->sync_cycles) \
+    if (cpu->cycles >= budget || mem->break_run) { \
+      goto done; \
+    } \
+    CPU_RUN_FETCH_FUSED \
+    goto label_##b;
+#define CPU_THREADED_DISPATCH \
+  if (cpu->cycles >= budget || mem->break_run) { \
+    goto done; \
+  } \
+  CPU_RUN_FETCH \
+  goto *dispatch[decoded->key];
+
+  static void *dispatch[UINT8_MAX + 1 + CPU_FUSE_MAX] = {
+    CPU_OPCODE_TABLE(OPCODE_LABEL)
+    CPU_FUSE_TABLE(FUSE_LABEL)
+  };
+
+  CPU_THREADED_DISPATCH
+  CPU_OPCODE_TABLE(OPCODE_THREADED)
+  CPU_FUSE_TABLE(FUSE_THREADED)
+
+  cold:
+    CPU_RUN_COLD(decoded->func)
+    CPU_HISTOGRAM_COUNT(decoded->opcode, state->sync_cycles)
+    CPU_THREADED_DISPATCH
+
+#else
+#define OPCODE_CASE(opcode, mnemonic, operation, mode, cycles, class) \
+  case opcode: \
+    OPCODE_CALL_##class(OP_NAME(operation, mode)) \
+    CPU_HISTOGRAM_COUNT(opcode, state->sync_cycles) \
+    break;
+#define FUSE_CASE(n, a, fa, b, fb) \
+  case UINT8_MAX + n: \
+    fa(cpu, mem); \
+    CPU_HISTOGRAM_COUNT(a, state->sync_cycles) \
+    if (cpu->cycles >= budget || mem->break_run) { \
+      break; \
+    } \
+    CPU_RUN_FETCH_FUSED \
+    fb(cpu, mem); \
+    CPU_HISTOGRAM_COUNT(b, state->sync_cycles) \
+    break;
 
+  while (cpu->cycles < budget && ! mem->break_run) {
+    CPU_RUN_FETCH
+    switch (decoded->key) {
+    CPU_OPCODE_TABLE(OPCODE_CASE)
+    CPU_FUSE_TABLE(FUSE_CASE)
+    }
+    continue;
 
+  cold:
+    CPU_RUN_COLD(decoded->func)
+    CPU_HISTOGRAM_COUNT(decoded->opcode, state->sync_cycles)
+  }
+  goto done;
+#endif /* CPU_THREADED */
 
-void cpu_execute(cpu_t *cpu, mem_t *mem)
-{
-  uint8_t opcode;
-  opcode = mem_read(mem, cpu->pc++);
-  cpu->cycles += opcode_cycles[opcode];
-  (opcode_function[opcode])(cpu, mem);
+done:
+  cpu_idle_run_end(cpu->cycles, budget, count);
+  CPU_RUN_STORE
+  mem->break_run = true;
+  return count;
 }
+#endif /* CPU_DYNAREC */
 
 
 
@@ -2713,24 +3060,40 @@ void cpu_reset(cpu_t *cpu, mem_t *mem)
   cpu->x = 0;
   cpu->y = 0;
   cpu->sp = 0xFD;
-  cpu->sr.n = 0;
-  cpu->sr.v = 0;
-  cpu->sr.b = 0;
-  cpu->sr.d = 0;
-  cpu->sr.i = 1;
-  cpu->sr.z = 0;
-  cpu->sr.c = 0;
+  cpu->sr = CPU_FLAG_I;
+  cpu->n_result = 0;
+  cpu->z_result = 1;
+  cpu->interrupt = 0;
   cpu->cycles = 0;
+  cpu->sync_cycles = 0;
+  cpu->sync_instructions = 0;
+  mem->code_write = cpu_code_write;
+  mem->code_bank = cpu_code_bank;
+
+#ifdef CPU_FUSE_PROFILE
+  cpu_fuse_profile_start();
+#endif
+#ifdef CPU_HISTOGRAM
+  cpu_histogram_start();
+#endif
+#ifdef CPU_RECOMP_LOG
+  cpu_recomp_log_start(mem);
+#endif
+#ifdef CPU_RECOMP
+  cpu_recomp_enabled = true;
+  cpu_recomp_check(mem);
+#endif
 }
 
 
 
 void cpu_nmi(cpu_t *cpu, mem_t *mem)
 {
+  /* Not through mem_write_stack(), to be seen by watchpoints. */
   mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu->pc / 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu->pc % 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu_status_get(cpu, 0));
-  cpu->sr.i = 1;
+  cpu->sr |= CPU_FLAG_I;
   cpu->pc  = mem_read(mem, MEM_VECTOR_NMI_LOW);
   cpu->pc += mem_read(mem, MEM_VECTOR_NMI_HIGH) * 256;
 }
@@ -2739,16 +3102,55 @@ void cpu_nmi(cpu_t *cpu, mem_t *mem)
 
 void cpu_irq(cpu_t *cpu, mem_t *mem)
 {
-  if (cpu->sr.i == 1) {
+  if (cpu->sr & CPU_FLAG_I) {
     return; /* Masked. */
   }
+  /* Not through mem_write_stack(), to be seen by watchpoints. */
   mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu->pc / 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu->pc % 256);
   mem_write(mem, MEM_PAGE_STACK + cpu->sp--, cpu_status_get(cpu, 0));
-  cpu->sr.i = 1;
+  cpu->sr |= CPU_FLAG_I;
   cpu->pc  = mem_read(mem, MEM_VECTOR_IRQ_LOW);
   cpu->pc += mem_read(mem, MEM_VECTOR_IRQ_HIGH) * 256;
 }
 
 
 
+/* Called by the devices to assert interrupt lines. They are only stepped
+   between runs, or on register accesses that end the run, so a line is
+   always visible at the next run boundary. */
+void cpu_interrupt(cpu_t *cpu, uint8_t lines)
+{
+  cpu->interrupt |= lines;
+}
+
+
+
+/* Releases lines not taken yet, for devices acknowledging their IRQ. */
+void cpu_interrupt_clear(cpu_t *cpu, uint8_t lines)
+{
+  cpu->interrupt &= ~lines;
+}
+
+
+
+/* Takes the pending interrupts at an instruction boundary, returning the
+   lines taken. An IRQ stays pending for as long as it is masked. */
+uint8_t cpu_interrupt_poll(cpu_t *cpu, mem_t *mem)
+{
+  uint8_t taken = 0;
+
+  if ((cpu->interrupt & CPU_INTERRUPT_IRQ) && (cpu->sr & CPU_FLAG_I) == 0) {
+    cpu_irq(cpu, mem);
+    taken |= CPU_INTERRUPT_IRQ;
+  }
+  if (cpu->interrupt & CPU_INTERRUPT_NMI) {
+    cpu_nmi(cpu, mem);
+    taken |= CPU_INTERRUPT_NMI;
+  }
+  cpu->interrupt &= ~taken;
+  return taken;
+}
+
+
+
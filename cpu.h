@@ -5,15 +5,18 @@
 #include <stdbool.h>
 #include "mem.h"
 
-typedef struct cpu_status_s {
-  uint8_t n : 1; /* Negative */
-  uint8_t v : 1; /* Overflow */
-  uint8_t b : 1; /* Break */
-  uint8_t d : 1; /* Decimal */
-  uint8_t i : 1; /* Interrupt Disable */
-  uint8_t z : 1; /* Zero */
-  uint8_t c : 1; /* Carry */
-} cpu_status_t;
+#define CPU_FLAG_C 0x01 /* Carry */
+#define CPU_FLAG_Z 0x02 /* Zero */
+#define CPU_FLAG_I 0x04 /* Interrupt Disable */
+#define CPU_FLAG_D 0x08 /* Decimal */
+#define CPU_FLAG_B 0x10 /* Break */
+#define CPU_FLAG_V 0x40 /* Overflow */
+#define CPU_FLAG_N 0x80 /* Negative */
+
+#define CPU_INTERRUPT_NMI 0x01
+#define CPU_INTERRUPT_IRQ 0x02
+
+#define CPU_TRACE_SIZE_DEFAULT 20 /* Entries */
 
 typedef struct cpu_s {
   uint16_t pc;     /* Program Counter */
@@ -21,20 +24,56 @@ typedef struct cpu_s {
   uint8_t x;       /* X Register */
   uint8_t y;       /* Y Register */
   uint8_t sp;      /* Stack Pointer */
-  cpu_status_t sr; /* Status Register */
+  uint8_t sr;      /* Status Register, except N and Z: */
+  uint8_t n_result; /* N is bit 7 of the last result. */
+  uint8_t z_result; /* Z is set if the last result was zero. */
+  uint8_t interrupt; /* Pending interrupt lines. */
   uint32_t cycles; /* Internal Cycle Counter */
+  uint32_t sync_cycles;       /* Cycles and instructions of the current */
+  uint32_t sync_instructions; /* run before the current instruction. */
+  const uint8_t *operand; /* Operand bytes of the current instruction. */
 } cpu_t;
 
 typedef bool (*cpu_opcode_handler_t)(uint32_t, cpu_t *, mem_t *);
+typedef void (*cpu_operation_func_t)(cpu_t *, mem_t *);
 
 void cpu_reset(cpu_t *cpu, mem_t *mem);
 void cpu_execute(cpu_t *cpu, mem_t *mem);
+void cpu_execute_reference(cpu_t *cpu, mem_t *mem);
+uint32_t cpu_run_cycles(cpu_t *cpu, mem_t *mem, uint32_t budget);
+cpu_operation_func_t cpu_opcode_function(uint8_t opcode);
+uint8_t cpu_opcode_cycles(uint8_t opcode);
+int cpu_opcode_size(uint8_t opcode);
+void cpu_predecode(mem_t *mem, uint16_t start, uint16_t end);
+void cpu_code_flush(mem_t *mem);
+void cpu_idle_enable(bool enable);
+uint64_t cpu_idle_skipped(void);
+const char *cpu_core_name(void);
 void cpu_trap_opcode(uint8_t opcode, cpu_opcode_handler_t handler);
 void cpu_nmi(cpu_t *cpu, mem_t *mem);
 void cpu_irq(cpu_t *cpu, mem_t *mem);
+void cpu_interrupt(cpu_t *cpu, uint8_t lines);
+void cpu_interrupt_clear(cpu_t *cpu, uint8_t lines);
+uint8_t cpu_interrupt_poll(cpu_t *cpu, mem_t *mem);
 
-void cpu_trace_init(void);
-void cpu_trace_add(cpu_t *cpu, mem_t *mem);
+void cpu_break_set(mem_t *mem, uint16_t address, bool set);
+bool cpu_break_at(uint16_t address);
+bool cpu_break_hit(void);
+void cpu_break_dump(FILE *fh);
+
+int cpu_trace_init(uint32_t size);
+void cpu_trace_enable(bool enable);
+void cpu_trace_stream_enable(bool enable);
+bool cpu_trace_enabled(void);
+bool cpu_trace_active(void);
+uint32_t cpu_trace_entries(void);
+void cpu_trace_bytes(cpu_t *cpu, const uint8_t *code);
 void cpu_trace_dump(FILE *fh);
+void cpu_register_dump(FILE *fh, cpu_t *cpu, const uint8_t mc[3]);
+void cpu_state_dump(FILE *fh, cpu_t *cpu, mem_t *mem);
+
+#ifdef CPU_HISTOGRAM
+void cpu_histogram_dump(FILE *fh);
+#endif
 
 #endif /* _CPU_H */
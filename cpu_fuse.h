@@ -0,0 +1,17 @@
+#ifndef _CPU_FUSE_H
+#define _CPU_FUSE_H
+
+/* Generated by a CPU_FUSE_PROFILE build from the opcode pair counts in
+   cpu_fuse.csv, use "make fuse ROM=..." to update. */
+
+#define CPU_FUSE_TABLE(X) \
+  X(1, 0xC8, op_iny, 0xC0, op_cpy_imm) \
+  X(2, 0xC0, op_cpy_imm, 0xD0, op_bne) \
+  X(3, 0x0A, op_asl_accu, 0x65, op_adc_zp) \
+  X(4, 0xA8, op_tay, 0xB9, op_lda_absy) \
+  X(5, 0x29, op_and_imm, 0xA8, op_tay) \
+  X(6, 0xCA, op_dex, 0x10, op_bpl) \
+  X(7, 0x18, op_clc, 0x7D, op_adc_absx) \
+  X(8, 0x8A, op_txa, 0x48, op_pha) \
+
+#endif /* _CPU_FUSE_H */
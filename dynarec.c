@@ -0,0 +1,398 @@
+#ifdef CPU_DYNAREC
+#include "dynarec.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "mem.h"
+
+#if ! defined(__x86_64__) || defined(_WIN32)
+#error "The dynamic recompiler needs an x86-64 System V host."
+#endif
+
+/* Translated blocks call the existing opcode handlers back to back, so the
+   host code only replaces the fetch and dispatch of the interpreter. The
+   operand pointer given to the handlers points straight into cartridge
+   memory, which is safe since writes and bank switches there invalidate
+   the block. Each block is a function taking the CPU, memory, cycle budget
+   and instruction count, returning the updated count. Budget and run break
+   are checked before every instruction, so a block may exit anywhere in
+   the middle. */
+
+#define DYNAREC_CODE_SIZE 0x400000 /* 4MB */
+#define DYNAREC_CODE_START 0x6000 /* RAM and I/O below is interpreted. */
+#define DYNAREC_BLOCK_MAX 64 /* Instructions */
+#define DYNAREC_INSTRUCTION_MAX 128 /* Host code bytes */
+#define DYNAREC_EXIT_MAX 64 /* Host code bytes for prologue and exit. */
+
+static uint8_t *dynarec_code = NULL;
+static size_t dynarec_code_used = 0;
+static bool dynarec_disabled = false;
+static uint8_t *dynarec_emit_ptr;
+
+static dynarec_block_t dynarec_table[UINT16_MAX + 1];
+static uint8_t dynarec_block_size[UINT16_MAX + 1];
+static bool dynarec_page[UINT8_MAX + 1];
+
+
+
+static inline void dynarec_emit_8(uint8_t value)
+{
+  *dynarec_emit_ptr++ = value;
+}
+
+
+
+static inline void dynarec_emit_32(uint32_t value)
+{
+  memcpy(dynarec_emit_ptr, &value, sizeof(uint32_t));
+  dynarec_emit_ptr += sizeof(uint32_t);
+}
+
+
+
+static inline void dynarec_emit_64(uint64_t value)
+{
+  memcpy(dynarec_emit_ptr, &value, sizeof(uint64_t));
+  dynarec_emit_ptr += sizeof(uint64_t);
+}
+
+
+
+/* Emits: mov rdi, rbx; mov rsi, r12; mov rax, func; call rax */
+static void dynarec_emit_call(uint64_t func)
+{
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xDF);
+  dynarec_emit_8(0x4C);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xE6);
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0xB8);
+  dynarec_emit_64(func);
+  dynarec_emit_8(0xFF);
+  dynarec_emit_8(0xD0);
+}
+
+
+
+/* Emits: mov rdi, rbx; mov rsi, code; mov rax, cpu_trace_bytes; call rax */
+static void dynarec_emit_trace(const uint8_t *code)
+{
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xDF);
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0xBE);
+  dynarec_emit_64((uint64_t)(uintptr_t)code);
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0xB8);
+  dynarec_emit_64((uint64_t)(uintptr_t)cpu_trace_bytes);
+  dynarec_emit_8(0xFF);
+  dynarec_emit_8(0xD0);
+}
+
+
+
+/* Emits a conditional jump with the 32-bit displacement left for later. */
+static uint8_t *dynarec_emit_jcc(uint8_t condition)
+{
+  uint8_t *displacement;
+
+  dynarec_emit_8(0x0F);
+  dynarec_emit_8(condition);
+  displacement = dynarec_emit_ptr;
+  dynarec_emit_32(0);
+  return displacement;
+}
+
+
+
+static void dynarec_emit_instruction(uint16_t pc, uint8_t opcode,
+  const uint8_t *operand, uint8_t **exits)
+{
+  /* mov eax, [rbx + cycles]; cmp eax, r13d; jae exit */
+  dynarec_emit_8(0x8B);
+  dynarec_emit_8(0x83);
+  dynarec_emit_32(offsetof(cpu_t, cycles));
+  dynarec_emit_8(0x44);
+  dynarec_emit_8(0x39);
+  dynarec_emit_8(0xE8);
+  exits[0] = dynarec_emit_jcc(0x83);
+
+  /* cmp byte [r12 + break_run], 0; jne exit */
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x80);
+  dynarec_emit_8(0xBC);
+  dynarec_emit_8(0x24);
+  dynarec_emit_32(offsetof(mem_t, break_run));
+  dynarec_emit_8(0x00);
+  exits[1] = dynarec_emit_jcc(0x85);
+
+  /* mov [rbx + sync_cycles], eax; mov [rbx + sync_instructions], r14d */
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0x83);
+  dynarec_emit_32(offsetof(cpu_t, sync_cycles));
+  dynarec_emit_8(0x44);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xB3);
+  dynarec_emit_32(offsetof(cpu_t, sync_instructions));
+
+  /* Blocks are flushed when tracing is toggled. */
+  if (cpu_trace_active()) {
+    dynarec_emit_trace(operand - 1);
+  }
+
+  /* mov word [rbx + pc], pc + 1 */
+  dynarec_emit_8(0x66);
+  dynarec_emit_8(0xC7);
+  dynarec_emit_8(0x83);
+  dynarec_emit_32(offsetof(cpu_t, pc));
+  dynarec_emit_8((pc + 1) & 0xFF);
+  dynarec_emit_8((pc + 1) >> 8);
+
+  /* mov rax, operand; mov [rbx + operand], rax */
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0xB8);
+  dynarec_emit_64((uint64_t)(uintptr_t)operand);
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0x83);
+  dynarec_emit_32(offsetof(cpu_t, operand));
+
+  /* add dword [rbx + cycles], base cycles; inc r14d */
+  dynarec_emit_8(0x83);
+  dynarec_emit_8(0x83);
+  dynarec_emit_32(offsetof(cpu_t, cycles));
+  dynarec_emit_8(cpu_opcode_cycles(opcode));
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0xFF);
+  dynarec_emit_8(0xC6);
+
+  dynarec_emit_call((uint64_t)(uintptr_t)cpu_opcode_function(opcode));
+}
+
+
+
+static bool dynarec_ends_block(uint8_t opcode, uint16_t operand)
+{
+  switch (opcode) {
+  case 0x00: /* BRK */
+  case 0x20: /* JSR */
+  case 0x40: /* RTI */
+  case 0x4C: /* JMP */
+  case 0x60: /* RTS */
+  case 0x6C: /* JMP (a) */
+    return true;
+
+  default:
+    break;
+  }
+
+  if ((opcode & 0x1F) == 0x10) {
+    return true; /* Branch */
+  }
+
+  if (cpu_opcode_size(opcode) == 3) {
+    /* Absolute access, possibly indexed, to PPU/APU registers. */
+    if (operand + 0xFF >= 0x2000 && operand <= 0x401F) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+void dynarec_invalidate(void *mem, uint16_t address)
+{
+  int page_start;
+  int start;
+
+  (void)mem;
+  if (! dynarec_page[address / 256]) {
+    return;
+  }
+
+  /* Blocks are shorter than a page, so they start here or in the page
+     before if they cover this one. */
+  page_start = address & 0xFF00;
+  for (start = page_start - 256; start < page_start + 256; start++) {
+    if (start < 0) {
+      continue;
+    }
+    if (dynarec_table[start] != NULL &&
+        start + dynarec_block_size[start] > page_start) {
+      dynarec_table[start] = NULL;
+    }
+  }
+  dynarec_page[address / 256] = false;
+}
+
+
+
+/* Host memory of cartridge code, from the page table since the pages may be
+   banked in from different places. */
+static uint8_t *dynarec_code_at(mem_t *mem, uint32_t address)
+{
+  return &mem_page_unwatched(mem, address / 256)->read[address % 256];
+}
+
+
+
+static dynarec_block_t dynarec_translate(uint16_t pc, mem_t *mem)
+{
+  uint8_t *exits[DYNAREC_BLOCK_MAX * 2];
+  uint8_t *code;
+  uint8_t *block;
+  uint8_t opcode;
+  uint16_t operand;
+  uint32_t address;
+  int32_t displacement;
+  int size;
+  int n;
+  int i;
+
+  if (dynarec_code == NULL) {
+    dynarec_code = mmap(NULL, DYNAREC_CODE_SIZE,
+      PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dynarec_code == MAP_FAILED) {
+      dynarec_code = NULL;
+      dynarec_disabled = true;
+      return NULL;
+    }
+  }
+
+  if (dynarec_code_used + (DYNAREC_BLOCK_MAX * DYNAREC_INSTRUCTION_MAX) +
+    DYNAREC_EXIT_MAX > DYNAREC_CODE_SIZE) {
+    dynarec_flush();
+  }
+
+  block = dynarec_code + dynarec_code_used;
+  dynarec_emit_ptr = block;
+
+  /* push rbx; push r12; push r13; push r14; push r15 */
+  dynarec_emit_8(0x53);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x54);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x55);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x56);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x57);
+
+  /* mov rbx, rdi; mov r12, rsi; mov r13d, edx; mov r14d, ecx */
+  dynarec_emit_8(0x48);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xFB);
+  dynarec_emit_8(0x49);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xF4);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xD5);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xCE);
+
+  address = pc;
+  for (n = 0; n < DYNAREC_BLOCK_MAX; n++) {
+    code = dynarec_code_at(mem, address);
+    opcode = code[0];
+    size = cpu_opcode_size(opcode);
+    if (size == 0 || address + size > UINT16_MAX + 1) {
+      break;
+    }
+    if (dynarec_code_at(mem, address + size - 1) != code + size - 1) {
+      break; /* Crosses into another bank. */
+    }
+    if (n > 0 && cpu_break_at(address)) {
+      break; /* Left to the run loop to stop at. */
+    }
+
+    operand = 0;
+    if (size > 1) {
+      operand = code[1];
+    }
+    if (size > 2) {
+      operand += code[2] * 256;
+    }
+
+    dynarec_emit_instruction(address, opcode, code + 1, &exits[n * 2]);
+    address += size;
+
+    if (dynarec_ends_block(opcode, operand)) {
+      n++;
+      break;
+    }
+  }
+
+  if (n == 0) {
+    return NULL;
+  }
+
+  /* mov eax, r14d; pop r15; pop r14; pop r13; pop r12; pop rbx; ret */
+  for (i = 0; i < n * 2; i++) {
+    displacement = dynarec_emit_ptr - (exits[i] + sizeof(int32_t));
+    memcpy(exits[i], &displacement, sizeof(int32_t));
+  }
+  dynarec_emit_8(0x44);
+  dynarec_emit_8(0x89);
+  dynarec_emit_8(0xF0);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x5F);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x5E);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x5D);
+  dynarec_emit_8(0x41);
+  dynarec_emit_8(0x5C);
+  dynarec_emit_8(0x5B);
+  dynarec_emit_8(0xC3);
+
+  dynarec_code_used = dynarec_emit_ptr - dynarec_code;
+  dynarec_table[pc] = (dynarec_block_t)block;
+  dynarec_block_size[pc] = address - pc;
+
+  /* Watch for writes to the code to invalidate the block. */
+  for (i = pc / 256; i <= (int)((address - 1) / 256); i++) {
+    mem_code_page_set(mem, i, true);
+    dynarec_page[i] = true;
+  }
+
+  return dynarec_table[pc];
+}
+
+
+
+dynarec_block_t dynarec_block(uint16_t pc, mem_t *mem)
+{
+  if (dynarec_table[pc] != NULL) {
+    return dynarec_table[pc];
+  }
+
+  if (pc < DYNAREC_CODE_START || dynarec_disabled) {
+    return NULL;
+  }
+
+  return dynarec_translate(pc, mem);
+}
+
+
+
+void dynarec_flush(void)
+{
+  memset(dynarec_table, 0, sizeof(dynarec_table));
+  memset(dynarec_page, false, sizeof(dynarec_page));
+  dynarec_code_used = 0;
+}
+
+
+
+#endif /* CPU_DYNAREC */
@@ -0,0 +1,14 @@
+#ifndef _DYNAREC_H
+#define _DYNAREC_H
+
+#include <stdint.h>
+#include "cpu.h"
+#include "mem.h"
+
+typedef uint32_t (*dynarec_block_t)(cpu_t *, mem_t *, uint32_t, uint32_t);
+
+dynarec_block_t dynarec_block(uint16_t pc, mem_t *mem);
+void dynarec_invalidate(void *mem, uint16_t address);
+void dynarec_flush(void);
+
+#endif /* _DYNAREC_H */
@@ -88,7 +88,8 @@ static void fds_write_hook(void *fds, uint16_t address, uint8_t value)
 
   case FDS_CONTROL:
     ((fds_t *)fds)->ctrl = value;
-    ((fds_t *)fds)->ppu->vertical_mirroring = !((fds_t *)fds)->mirroring;
+    ppu_mirroring_set(((fds_t *)fds)->ppu, ((fds_t *)fds)->mirroring ?
+      PPU_MIRRORING_HORIZONTAL : PPU_MIRRORING_VERTICAL);
     ((fds_t *)fds)->ack_disk_irq = true;
     break;
 
@@ -168,7 +169,7 @@ int fds_image_load(const char *filename, fds_t *fds)
 
 
 
-void fds_init(fds_t *fds, mem_t *mem, ppu_t *ppu)
+void fds_init(fds_t *fds, mem_t *mem, ppu_t *ppu, cpu_t *cpu)
 {
   int i;
 
@@ -176,10 +177,14 @@ void fds_init(fds_t *fds, mem_t *mem, ppu_t *ppu)
   mem->fds = fds;
   mem->fds_read  = fds_read_hook;
   mem->fds_write = fds_write_hook;
+  mem_map_update(mem);
 
   /* Special connection to the PPU for mirroring: */
   fds->ppu = ppu;
 
+  /* The IRQ line goes to the CPU: */
+  fds->cpu = cpu;
+
   /* Timer: */
   fds->timer_irq_enable   = false;
   fds->timer_irq_repeat   = false;
@@ -194,11 +199,11 @@ void fds_init(fds_t *fds, mem_t *mem, ppu_t *ppu)
   fds->disk_inserted      = false;
   fds->disk_ready         = false;
   fds->disk_write_protect = false;
-  fds->trigger_irq        = false;
   fds->ack_disk_irq       = true;
   fds->ack_timer_irq      = true;
   fds->byte_transferred   = false;
   fds->data_read          = 0;
+  fds->transfer_wait      = FDS_WAIT_CYCLES;
 
   /* RAM: */
   for (i = 0; i < FDS_RAM_SIZE; i++) {
@@ -367,17 +372,15 @@ static uint8_t fds_image_read(fds_t *fds)
 
 void fds_execute(fds_t *fds)
 {
-  static int wait = FDS_WAIT_CYCLES;
-
   if (fds->irq_transfer && fds->ack_disk_irq) {
-    if (wait > 0) {
+    if (fds->transfer_wait > 0) {
       /* Need to wait for FDS BIOS to be ready. */
-      wait--;
+      fds->transfer_wait--;
     } else {
       /* Now the byte can be transferred. */
-      wait = FDS_WAIT_CYCLES;
+      fds->transfer_wait = FDS_WAIT_CYCLES;
       fds->ack_disk_irq = false;
-      fds->trigger_irq = true;
+      cpu_interrupt(fds->cpu, CPU_INTERRUPT_IRQ);
       fds->timer_irq_occurred = false;
       fds->data_read = fds_image_read(fds);
       fds->byte_transferred = true;
@@ -390,7 +393,7 @@ void fds_execute(fds_t *fds)
     }
     if (fds->timer_count == 0 && fds->ack_timer_irq) {
       fds->ack_timer_irq = false;
-      fds->trigger_irq = true;
+      cpu_interrupt(fds->cpu, CPU_INTERRUPT_IRQ);
       fds->timer_irq_occurred = true;
       fds->timer_count = fds->timer_reload;
       if (fds->timer_irq_repeat == false) {
@@ -402,6 +405,28 @@ void fds_execute(fds_t *fds)
 
 
 
+/* CPU cycles that can pass before fds_execute() raises an IRQ. */
+uint32_t fds_cycles_until_event(fds_t *fds)
+{
+  uint32_t cycles = UINT32_MAX;
+
+  if (fds->irq_transfer && fds->ack_disk_irq) {
+    cycles = fds->transfer_wait + 1;
+  }
+
+  if (fds->timer_irq_enable && fds->ack_timer_irq) {
+    if (fds->timer_count > 0 && fds->timer_count < cycles) {
+      cycles = fds->timer_count;
+    } else if (fds->timer_count == 0) {
+      cycles = 1;
+    }
+  }
+
+  return cycles;
+}
+
+
+
 void fds_dump(FILE *fh, fds_t *fds)
 {
   int i;
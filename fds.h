@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include "mem.h"
 #include "ppu.h"
+#include "cpu.h"
 
 #define FDS_RAM_SIZE 0x1800
 #define FDS_IMAGE_SIZE 65500
@@ -46,11 +47,11 @@ typedef struct fds_s {
   bool disk_inserted;
   bool disk_ready;
   bool disk_write_protect;
-  bool trigger_irq;
   bool ack_disk_irq;
   bool ack_timer_irq;
   bool byte_transferred;
   uint8_t data_read;
+  int transfer_wait;
 
   union {
     struct {
@@ -76,6 +77,7 @@ typedef struct fds_s {
   uint8_t image[FDS_IMAGE_SIZE];
 
   ppu_t *ppu;
+  cpu_t *cpu;
 
   fds_file_info_t file_info[FDS_FILE_INFO_MAX];
 } fds_t;
@@ -92,8 +94,9 @@ typedef struct fds_s {
 #define FDS_DRIVE_STATUS        0x4032
 #define FDS_EXT_CONNECTOR_READ  0x4033
 
-void fds_init(fds_t *fds, mem_t *mem, ppu_t *ppu);
+void fds_init(fds_t *fds, mem_t *mem, ppu_t *ppu, cpu_t *cpu);
 void fds_execute(fds_t *fds);
+uint32_t fds_cycles_until_event(fds_t *fds);
 void fds_dump(FILE *fh, fds_t *fds);
 
 int fds_bios_load(const char *filename, mem_t *mem);
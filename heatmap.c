@@ -0,0 +1,109 @@
+#include "heatmap.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#ifdef HEATMAP
+#define HEATMAP_CSV "heatmap.csv"
+#define HEATMAP_CPU_PGM "heatmap_cpu.pgm"
+#define HEATMAP_PPU_PGM "heatmap_ppu.pgm"
+#define HEATMAP_PGM_WIDTH 256 /* One row per page. */
+
+heatmap_t heatmap_cpu[HEATMAP_SIZE_CPU];
+heatmap_t heatmap_ppu[HEATMAP_SIZE_PPU];
+
+
+
+static inline uint64_t heatmap_total(heatmap_t *count)
+{
+  return count->read + count->write + count->execute;
+}
+
+
+
+/* Only the addresses accessed at all. */
+static void heatmap_csv_write(FILE *fh, const char *space, heatmap_t *counts,
+  int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++) {
+    if (heatmap_total(&counts[i]) == 0) {
+      continue;
+    }
+    fprintf(fh, "%s,%04x,%llu,%llu,%llu\n", space, i,
+      (unsigned long long)counts[i].read,
+      (unsigned long long)counts[i].write,
+      (unsigned long long)counts[i].execute);
+  }
+}
+
+
+
+/* Binary greymap of all accesses on a logarithmic scale, since a few
+   addresses are accessed orders of magnitude more than the rest. */
+static void heatmap_pgm_write(const char *filename, heatmap_t *counts,
+  int size)
+{
+  FILE *fh;
+  uint64_t max = 0;
+  int i;
+
+  fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    return;
+  }
+
+  for (i = 0; i < size; i++) {
+    if (heatmap_total(&counts[i]) > max) {
+      max = heatmap_total(&counts[i]);
+    }
+  }
+
+  fprintf(fh, "P5\n%d %d\n255\n", HEATMAP_PGM_WIDTH, size / HEATMAP_PGM_WIDTH);
+  for (i = 0; i < size; i++) {
+    if (max == 0) {
+      fputc(0, fh);
+    } else {
+      fputc((int)(255 * log1p(heatmap_total(&counts[i])) / log1p(max)), fh);
+    }
+  }
+  fclose(fh);
+}
+
+
+
+/* Sprite RAM gets its own space in the CSV and the last row of the PPU
+   image. */
+static void heatmap_write(void)
+{
+  FILE *fh;
+
+  fh = fopen(HEATMAP_CSV, "w");
+  if (fh != NULL) {
+    fprintf(fh, "space,address,read,write,execute\n");
+    heatmap_csv_write(fh, "cpu", heatmap_cpu, HEATMAP_SIZE_CPU);
+    heatmap_csv_write(fh, "ppu", heatmap_ppu, HEATMAP_PPU_SPRITE_RAM);
+    heatmap_csv_write(fh, "oam", &heatmap_ppu[HEATMAP_PPU_SPRITE_RAM],
+      HEATMAP_SIZE_PPU - HEATMAP_PPU_SPRITE_RAM);
+    fclose(fh);
+  }
+
+  heatmap_pgm_write(HEATMAP_CPU_PGM, heatmap_cpu, HEATMAP_SIZE_CPU);
+  heatmap_pgm_write(HEATMAP_PPU_PGM, heatmap_ppu, HEATMAP_SIZE_PPU);
+}
+
+
+
+void heatmap_start(void)
+{
+  static bool started = false;
+
+  if (! started) {
+    atexit(heatmap_write);
+    started = true;
+  }
+}
+#endif /* HEATMAP */
@@ -0,0 +1,43 @@
+#ifndef _HEATMAP_H
+#define _HEATMAP_H
+
+#include <stdint.h>
+
+/* Memory accesses counted per address in builds with -DHEATMAP, written
+   out at exit. Without it the counting compiles to nothing. The type of
+   access is one of read, write or execute. */
+
+#define HEATMAP_SIZE_CPU 0x10000
+#define HEATMAP_PPU_SPRITE_RAM 0x4000 /* After the PPU address space. */
+#define HEATMAP_SIZE_PPU 0x4100
+
+#ifdef HEATMAP
+typedef struct heatmap_s {
+  uint64_t read;
+  uint64_t write;
+  uint64_t execute;
+} heatmap_t;
+
+extern heatmap_t heatmap_cpu[HEATMAP_SIZE_CPU];
+extern heatmap_t heatmap_ppu[HEATMAP_SIZE_PPU];
+
+#define HEATMAP_CPU(type, address) heatmap_cpu[address].type++;
+#define HEATMAP_PPU(type, address) heatmap_ppu[address].type++;
+#define HEATMAP_CPU_RANGE(type, start, size) \
+  for (int heatmap_i = 0; heatmap_i < (size); heatmap_i++) { \
+    heatmap_cpu[(start) + heatmap_i].type++; \
+  }
+#define HEATMAP_PPU_RANGE(type, start, size) \
+  for (int heatmap_i = 0; heatmap_i < (size); heatmap_i++) { \
+    heatmap_ppu[(start) + heatmap_i].type++; \
+  }
+
+void heatmap_start(void);
+#else
+#define HEATMAP_CPU(type, address)
+#define HEATMAP_PPU(type, address)
+#define HEATMAP_CPU_RANGE(type, start, size)
+#define HEATMAP_PPU_RANGE(type, start, size)
+#endif /* HEATMAP */
+
+#endif /* _HEATMAP_H */
@@ -3,7 +3,8 @@
 
 #include "mem.h"
 #include "ppu.h"
+#include "mapper.h"
 
-int ines_load(const char *filename, mem_t *mem, ppu_t *ppu);
+int ines_load(const char *filename, mem_t *mem, ppu_t *ppu, mapper_t *mapper);
 
 #endif /* _INES_H */
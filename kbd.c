@@ -463,6 +463,13 @@ int kbd_cassette_save_file_stop(void)
 
 
 
+bool kbd_cassette_active(void)
+{
+  return (kbd.cassette_load_fh != NULL || kbd.cassette_save_fh != NULL);
+}
+
+
+
 void kbd_cassette_execute(bool dac, bool *adc)
 {
   uint8_t sample;
@@ -98,6 +98,7 @@ void kbd_key_set(kbd_key_t key, bool shift, bool ctrl);
 void kbd_key_clear(void);
 uint8_t kbd_port_get(uint8_t row_counter, bool col_select);
 void kbd_cassette_execute(bool dac, bool *adc);
+bool kbd_cassette_active(void);
 int kbd_cassette_load_file(const char *filename);
 int kbd_cassette_save_file_start(const char *filename);
 int kbd_cassette_save_file_stop(void);
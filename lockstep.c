@@ -0,0 +1,459 @@
+#include "lockstep.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "ppu.h"
+
+/* Runs the reference core on a copy of the CPU and memory alongside the
+   core in use, comparing the results after every run of it. The runs are
+   as long as without lockstep, so superinstructions and idle loop skipping
+   are checked as they really happen. Device register accesses of the core
+   in use end its run and are logged on their way to the devices, and the
+   values read are replayed to the reference core instead of letting it
+   access the devices a second time. Internal RAM is copied over before and
+   compared after every run. Cartridge memory is compared where the
+   reference core wrote to it, and completely once per frame to also catch
+   stray writes from the core in use. */
+
+#define LOCKSTEP_LOG_MAX 1024 /* Accesses per run, fits a DMA. */
+
+typedef struct lockstep_access_s {
+  uint16_t address;
+  uint8_t value;
+  bool write;
+} lockstep_access_t;
+
+typedef struct lockstep_s {
+  cpu_t cpu; /* Reference core. */
+  mem_t mem;
+  mem_read_hook_t  ppu_read; /* Hooks of the devices. */
+  mem_write_hook_t ppu_write;
+  mem_read_hook_t  apu_read;
+  mem_write_hook_t apu_write;
+  mem_read_hook_t  fds_read;
+  mem_write_hook_t fds_write;
+  lockstep_access_t access[LOCKSTEP_LOG_MAX]; /* By the core in use. */
+  int access_count;
+  int access_replayed; /* By the reference core. */
+  int access_mismatch; /* First access not replayed as logged, or -1. */
+  lockstep_access_t mismatch;
+  uint16_t cart_write[LOCKSTEP_LOG_MAX]; /* By the reference core. */
+  int cart_write_count;
+  bool cart_write_full; /* Compare all of it instead. */
+  uint64_t idle_skipped; /* Cycles skipped by the core in use at start. */
+  bool idle_repeat;
+  bool overflow;
+  bool diverged;
+  uint64_t instructions;
+} lockstep_t;
+
+static lockstep_t lockstep;
+
+/* Device contexts of the copy only need to be set, except for the PPU
+   which is the target of sprite DMA. */
+static ppu_t lockstep_ppu;
+
+
+
+static void lockstep_log(uint16_t address, uint8_t value, bool write)
+{
+  if (lockstep.access_count >= LOCKSTEP_LOG_MAX) {
+    lockstep.overflow = true;
+    return;
+  }
+  lockstep.access[lockstep.access_count].address = address;
+  lockstep.access[lockstep.access_count].value = value;
+  lockstep.access[lockstep.access_count].write = write;
+  lockstep.access_count++;
+}
+
+
+
+static uint8_t lockstep_ppu_read(void *ppu, uint16_t address)
+{
+  uint8_t value;
+
+  value = (lockstep.ppu_read)(ppu, address);
+  lockstep_log(address, value, false);
+  return value;
+}
+
+static void lockstep_ppu_write(void *ppu, uint16_t address, uint8_t value)
+{
+  lockstep_log(address, value, true);
+  (lockstep.ppu_write)(ppu, address, value);
+}
+
+static uint8_t lockstep_apu_read(void *apu, uint16_t address)
+{
+  uint8_t value;
+
+  value = (lockstep.apu_read)(apu, address);
+  lockstep_log(address, value, false);
+  return value;
+}
+
+static void lockstep_apu_write(void *apu, uint16_t address, uint8_t value)
+{
+  lockstep_log(address, value, true);
+  (lockstep.apu_write)(apu, address, value);
+}
+
+static uint8_t lockstep_fds_read(void *fds, uint16_t address)
+{
+  uint8_t value;
+
+  value = (lockstep.fds_read)(fds, address);
+  lockstep_log(address, value, false);
+  return value;
+}
+
+static void lockstep_fds_write(void *fds, uint16_t address, uint8_t value)
+{
+  lockstep_log(address, value, true);
+  (lockstep.fds_write)(fds, address, value);
+}
+
+
+
+/* Takes the next access from the log, which must be the same one. */
+static lockstep_access_t *lockstep_replay(uint16_t address, uint8_t value,
+  bool write)
+{
+  lockstep_access_t *access;
+
+  if (lockstep.access_replayed < lockstep.access_count) {
+    access = &lockstep.access[lockstep.access_replayed];
+    if (access->address == address && access->write == write &&
+        (! write || access->value == value)) {
+      lockstep.access_replayed++;
+      return access;
+    }
+  }
+
+  /* The core in use skipped idle loop iterations without their reads,
+     which is only right if reading again gives the same value. The
+     reference core gets that value and the comparison afterwards shows
+     whether the iterations then really end up the same. */
+  if (lockstep.idle_repeat && ! write && lockstep.access_replayed > 0) {
+    access = &lockstep.access[lockstep.access_replayed - 1];
+    if (access->address == address && ! access->write) {
+      return access;
+    }
+  }
+
+  if (lockstep.access_mismatch < 0) {
+    lockstep.access_mismatch = lockstep.access_replayed;
+    lockstep.mismatch.address = address;
+    lockstep.mismatch.value = value;
+    lockstep.mismatch.write = write;
+  }
+  return NULL;
+}
+
+static uint8_t lockstep_replay_read(void *device, uint16_t address)
+{
+  lockstep_access_t *access;
+  (void)device;
+
+  access = lockstep_replay(address, 0, false);
+  if (access == NULL) {
+    return 0xFF;
+  }
+  return access->value;
+}
+
+static void lockstep_replay_write(void *device, uint16_t address,
+  uint8_t value)
+{
+  (void)device;
+  lockstep_replay(address, value, true);
+}
+
+static void lockstep_cart_write(void *mem, uint16_t address)
+{
+  (void)mem;
+  if (lockstep.cart_write_count >= LOCKSTEP_LOG_MAX) {
+    lockstep.cart_write_full = true;
+    return;
+  }
+  lockstep.cart_write[lockstep.cart_write_count] = address;
+  lockstep.cart_write_count++;
+}
+
+
+
+/* Prints the heading on the first divergence found in a comparison. */
+static void lockstep_divergence(const char *format, ...)
+{
+  va_list args;
+
+  if (! lockstep.diverged) {
+    fprintf(stdout, "\nLockstep divergence after %llu instructions:\n",
+      (unsigned long long)lockstep.instructions);
+    lockstep.diverged = true;
+  }
+
+  fprintf(stdout, "  ");
+  va_start(args, format);
+  vfprintf(stdout, format, args);
+  va_end(args);
+}
+
+
+
+static uint8_t lockstep_status(cpu_t *cpu)
+{
+  uint8_t status;
+
+  status = cpu->sr & ~(CPU_FLAG_N | CPU_FLAG_Z);
+  status |= cpu->n_result & CPU_FLAG_N;
+  if (cpu->z_result == 0) {
+    status |= CPU_FLAG_Z;
+  }
+  return status;
+}
+
+
+
+static void lockstep_compare_ram(mem_t *mem)
+{
+  int i;
+
+  if (memcmp(lockstep.mem.ram, mem->ram, MEM_SIZE_RAM) == 0) {
+    return;
+  }
+  for (i = 0; i < MEM_SIZE_RAM; i++) {
+    if (lockstep.mem.ram[i] != mem->ram[i]) {
+      lockstep_divergence("RAM at 0x%04x: %02x, in use %02x\n",
+        i, lockstep.mem.ram[i], mem->ram[i]);
+      return;
+    }
+  }
+}
+
+
+
+static void lockstep_compare_cart(mem_t *mem)
+{
+  int i;
+
+  if (memcmp(lockstep.mem.cart, mem->cart, MEM_SIZE_CART) == 0) {
+    return;
+  }
+  for (i = 0; i < MEM_SIZE_CART; i++) {
+    if (lockstep.mem.cart[i] != mem->cart[i]) {
+      lockstep_divergence("Cartridge at 0x%04x: %02x, in use %02x\n",
+        i + 0x4020, lockstep.mem.cart[i], mem->cart[i]);
+      return;
+    }
+  }
+}
+
+
+
+/* Installs the logging hooks between the memory and the devices, so this
+   must be done after all devices are initialized. */
+void lockstep_init(mem_t *mem)
+{
+  lockstep.ppu_read  = mem->ppu_read;
+  lockstep.ppu_write = mem->ppu_write;
+  lockstep.apu_read  = mem->apu_read;
+  lockstep.apu_write = mem->apu_write;
+  lockstep.fds_read  = mem->fds_read;
+  lockstep.fds_write = mem->fds_write;
+
+  memcpy(&lockstep.mem, mem, sizeof(mem_t));
+  lockstep.mem.sync = NULL;
+  lockstep.mem.code_write = lockstep_cart_write;
+  lockstep.mem.code_bank = NULL;
+  lockstep.mem.mapper_write = NULL; /* Banks are copied at each start. */
+  memset(lockstep.mem.code_page, true, sizeof(lockstep.mem.code_page));
+
+  if (mem->ppu_read != NULL) {
+    mem->ppu_read = lockstep_ppu_read;
+    lockstep.mem.ppu_read = lockstep_replay_read;
+    lockstep.mem.ppu = &lockstep_ppu;
+  }
+  if (mem->ppu_write != NULL) {
+    mem->ppu_write = lockstep_ppu_write;
+    lockstep.mem.ppu_write = lockstep_replay_write;
+    lockstep.mem.ppu = &lockstep_ppu;
+  }
+  if (mem->apu_read != NULL) {
+    mem->apu_read = lockstep_apu_read;
+    lockstep.mem.apu_read = lockstep_replay_read;
+    lockstep.mem.apu = &lockstep_ppu;
+  }
+  if (mem->apu_write != NULL) {
+    mem->apu_write = lockstep_apu_write;
+    lockstep.mem.apu_write = lockstep_replay_write;
+    lockstep.mem.apu = &lockstep_ppu;
+  }
+  if (mem->fds_read != NULL) {
+    mem->fds_read = lockstep_fds_read;
+    lockstep.mem.fds_read = lockstep_replay_read;
+    lockstep.mem.fds = &lockstep_ppu;
+  }
+  if (mem->fds_write != NULL) {
+    mem->fds_write = lockstep_fds_write;
+    lockstep.mem.fds_write = lockstep_replay_write;
+    lockstep.mem.fds = &lockstep_ppu;
+  }
+
+  mem_map_update(&lockstep.mem);
+  lockstep.instructions = 0;
+}
+
+
+
+/* Makes the memory of the reference core the same as the one in use, when
+   changed by other means than running the CPU. */
+void lockstep_sync(mem_t *mem)
+{
+  memcpy(lockstep.mem.ram, mem->ram, MEM_SIZE_RAM);
+  memcpy(lockstep.mem.cart, mem->cart, MEM_SIZE_CART);
+}
+
+
+
+/* Called before a run of the core in use, which interrupts may have
+   changed the state of since the last one. */
+void lockstep_start(cpu_t *cpu, mem_t *mem)
+{
+  lockstep.cpu = *cpu;
+  memcpy(lockstep.mem.ram, mem->ram, MEM_SIZE_RAM);
+  if (mem->mapper != NULL) {
+    memcpy(lockstep.mem.cart_bank, mem->cart_bank, sizeof(mem->cart_bank));
+    mem_map_update(&lockstep.mem);
+  }
+  lockstep.access_count = 0;
+  lockstep.access_replayed = 0;
+  lockstep.access_mismatch = -1;
+  lockstep.cart_write_count = 0;
+  lockstep.cart_write_full = false;
+  lockstep.idle_skipped = cpu_idle_skipped();
+  lockstep.overflow = false;
+  lockstep.diverged = false;
+}
+
+
+
+/* Runs the reference core for the same number of instructions as the run
+   of the core in use and compares. Returns false on divergence, after
+   printing both states and the trace. */
+bool lockstep_check(cpu_t *cpu, mem_t *mem, uint32_t instructions)
+{
+  uint32_t i;
+  uint16_t address;
+  lockstep_access_t *access;
+
+  lockstep.idle_repeat = (cpu_idle_skipped() != lockstep.idle_skipped);
+  for (i = 0; i < instructions; i++) {
+    cpu_execute_reference(&lockstep.cpu, &lockstep.mem);
+  }
+  lockstep.instructions += instructions;
+
+  if (lockstep.cpu.pc != cpu->pc ||
+      lockstep.cpu.a != cpu->a ||
+      lockstep.cpu.x != cpu->x ||
+      lockstep.cpu.y != cpu->y ||
+      lockstep.cpu.sp != cpu->sp ||
+      lockstep_status(&lockstep.cpu) != lockstep_status(cpu)) {
+    lockstep_divergence("Registers\n");
+  }
+  if (lockstep.cpu.cycles != cpu->cycles) {
+    lockstep_divergence("Cycles: %u, in use %u\n",
+      lockstep.cpu.cycles, cpu->cycles);
+  }
+
+  if (lockstep.access_mismatch >= 0) {
+    lockstep_divergence("Device access #%d: %s 0x%04x",
+      lockstep.access_mismatch,
+      lockstep.mismatch.write ? "write" : "read",
+      lockstep.mismatch.address);
+    if (lockstep.mismatch.write) {
+      fprintf(stdout, " = %02x", lockstep.mismatch.value);
+    }
+    if (lockstep.access_mismatch < lockstep.access_count) {
+      access = &lockstep.access[lockstep.access_mismatch];
+      fprintf(stdout, ", in use %s 0x%04x", access->write ? "write" : "read",
+        access->address);
+      if (access->write) {
+        fprintf(stdout, " = %02x", access->value);
+      }
+    } else {
+      fprintf(stdout, ", in use none");
+    }
+    fprintf(stdout, "\n");
+  } else if (lockstep.access_replayed < lockstep.access_count) {
+    access = &lockstep.access[lockstep.access_replayed];
+    lockstep_divergence("Device access #%d: none, in use %s 0x%04x\n",
+      lockstep.access_replayed, access->write ? "write" : "read",
+      access->address);
+  }
+  if (lockstep.overflow) {
+    lockstep_divergence("Too many memory accesses to compare\n");
+  }
+
+  lockstep_compare_ram(mem);
+  if (lockstep.cart_write_full) {
+    lockstep_compare_cart(mem);
+  }
+  for (i = 0; i < (uint32_t)lockstep.cart_write_count; i++) {
+    address = lockstep.cart_write[i] - 0x4020;
+    if (lockstep.mem.cart[address] != mem->cart[address]) {
+      lockstep_divergence("Cartridge at 0x%04x: %02x, in use %02x\n",
+        lockstep.cart_write[i], lockstep.mem.cart[address],
+        mem->cart[address]);
+      break;
+    }
+  }
+
+  if (! lockstep.diverged) {
+    return true;
+  }
+
+  fprintf(stdout, "Reference:\n");
+  cpu_state_dump(stdout, &lockstep.cpu, &lockstep.mem);
+  fprintf(stdout, "In use:\n");
+  cpu_state_dump(stdout, cpu, mem);
+  fprintf(stdout, "CPU Trace:\n");
+  cpu_trace_dump(stdout);
+
+  /* Continue from the state of the core in use. */
+  lockstep_sync(mem);
+  return false;
+}
+
+
+
+/* Compares all of cartridge memory, done once per frame. RAM is already
+   compared after every run. Returns false on divergence. */
+bool lockstep_frame(mem_t *mem)
+{
+  lockstep.diverged = false;
+  lockstep_compare_cart(mem);
+
+  if (! lockstep.diverged) {
+    return true;
+  }
+
+  fprintf(stdout, "CPU Trace:\n");
+  cpu_trace_dump(stdout);
+  lockstep_sync(mem);
+  return false;
+}
+
+
+
+uint64_t lockstep_instructions(void)
+{
+  return lockstep.instructions;
+}
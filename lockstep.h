@@ -0,0 +1,16 @@
+#ifndef _LOCKSTEP_H
+#define _LOCKSTEP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "mem.h"
+
+void lockstep_init(mem_t *mem);
+void lockstep_sync(mem_t *mem);
+void lockstep_start(cpu_t *cpu, mem_t *mem);
+bool lockstep_check(cpu_t *cpu, mem_t *mem, uint32_t instructions);
+bool lockstep_frame(mem_t *mem);
+uint64_t lockstep_instructions(void);
+
+#endif /* _LOCKSTEP_H */
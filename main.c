@@ -6,6 +6,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "cpu.h"
 #include "mem.h"
@@ -18,6 +19,10 @@
 #include "gui.h"
 #include "cli.h"
 #include "tas.h"
+#include "lockstep.h"
+#include "trace.h"
+#include "mapper.h"
+#include "heatmap.h"
 
 
 
@@ -32,9 +37,25 @@ static mem_t main_mem;
 static ppu_t main_ppu;
 static apu_t main_apu;
 static fds_t main_fds;
+static mapper_t main_mapper;
 
 static bool debugger_break = false;
 static bool nmi_break = false;
+static bool break_hit = false;
+static bool lockstep = false;
+static int exit_status = EXIT_SUCCESS;
+
+static uint32_t synced_cycles = 0;
+static uint32_t synced_instructions = 0;
+static bool cycles_odd = false; /* Since reset, before the current run. */
+
+static bool idle_skip = true;
+static uint64_t idle_skipped_frame_start = 0;
+static uint32_t idle_skipped_frame = 0;
+
+static uint32_t bench_frames = 0;
+static uint64_t bench_instructions = 0;
+static clock_t bench_start;
 
 static bool saved_state = false;
 static cpu_t save_cpu;
@@ -42,6 +63,59 @@ static mem_t save_mem;
 static ppu_t save_ppu;
 static apu_t save_apu;
 static fds_t save_fds;
+static mapper_t save_mapper;
+
+
+
+/* Reads the hex address after a debugger command. */
+static bool debugger_address(const char *cmd, uint16_t *address)
+{
+  unsigned int value;
+
+  if (sscanf(&cmd[1], " $%x", &value) != 1 &&
+      sscanf(&cmd[1], " %x", &value) != 1) {
+    fprintf(stdout, "Missing address!\n");
+    return false;
+  }
+  if (value > UINT16_MAX) {
+    fprintf(stdout, "Invalid address: %x\n", value);
+    return false;
+  }
+
+  *address = value;
+  return true;
+}
+
+
+
+static void debugger_watch(uint16_t address, uint8_t type)
+{
+  mem_watch_set(&main_mem, address, mem_watch_get(address) | type);
+}
+
+
+
+/* Tells why the debugger was entered, if it was a breakpoint or watchpoint
+   in the last run. */
+static void debugger_break_report(void)
+{
+  static const char *type[] = {
+    [MEM_WATCH_READ]   = "read",
+    [MEM_WATCH_WRITE]  = "write",
+    [MEM_WATCH_CHANGE] = "change",
+  };
+
+  if (break_hit) {
+    fprintf(stdout, "\nBreakpoint: $%04x\n", main_cpu.pc);
+    break_hit = false;
+  }
+  if (main_mem.watch_hit != 0) {
+    fprintf(stdout, "\nWatchpoint: $%04x %s of $%02x\n",
+      main_mem.watch_address, type[main_mem.watch_hit],
+      main_mem.watch_value);
+    main_mem.watch_hit = 0;
+  }
+}
 
 
 
@@ -50,6 +124,7 @@ static bool debugger(void)
   int i;
   char cmd[16];
   int result;
+  uint16_t address;
 
   fprintf(stdout, "\n");
   while (1) {
@@ -57,7 +132,7 @@ static bool debugger(void)
 
     if (fgets(cmd, sizeof(cmd), stdin) == NULL) {
       if (feof(stdin)) {
-        exit(EXIT_SUCCESS);
+        exit(exit_status);
       }
       continue;
     }
@@ -72,6 +147,12 @@ static bool debugger(void)
       fprintf(stdout, "  n - Continue until next NMI\n");
       fprintf(stdout, "  s - Step\n");
       fprintf(stdout, "  w - Warp mode toggle\n");
+      fprintf(stdout, "  b ADDR - Set breakpoint\n");
+      fprintf(stdout, "  R ADDR - Set read watchpoint\n");
+      fprintf(stdout, "  W ADDR - Set write watchpoint\n");
+      fprintf(stdout, "  V ADDR - Set value change watchpoint\n");
+      fprintf(stdout, "  x ADDR - Clear breakpoint and watchpoints\n");
+      fprintf(stdout, "  B - List breakpoints and watchpoints\n");
       fprintf(stdout, "  1 - Dump CPU Trace\n");
       fprintf(stdout, "  2 - Dump ZP/Stack/Vectors\n");
       fprintf(stdout, "  3 - Dump PPU NT/AT/RAM\n");
@@ -79,6 +160,12 @@ static bool debugger(void)
       fprintf(stdout, "  5 - Dump APU\n");
       fprintf(stdout, "  6 - Dump other RAM\n");
       fprintf(stdout, "  7 - Dump FDS\n");
+#ifdef CPU_HISTOGRAM
+      fprintf(stdout, "  8 - Dump CPU Opcode Histogram\n");
+#endif
+      fprintf(stdout, "  9 - Dump Mapper\n");
+      fprintf(stdout, "  i - Idle loop cycles skipped last frame\n");
+      fprintf(stdout, "  r - CPU Trace toggle\n");
       fprintf(stdout, "BASIC Mode Commands:\n");
       fprintf(stdout, "  t - Inject \""
         DEBUGGER_KEYBOARD_INJECT_FILE "\" text file as keyboard input.\n");
@@ -150,7 +237,43 @@ static bool debugger(void)
       break;
 
     case 'q': /* Quit */
-      exit(EXIT_SUCCESS);
+      exit(exit_status);
+      break;
+
+    case 'b':
+      if (debugger_address(cmd, &address)) {
+        cpu_break_set(&main_mem, address, true);
+      }
+      break;
+
+    case 'R':
+      if (debugger_address(cmd, &address)) {
+        debugger_watch(address, MEM_WATCH_READ);
+      }
+      break;
+
+    case 'W':
+      if (debugger_address(cmd, &address)) {
+        debugger_watch(address, MEM_WATCH_WRITE);
+      }
+      break;
+
+    case 'V':
+      if (debugger_address(cmd, &address)) {
+        debugger_watch(address, MEM_WATCH_CHANGE);
+      }
+      break;
+
+    case 'x':
+      if (debugger_address(cmd, &address)) {
+        cpu_break_set(&main_mem, address, false);
+        mem_watch_set(&main_mem, address, 0);
+      }
+      break;
+
+    case 'B':
+      cpu_break_dump(stdout);
+      mem_watch_dump(stdout);
       break;
 
     case '1':
@@ -206,6 +329,28 @@ static bool debugger(void)
       fds_dump(stdout, &main_fds);
       break;
 
+#ifdef CPU_HISTOGRAM
+    case '8':
+      fprintf(stdout, "CPU Opcode Histogram:\n");
+      cpu_histogram_dump(stdout);
+      break;
+#endif
+
+    case '9':
+      mapper_dump(stdout, &main_mapper);
+      break;
+
+    case 'i':
+      fprintf(stdout, "Idle loop cycles skipped last frame: %u\n",
+        idle_skipped_frame);
+      break;
+
+    case 'r':
+      cpu_trace_enable(! cpu_trace_enabled());
+      fprintf(stdout, "CPU Trace: %s (%u entries)\n",
+        cpu_trace_enabled() ? "Enabled" : "Disabled", cpu_trace_entries());
+      break;
+
     default:
       continue;
     }
@@ -214,6 +359,115 @@ static bool debugger(void)
 
 
 
+/* Run the CPU until the next point where one of the devices may change state
+   visible to it, or just one instruction when stepping or when it relies on
+   exact timing for other reasons. */
+static uint32_t cycle_budget(void)
+{
+  uint32_t budget;
+  uint32_t cycles;
+
+  if (debugger_break || (main_cpu.interrupt & CPU_INTERRUPT_IRQ) ||
+      kbd_cassette_active()) {
+    return 1;
+  }
+
+  budget = ppu_cycles_until_event(&main_ppu);
+  cycles = fds_cycles_until_event(&main_fds);
+  if (cycles < budget) {
+    budget = cycles;
+  }
+  cycles = apu_cycles_until_event(&main_apu);
+  if (cycles < budget) {
+    budget = cycles;
+  }
+
+  return budget;
+}
+
+
+
+static void devices_execute(uint32_t cycles, uint32_t instructions)
+{
+  /* Three PPU dots per CPU cycle spent. */
+  ppu_run(&main_ppu, cycles * 3);
+  while (cycles > 0) {
+    fds_execute(&main_fds);
+    kbd_cassette_execute(main_apu.keyboard_cassette_dac,
+      &main_apu.keyboard_cassette_adc);
+    cycles--;
+  }
+
+  /* The APU sequencer is stepped once per instruction. */
+  while (instructions > 0) {
+    apu_execute(&main_apu);
+    instructions--;
+  }
+}
+
+
+
+/* Called on device register access during a CPU run, to let the devices
+   catch up to the start of the accessing instruction. */
+static void devices_sync(void)
+{
+  devices_execute(main_cpu.sync_cycles - synced_cycles,
+    main_cpu.sync_instructions - synced_instructions);
+  synced_cycles = main_cpu.sync_cycles;
+  synced_instructions = main_cpu.sync_instructions;
+}
+
+
+
+/* The CPU is halted while OAM DMA runs, one cycle longer when it starts on
+   an odd cycle, and the devices carry on for that long. */
+static void dma_stall(void)
+{
+  if (cycles_odd != (main_cpu.cycles % 2 != 0)) {
+    main_cpu.cycles++;
+  }
+  main_cpu.cycles += main_mem.stall_cycles;
+  main_mem.stall_cycles = 0;
+}
+
+
+
+static void bench_report(void)
+{
+  double seconds;
+
+  seconds = (double)(clock() - bench_start) / CLOCKS_PER_SEC;
+
+  cli_pause(); /* Turn off to let text appear. */
+  fprintf(stderr, "CPU core    : %s\n", cpu_core_name());
+  fprintf(stderr, "Frames      : %u\n", main_ppu.frame_no);
+  fprintf(stderr, "Instructions: %llu\n",
+    (unsigned long long)bench_instructions);
+  fprintf(stderr, "Idle skipped: %llu cycles\n",
+    (unsigned long long)cpu_idle_skipped());
+  fprintf(stderr, "Time        : %.3f s\n", seconds);
+  if (seconds > 0) {
+    fprintf(stderr, "Instr/sec   : %.0f\n", bench_instructions / seconds);
+    fprintf(stderr, "Frames/sec  : %.1f\n", main_ppu.frame_no / seconds);
+  }
+}
+
+
+
+static void lockstep_report(void)
+{
+  cli_pause(); /* Turn off to let text appear. */
+  fprintf(stderr, "Lockstep frames      : %u\n", main_ppu.frame_no);
+  fprintf(stderr, "Lockstep instructions: %llu\n",
+    (unsigned long long)lockstep_instructions());
+  fprintf(stderr, "Lockstep idle skipped: %llu cycles\n",
+    (unsigned long long)cpu_idle_skipped());
+  fprintf(stderr, "Lockstep result      : %s\n",
+    (exit_status == EXIT_SUCCESS) ? "No divergence" : "Diverged");
+}
+
+
+
 static void sig_handler(int sig)
 {
   (void)sig;
@@ -233,6 +487,7 @@ void panic(const char *format, ...)
   va_end(args);
 
   debugger_break = true;
+  main_mem.break_run = true;
 }
 
 
@@ -240,6 +495,7 @@ void panic(const char *format, ...)
 void debug(void)
 {
   debugger_break = true;
+  main_mem.break_run = true;
 }
 
 
@@ -257,8 +513,19 @@ static void display_help(const char *progname)
     "  -j NO     Use SDL joystick NO instead of 0.\n"
     "  -t FILE   Use FM2 FILE as input for TAS.\n"
     "  -f FILE   Enable Famicom Disk System and use FILE as FDS BIOS.\n"
-    "  -b        Enable BASIC mode with keyboard and data recorder."
-    "\n");
+    "  -b        Enable BASIC mode with keyboard and data recorder.\n"
+    "  -p FRAMES Run FRAMES frames in warp mode, then report speed and quit."
+    "\n"
+    "  -i        Disable idle loop skipping.\n"
+    "  -r SIZE   Enable the CPU trace with the last SIZE instructions.\n"
+    "  -w FILE   Stream a binary trace of every instruction to FILE,\n"
+    "            disables idle loop skipping.\n"
+    "  -P A-B    Only stream instructions at hex addresses A to B.\n"
+    "  -F A-B    Only stream instructions in frames A to B.\n"
+    "  -x FILE   Print the binary trace FILE as text and quit.\n"
+    "  -S        Benchmark the scanline renderer and quit.\n"
+    "  -l        Compare the CPU with the reference core in lockstep,\n"
+    "            and quit at the end of the TAS movie if any.\n");
 }
 
 
@@ -275,8 +542,14 @@ int main(int argc, char *argv[])
   bool enable_colors = true;
   bool basic_mode = false;
   int joystick_no = 0;
-
-  while ((c = getopt(argc, argv, "hdvakcj:t:f:b")) != -1) {
+  uint32_t trace_size = CPU_TRACE_SIZE_DEFAULT;
+  bool trace = false;
+  char *trace_filename = NULL;
+  unsigned int range_start, range_end;
+  uint32_t instructions;
+  uint8_t taken;
+
+  while ((c = getopt(argc, argv, "hdvakcj:t:f:bp:ir:w:P:F:x:Sl")) != -1) {
     switch (c) {
     case 'h':
       display_help(argv[0]);
@@ -318,6 +591,54 @@ int main(int argc, char *argv[])
       basic_mode = true;
       break;
 
+    case 'p':
+      bench_frames = atoi(optarg);
+      break;
+
+    case 'i':
+      idle_skip = false;
+      break;
+
+    case 'r':
+      trace_size = atoi(optarg);
+      trace = true;
+      break;
+
+    case 'w':
+      trace_filename = optarg;
+      break;
+
+    case 'P':
+      if (sscanf(optarg, "%x-%x", &range_start, &range_end) != 2) {
+        display_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      trace_filter_pc(range_start, range_end);
+      break;
+
+    case 'F':
+      if (sscanf(optarg, "%u-%u", &range_start, &range_end) != 2) {
+        display_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      trace_filter_frame(range_start, range_end);
+      break;
+
+    case 'x':
+      if (trace_decode(optarg, stdout) != 0) {
+        fprintf(stderr, "Unable to decode trace: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      return EXIT_SUCCESS;
+
+    case 'S':
+      ppu_render_bench(stdout);
+      return EXIT_SUCCESS;
+
+    case 'l':
+      lockstep = true;
+      break;
+
     case '?':
     default:
       display_help(argv[0]);
@@ -332,17 +653,36 @@ int main(int argc, char *argv[])
     rom_filename = argv[optind];
   }
 
-  cpu_trace_init();
+  if (cpu_trace_init(trace_size) != 0) {
+    fprintf(stderr, "Unable to allocate CPU trace of %u entries\n",
+      trace_size);
+    return EXIT_FAILURE;
+  }
+  cpu_trace_enable(trace || lockstep); /* Lockstep dumps it on divergence. */
+
+  if (trace_filename != NULL) {
+    if (trace_open(trace_filename, &main_ppu.frame_no) != 0) {
+      fprintf(stderr, "Unable to open trace file: %s\n", trace_filename);
+      return EXIT_FAILURE;
+    }
+    cpu_trace_stream_enable(true);
+    idle_skip = false; /* Skipped instructions would be missing. */
+  }
+#ifdef HEATMAP
+  heatmap_start();
+  idle_skip = false; /* Accesses in skipped loops would be missing. */
+#endif
   signal(SIGINT, sig_handler);
 
   mem_init(&main_mem);
-  ppu_init(&main_ppu, &main_mem);
+  main_mem.sync = devices_sync;
+  ppu_init(&main_ppu, &main_mem, &main_cpu);
   apu_init(&main_apu, &main_mem);
   kbd_init();
 
   if (fds_bios_filename != NULL) {
     /* Famicom Disk System */
-    fds_init(&main_fds, &main_mem, &main_ppu);
+    fds_init(&main_fds, &main_mem, &main_ppu, &main_cpu);
     if (fds_bios_load(fds_bios_filename, &main_mem) != 0) {
       fprintf(stderr, "Unable to load FDS BIOS: %s\n", fds_bios_filename);
       return EXIT_FAILURE;
@@ -351,13 +691,20 @@ int main(int argc, char *argv[])
       fprintf(stderr, "Unable to load FDS image: %s\n", rom_filename);
       return EXIT_FAILURE;
     }
+    cpu_predecode(&main_mem, 0xE000, 0xFFFF); /* BIOS */
 
   } else {
     /* Regular ROM */
-    if (ines_load(rom_filename, &main_mem, &main_ppu) != 0) {
+    if (ines_load(rom_filename, &main_mem, &main_ppu, &main_mapper) != 0) {
       fprintf(stderr, "Unable to load ROM: %s\n", rom_filename);
       return EXIT_FAILURE;
     }
+    cpu_predecode(&main_mem, 0x8000, 0xFFFF); /* PRG ROM */
+  }
+
+  if (lockstep) {
+    lockstep_init(&main_mem);
+    lockstep_sync(&main_mem);
   }
 
   if (tas_filename != NULL) {
@@ -379,40 +726,60 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (bench_frames > 0) {
+    gui_warp_mode_set(true);
+  }
+
   cpu_reset(&main_cpu, &main_mem);
+  bench_start = clock();
   while (1) {
-    cpu_trace_add(&main_cpu, &main_mem);
-
     /* Let the PPU execute for 2 frames before the CPU starts. */
     if (main_ppu.frame_no < 2) {
-      ppu_execute(&main_ppu);
+      ppu_run(&main_ppu, 1);
+      synced_cycles = 0;
+      synced_instructions = 0;
+      instructions = 1;
     } else {
-      cpu_execute(&main_cpu, &main_mem);
-    }
-
-    /* Limit PPU execution to three times per CPU cycle spent. */
-    while (main_cpu.cycles > 0) {
-      ppu_execute(&main_ppu);
-      ppu_execute(&main_ppu);
-      ppu_execute(&main_ppu);
-      fds_execute(&main_fds);
-      kbd_cassette_execute(main_apu.keyboard_cassette_dac,
-        &main_apu.keyboard_cassette_adc);
-      main_cpu.cycles--;
+      synced_cycles = 0;
+      synced_instructions = 0;
+      /* Never skip idle loops when stepping in the debugger. */
+      cpu_idle_enable(idle_skip && ! debugger_break);
+      if (lockstep) {
+        lockstep_start(&main_cpu, &main_mem);
+      }
+      instructions = cpu_run_cycles(&main_cpu, &main_mem, cycle_budget());
+      bench_instructions += instructions;
+      if (lockstep && ! lockstep_check(&main_cpu, &main_mem, instructions)) {
+        exit_status = EXIT_FAILURE;
+        debugger_break = true;
+      }
+      if (main_mem.stall_cycles > 0) {
+        dma_stall();
+      }
+      if (cpu_break_hit()) {
+        break_hit = true;
+        debugger_break = true;
+      }
+      if (main_mem.watch_hit != 0) {
+        debugger_break = true;
+      }
     }
 
-    apu_execute(&main_apu);
-
-    /* Trigger pending IRQ from FDS once CPU is ready. */
-    if (main_fds.trigger_irq && (main_cpu.sr.i == false)) {
-      cpu_irq(&main_cpu, &main_mem);
-      main_fds.trigger_irq = false;
+    devices_execute(main_cpu.cycles - synced_cycles,
+      instructions - synced_instructions);
+    trace_cycles(main_cpu.cycles);
+    cycles_odd = (cycles_odd != (main_cpu.cycles % 2 != 0));
+    main_cpu.cycles = 0;
+
+    /* Take interrupts raised by the devices, the frame ends with the
+       vertical blank NMI from the PPU. */
+    taken = 0;
+    if (main_cpu.interrupt != 0) {
+      taken = cpu_interrupt_poll(&main_cpu, &main_mem);
     }
-
-    /* Check for vertical blank NMI from PPU. */
-    if (main_ppu.trigger_nmi) {
-      cpu_nmi(&main_cpu, &main_mem);
-      main_ppu.trigger_nmi = false;
+    if (taken & CPU_INTERRUPT_NMI) {
+      idle_skipped_frame = cpu_idle_skipped() - idle_skipped_frame_start;
+      idle_skipped_frame_start = cpu_idle_skipped();
       kbd_key_clear();
       gui_update();
 #ifdef EXTRA_INFO
@@ -422,6 +789,22 @@ int main(int argc, char *argv[])
 #endif
       tas_update(main_ppu.frame_no);
 
+      if (lockstep) {
+        if (! lockstep_frame(&main_mem)) {
+          exit_status = EXIT_FAILURE;
+          debugger_break = true;
+        } else if (tas_filename != NULL &&
+          main_ppu.frame_no >= tas_length()) {
+          lockstep_report();
+          exit(exit_status);
+        }
+      }
+
+      if (bench_frames > 0 && main_ppu.frame_no >= bench_frames) {
+        bench_report();
+        exit(exit_status);
+      }
+
       if (nmi_break) {
         nmi_break = false;
         debugger_break = true;
@@ -433,6 +816,7 @@ int main(int argc, char *argv[])
         memcpy(&save_ppu, &main_ppu, sizeof(ppu_t));
         memcpy(&save_apu, &main_apu, sizeof(apu_t));
         memcpy(&save_fds, &main_fds, sizeof(fds_t));
+        memcpy(&save_mapper, &main_mapper, sizeof(mapper_t));
         saved_state = true;
       } else if (gui_load_state_requested() && saved_state) {
         memcpy(&main_cpu, &save_cpu, sizeof(cpu_t));
@@ -440,11 +824,17 @@ int main(int argc, char *argv[])
         memcpy(&main_ppu, &save_ppu, sizeof(ppu_t));
         memcpy(&main_apu, &save_apu, sizeof(apu_t));
         memcpy(&main_fds, &save_fds, sizeof(fds_t));
+        memcpy(&main_mapper, &save_mapper, sizeof(mapper_t));
+        cpu_code_flush(&main_mem);
+        if (lockstep) {
+          lockstep_sync(&main_mem);
+        }
       }
     }
 
     if (debugger_break) {
       cli_pause();
+      debugger_break_report();
       debugger_break = debugger();
       if (! debugger_break) {
         cli_resume();
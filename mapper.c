@@ -0,0 +1,432 @@
+#include "mapper.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mem.h"
+#include "ppu.h"
+#include "cpu.h"
+
+/* Cartridge boards switching PRG and CHR banks. The whole ROM is loaded
+   once, and a bank switch only repoints memory pages and PPU pattern table
+   banks into it, so it costs the same no matter how often games do it.
+   Mapper registers are written through the memory hook of banked ROM. */
+
+
+
+/* Maps an 8K bank of PRG ROM at the CPU address, with negative banks
+   counted from the end. */
+static void mapper_prg_map(mapper_t *mapper, uint16_t address, int bank)
+{
+  int banks;
+  int page;
+  uint8_t *data;
+
+  banks = mapper->prg_size / MAPPER_PRG_BANK_SIZE;
+  bank = ((bank % banks) + banks) % banks;
+  data = &mapper->prg[bank * MAPPER_PRG_BANK_SIZE];
+
+  for (page = 0; page < MAPPER_PRG_BANK_SIZE / 256; page++) {
+    mem_map_bank(mapper->mem, (address / 256) + page, &data[page * 256]);
+  }
+}
+
+
+
+/* Maps a 1K bank of CHR ROM at one of the PPU pattern table banks. CHR RAM
+   is never banked. */
+static void mapper_chr_map(mapper_t *mapper, int slot, int bank)
+{
+  int banks;
+
+  if (mapper->chr == NULL) {
+    return;
+  }
+
+  banks = mapper->chr_size / PPU_SIZE_PATTERN_BANK;
+  bank %= banks;
+  ppu_pattern_bank_set(mapper->ppu, slot,
+    &mapper->chr[bank * PPU_SIZE_PATTERN_BANK]);
+}
+
+
+
+static void mapper_mmc1_update(mapper_t *mapper)
+{
+  int bank;
+  int i;
+
+  bank = (mapper->prg_bank & 0xF) * 2; /* 16K to 8K banks. */
+  switch ((mapper->control >> 2) & 0x3) {
+  case 0:
+  case 1: /* 32K */
+    for (i = 0; i < 4; i++) {
+      mapper_prg_map(mapper, 0x8000 + (i * 0x2000), (bank & ~0x3) + i);
+    }
+    break;
+
+  case 2: /* First bank fixed at 0x8000. */
+    mapper_prg_map(mapper, 0x8000, 0);
+    mapper_prg_map(mapper, 0xA000, 1);
+    mapper_prg_map(mapper, 0xC000, bank);
+    mapper_prg_map(mapper, 0xE000, bank + 1);
+    break;
+
+  case 3: /* Last bank fixed at 0xC000. */
+    mapper_prg_map(mapper, 0x8000, bank);
+    mapper_prg_map(mapper, 0xA000, bank + 1);
+    mapper_prg_map(mapper, 0xC000, -2);
+    mapper_prg_map(mapper, 0xE000, -1);
+    break;
+  }
+
+  if (mapper->control & 0x10) { /* 4K */
+    for (i = 0; i < 4; i++) {
+      mapper_chr_map(mapper, i, (mapper->chr_bank_0 * 4) + i);
+      mapper_chr_map(mapper, i + 4, (mapper->chr_bank_1 * 4) + i);
+    }
+  } else { /* 8K */
+    for (i = 0; i < 8; i++) {
+      mapper_chr_map(mapper, i, ((mapper->chr_bank_0 & ~0x1) * 4) + i);
+    }
+  }
+
+  switch (mapper->control & 0x3) {
+  case 0:
+    ppu_mirroring_set(mapper->ppu, PPU_MIRRORING_SINGLE_LOW);
+    break;
+  case 1:
+    ppu_mirroring_set(mapper->ppu, PPU_MIRRORING_SINGLE_HIGH);
+    break;
+  case 2:
+    ppu_mirroring_set(mapper->ppu, PPU_MIRRORING_VERTICAL);
+    break;
+  case 3:
+    ppu_mirroring_set(mapper->ppu, PPU_MIRRORING_HORIZONTAL);
+    break;
+  }
+}
+
+
+
+/* Registers are loaded serially through bit 0, five writes in a row. */
+static void mapper_mmc1_write(mapper_t *mapper, uint16_t address,
+  uint8_t value)
+{
+  bool complete;
+
+  if (value & 0x80) {
+    mapper->shift = 0x10;
+    mapper->control |= 0x0C;
+    mapper_mmc1_update(mapper);
+    return;
+  }
+
+  complete = mapper->shift & 0x1;
+  mapper->shift = (mapper->shift >> 1) | ((value & 0x1) << 4);
+  if (! complete) {
+    return;
+  }
+
+  switch (address & 0xE000) {
+  case 0x8000:
+    mapper->control = mapper->shift;
+    break;
+  case 0xA000:
+    mapper->chr_bank_0 = mapper->shift;
+    break;
+  case 0xC000:
+    mapper->chr_bank_1 = mapper->shift;
+    break;
+  case 0xE000:
+    mapper->prg_bank = mapper->shift;
+    break;
+  }
+  mapper->shift = 0x10;
+  mapper_mmc1_update(mapper);
+}
+
+
+
+static void mapper_uxrom_update(mapper_t *mapper)
+{
+  mapper_prg_map(mapper, 0x8000, mapper->bank * 2);
+  mapper_prg_map(mapper, 0xA000, (mapper->bank * 2) + 1);
+  mapper_prg_map(mapper, 0xC000, -2);
+  mapper_prg_map(mapper, 0xE000, -1);
+}
+
+
+
+static void mapper_cnrom_update(mapper_t *mapper)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    mapper_chr_map(mapper, i, (mapper->bank * 8) + i);
+  }
+}
+
+
+
+static void mapper_mmc3_update(mapper_t *mapper)
+{
+  int inverted;
+
+  if (mapper->bank_select & 0x40) {
+    mapper_prg_map(mapper, 0x8000, -2);
+    mapper_prg_map(mapper, 0xC000, mapper->bank_data[6]);
+  } else {
+    mapper_prg_map(mapper, 0x8000, mapper->bank_data[6]);
+    mapper_prg_map(mapper, 0xC000, -2);
+  }
+  mapper_prg_map(mapper, 0xA000, mapper->bank_data[7]);
+  mapper_prg_map(mapper, 0xE000, -1);
+
+  /* Two 2K banks and four 1K banks, swapped around by A12 inversion. */
+  inverted = (mapper->bank_select & 0x80) ? 4 : 0;
+  mapper_chr_map(mapper, inverted + 0, mapper->bank_data[0] & 0xFE);
+  mapper_chr_map(mapper, inverted + 1, mapper->bank_data[0] | 0x01);
+  mapper_chr_map(mapper, inverted + 2, mapper->bank_data[1] & 0xFE);
+  mapper_chr_map(mapper, inverted + 3, mapper->bank_data[1] | 0x01);
+  mapper_chr_map(mapper, (inverted ^ 4) + 0, mapper->bank_data[2]);
+  mapper_chr_map(mapper, (inverted ^ 4) + 1, mapper->bank_data[3]);
+  mapper_chr_map(mapper, (inverted ^ 4) + 2, mapper->bank_data[4]);
+  mapper_chr_map(mapper, (inverted ^ 4) + 3, mapper->bank_data[5]);
+}
+
+
+
+static void mapper_mmc3_write(mapper_t *mapper, uint16_t address,
+  uint8_t value)
+{
+  switch (address & 0xE001) {
+  case 0x8000:
+    mapper->bank_select = value;
+    mapper_mmc3_update(mapper);
+    break;
+
+  case 0x8001:
+    mapper->bank_data[mapper->bank_select & 0x7] = value;
+    mapper_mmc3_update(mapper);
+    break;
+
+  case 0xA000:
+    ppu_mirroring_set(mapper->ppu, (value & 0x1) ?
+      PPU_MIRRORING_HORIZONTAL : PPU_MIRRORING_VERTICAL);
+    break;
+
+  case 0xA001:
+    /* PRG RAM protection, ignored. */
+    break;
+
+  case 0xC000:
+    mapper->irq_latch = value;
+    break;
+
+  case 0xC001:
+    mapper->irq_counter = 0;
+    mapper->irq_reload = true;
+    break;
+
+  case 0xE000:
+    mapper->irq_enable = false;
+    cpu_interrupt_clear(mapper->ppu->cpu, CPU_INTERRUPT_IRQ);
+    break;
+
+  case 0xE001:
+    mapper->irq_enable = true;
+    break;
+  }
+}
+
+
+
+/* Clocked by the PPU once per rendered scanline, in place of watching the
+   A12 line of the pattern table fetches. */
+static void mapper_mmc3_scanline(void *mapper)
+{
+  if (((mapper_t *)mapper)->irq_counter == 0 ||
+      ((mapper_t *)mapper)->irq_reload) {
+    ((mapper_t *)mapper)->irq_counter = ((mapper_t *)mapper)->irq_latch;
+    ((mapper_t *)mapper)->irq_reload = false;
+  } else {
+    ((mapper_t *)mapper)->irq_counter--;
+  }
+
+  if (((mapper_t *)mapper)->irq_counter == 0 &&
+      ((mapper_t *)mapper)->irq_enable) {
+    cpu_interrupt(((mapper_t *)mapper)->ppu->cpu, CPU_INTERRUPT_IRQ);
+  }
+}
+
+
+
+static void mapper_write_hook(void *mapper, uint16_t address, uint8_t value)
+{
+  switch (((mapper_t *)mapper)->number) {
+  case MAPPER_MMC1:
+    mapper_mmc1_write(mapper, address, value);
+    break;
+
+  case MAPPER_UXROM:
+    ((mapper_t *)mapper)->bank = value;
+    mapper_uxrom_update(mapper);
+    break;
+
+  case MAPPER_CNROM:
+    ((mapper_t *)mapper)->bank = value;
+    mapper_cnrom_update(mapper);
+    break;
+
+  case MAPPER_MMC3:
+    mapper_mmc3_write(mapper, address, value);
+    break;
+  }
+}
+
+
+
+/* Takes over the ROM data allocated by the caller when successful. */
+int mapper_init(mapper_t *mapper, int number, mem_t *mem, ppu_t *ppu,
+  uint8_t *prg, uint32_t prg_size, uint8_t *chr, uint32_t chr_size)
+{
+  int i;
+
+  if (prg_size == 0 || prg_size % MAPPER_PRG_BANK_SIZE != 0) {
+    fprintf(stderr, "Invalid PRG ROM size: 0x%x\n", prg_size);
+    return -1;
+  }
+  if (chr_size % (PPU_SIZE_PATTERN_TABLE * PPU_PATTERN_TABLES) != 0) {
+    fprintf(stderr, "Invalid CHR ROM size: 0x%x\n", chr_size);
+    return -1;
+  }
+  if (number < MAPPER_NROM || number > MAPPER_MMC3) {
+    fprintf(stderr, "Mapper #%d is not supported!\n", number);
+    return -1;
+  }
+
+  mapper->number = number;
+  mapper->mem = mem;
+  mapper->ppu = ppu;
+  mapper->prg = prg;
+  mapper->prg_size = prg_size;
+  mapper->chr = (chr_size > 0) ? chr : NULL;
+  mapper->chr_size = chr_size;
+
+  mapper->shift = 0x10;
+  mapper->control = 0x0C;
+  mapper->chr_bank_0 = 0;
+  mapper->chr_bank_1 = 0;
+  mapper->prg_bank = 0;
+  mapper->bank = 0;
+  mapper->bank_select = 0;
+  for (i = 0; i < 8; i++) {
+    mapper->bank_data[i] = 0;
+  }
+  mapper->irq_latch = 0;
+  mapper->irq_counter = 0;
+  mapper->irq_reload = false;
+  mapper->irq_enable = false;
+
+  if (number == MAPPER_NROM) {
+    /* Fixed, so copied to cartridge memory like before, where the
+       recompiler expects it. 16K ROMs are mirrored at 0xC000. */
+    if (prg_size > 0x8000 || chr_size > 0x2000) {
+      fprintf(stderr, "Invalid ROM size for mapper #0!\n");
+      return -1;
+    }
+    memcpy(&mem->cart[0x8000 - 0x4020], prg, prg_size);
+    if (prg_size == 0x4000) {
+      memcpy(&mem->cart[0xC000 - 0x4020], prg, prg_size);
+    }
+    if (chr_size > 0) {
+      memcpy(ppu->pattern_table, chr, chr_size);
+      ppu_tile_cache_flush(ppu);
+    }
+    free(prg);
+    free(chr);
+    mapper->prg = NULL;
+    mapper->chr = NULL;
+    return 0;
+  }
+
+  mem->mapper = mapper;
+  mem->mapper_write = mapper_write_hook;
+  ppu->pattern_rom = (mapper->chr != NULL);
+
+  switch (number) {
+  case MAPPER_MMC1:
+    mapper_mmc1_update(mapper);
+    break;
+
+  case MAPPER_UXROM:
+    mapper_uxrom_update(mapper);
+    mapper_cnrom_update(mapper); /* Only the 8K CHR bank if any. */
+    break;
+
+  case MAPPER_CNROM:
+    mapper_prg_map(mapper, 0x8000, 0);
+    mapper_prg_map(mapper, 0xA000, 1);
+    mapper_prg_map(mapper, 0xC000, -2);
+    mapper_prg_map(mapper, 0xE000, -1);
+    mapper_cnrom_update(mapper);
+    break;
+
+  case MAPPER_MMC3:
+    mapper->bank_data[0] = 0;
+    mapper->bank_data[1] = 2;
+    mapper->bank_data[2] = 4;
+    mapper->bank_data[3] = 5;
+    mapper->bank_data[4] = 6;
+    mapper->bank_data[5] = 7;
+    mapper->bank_data[6] = 0;
+    mapper->bank_data[7] = 1;
+    mapper_mmc3_update(mapper);
+    ppu->scanline_hook = mapper_mmc3_scanline;
+    ppu->scanline_context = mapper;
+    break;
+  }
+
+  return 0;
+}
+
+
+
+void mapper_dump(FILE *fh, mapper_t *mapper)
+{
+  int i;
+
+  fprintf(fh, "Mapper: %d\n", mapper->number);
+  switch (mapper->number) {
+  case MAPPER_MMC1:
+    fprintf(fh, "Shift     : 0x%02x\n", mapper->shift);
+    fprintf(fh, "Control   : 0x%02x\n", mapper->control);
+    fprintf(fh, "CHR Bank 0: 0x%02x\n", mapper->chr_bank_0);
+    fprintf(fh, "CHR Bank 1: 0x%02x\n", mapper->chr_bank_1);
+    fprintf(fh, "PRG Bank  : 0x%02x\n", mapper->prg_bank);
+    break;
+
+  case MAPPER_UXROM:
+  case MAPPER_CNROM:
+    fprintf(fh, "Bank      : 0x%02x\n", mapper->bank);
+    break;
+
+  case MAPPER_MMC3:
+    fprintf(fh, "Select    : 0x%02x\n", mapper->bank_select);
+    fprintf(fh, "Banks     :");
+    for (i = 0; i < 8; i++) {
+      fprintf(fh, " 0x%02x", mapper->bank_data[i]);
+    }
+    fprintf(fh, "\n");
+    fprintf(fh, "IRQ Latch : %d\n", mapper->irq_latch);
+    fprintf(fh, "IRQ Count : %d\n", mapper->irq_counter);
+    fprintf(fh, "IRQ Enable: %d\n", mapper->irq_enable);
+    break;
+
+  default:
+    break;
+  }
+}
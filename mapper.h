@@ -0,0 +1,50 @@
+#ifndef _MAPPER_H
+#define _MAPPER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "mem.h"
+#include "ppu.h"
+
+#define MAPPER_NROM  0
+#define MAPPER_MMC1  1
+#define MAPPER_UXROM 2
+#define MAPPER_CNROM 3
+#define MAPPER_MMC3  4
+
+#define MAPPER_PRG_BANK_SIZE 0x2000 /* 8K, the smallest PRG bank. */
+
+typedef struct mapper_s {
+  int number;
+  uint8_t *prg; /* Whole PRG ROM, banks are pointed into it. */
+  uint32_t prg_size;
+  uint8_t *chr; /* Whole CHR ROM, or NULL for CHR RAM in the PPU. */
+  uint32_t chr_size;
+  mem_t *mem;
+  ppu_t *ppu;
+
+  /* MMC1 */
+  uint8_t shift; /* Bits shifted in from the top, with a marker bit. */
+  uint8_t control;
+  uint8_t chr_bank_0;
+  uint8_t chr_bank_1;
+  uint8_t prg_bank;
+
+  /* UxROM and CNROM */
+  uint8_t bank;
+
+  /* MMC3 */
+  uint8_t bank_select;
+  uint8_t bank_data[8];
+  uint8_t irq_latch;
+  uint8_t irq_counter;
+  bool irq_reload;
+  bool irq_enable;
+} mapper_t;
+
+int mapper_init(mapper_t *mapper, int number, mem_t *mem, ppu_t *ppu,
+  uint8_t *prg, uint32_t prg_size, uint8_t *chr, uint32_t chr_size);
+void mapper_dump(FILE *fh, mapper_t *mapper);
+
+#endif /* _MAPPER_H */
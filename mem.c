@@ -3,11 +3,17 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "ppu.h"
 #include "apu.h"
 #include "panic.h"
 
+/* Outside of the memory, so loading a saved state keeps them, the same as
+   CPU breakpoints. */
+static uint8_t mem_watch_map[UINT16_MAX + 1]; /* Types by address. */
+static bool mem_watch_page[UINT8_MAX + 1]; /* Pages with any watchpoint. */
+
 
 
 void mem_init(mem_t *mem)
@@ -31,115 +37,380 @@ void mem_init(mem_t *mem)
   mem->ppu = NULL;
   mem->apu = NULL;
   mem->fds = NULL;
+  mem->sync = NULL;
+  mem->code_write = NULL;
+  mem->code_bank = NULL;
+  memset(mem->code_page, false, sizeof(mem->code_page));
+  memset(mem->cart_bank, 0, sizeof(mem->cart_bank));
+  mem->mapper_write = NULL;
+  mem->mapper = NULL;
+  mem->break_run = true;
+  mem->stall_cycles = 0;
+  mem->watch_hit = 0;
+  mem_map_update(mem);
 }
 
 
 
-uint8_t mem_read(mem_t *mem, uint16_t address)
+/* Devices lag behind the CPU during a run, so bring them up to date when
+   ending it, which is done on the first device register access. */
+static inline void mem_end_run(mem_t *mem)
 {
-  if (address <= 0x07FF) {
-    return mem->ram[address];
-
-  } else if (address <= 0x0FFF) {
-    if (mem->fds_read != NULL && mem->fds != NULL) {
-      return (mem->fds_read)(mem->fds, address);
-    } else {
-      return mem->ram[address - 0x800]; /* Mirror */
+  if (! mem->break_run) {
+    mem->break_run = true;
+    if (mem->sync != NULL) {
+      (mem->sync)();
     }
+  }
+}
 
-  } else if (address <= 0x17FF) {
-    if (mem->fds_read != NULL && mem->fds != NULL) {
-      return (mem->fds_read)(mem->fds, address);
-    } else {
-      return mem->ram[address - 0x1000]; /* Mirror */
+
+
+/* Internal RAM mirrors and the FDS RAM expansion on top of them. */
+static uint8_t mem_fds_read(void *mem, uint16_t address)
+{
+  return (((mem_t *)mem)->fds_read)(((mem_t *)mem)->fds, address);
+}
+
+
+
+static void mem_fds_write(void *mem, uint16_t address, uint8_t value)
+{
+  (((mem_t *)mem)->fds_write)(((mem_t *)mem)->fds, address, value);
+}
+
+
+
+static uint8_t mem_ppu_read(void *mem, uint16_t address)
+{
+  mem_end_run(mem);
+  if (((mem_t *)mem)->ppu_read != NULL && ((mem_t *)mem)->ppu != NULL) {
+    return (((mem_t *)mem)->ppu_read)(((mem_t *)mem)->ppu,
+      (address % 0x8) + 0x2000);
+  } else {
+    panic("PPU read hook not installed! Address: 0x%04x\n", address);
+  }
+  return 0;
+}
+
+
+
+static void mem_ppu_write(void *mem, uint16_t address, uint8_t value)
+{
+  mem_end_run(mem);
+  if (((mem_t *)mem)->ppu_write != NULL && ((mem_t *)mem)->ppu != NULL) {
+    (((mem_t *)mem)->ppu_write)(((mem_t *)mem)->ppu,
+      (address % 0x8) + 0x2000, value);
+  } else {
+    panic("PPU write hook not installed! Address: 0x%04x\n", address);
+  }
+}
+
+
+
+/* Cartridge writes to pages holding translated code, which may be running
+   from there, so the run is ended. Banked ROM is never written, but the
+   mapper registers are there. */
+static void mem_cart_write(void *mem, uint16_t address, uint8_t value)
+{
+  if (((mem_t *)mem)->cart_bank[address / 256] != NULL) {
+    if (((mem_t *)mem)->mapper_write != NULL) {
+      (((mem_t *)mem)->mapper_write)(((mem_t *)mem)->mapper, address, value);
     }
+    return;
+  }
+
+  if (((mem_t *)mem)->code_page[address / 256] &&
+      ((mem_t *)mem)->code_write != NULL) {
+    mem_end_run(mem);
+    (((mem_t *)mem)->code_write)(mem, address);
+  }
+  ((mem_t *)mem)->cart[address - 0x4020] = value;
+}
+
 
-  } else if (address <= 0x1FFF) {
-    if (mem->fds_read != NULL && mem->fds != NULL) {
-      return (mem->fds_read)(mem->fds, address);
+
+/* The page with the APU and I/O registers, FDS registers and the start of
+   cartridge memory. */
+static uint8_t mem_io_read(void *mem, uint16_t address)
+{
+  if (address <= 0x401F) {
+    mem_end_run(mem);
+    if (((mem_t *)mem)->apu_read != NULL && ((mem_t *)mem)->apu != NULL) {
+      return (((mem_t *)mem)->apu_read)(((mem_t *)mem)->apu, address);
     } else {
-      return mem->ram[address - 0x1800]; /* Mirror */
+      panic("APU read hook not installed! Address: 0x%04x\n", address);
     }
 
-  } else if (address <= 0x3FFF) {
-    if (mem->ppu_read != NULL && mem->ppu != NULL) {
-      return (mem->ppu_read)(mem->ppu, (address % 0x8) + 0x2000);
+  } else if (address <= 0x403F && ((mem_t *)mem)->fds_read != NULL &&
+    ((mem_t *)mem)->fds != NULL) {
+    mem_end_run(mem);
+    return (((mem_t *)mem)->fds_read)(((mem_t *)mem)->fds, address);
+
+  }
+
+  return ((mem_t *)mem)->cart[address - 0x4020];
+}
+
+
+
+static void mem_io_write(void *mem, uint16_t address, uint8_t value)
+{
+  if (address == APU_OAM_DMA) {
+    /* Special sprite data DMA transfer, copied in one go from plain
+       memory. The CPU is halted while it runs. */
+    mem_end_run(mem);
+    if (((mem_t *)mem)->ppu != NULL) {
+      if (((mem_t *)mem)->page[value].read != NULL) {
+        memcpy(((ppu_t *)((mem_t *)mem)->ppu)->sprite_ram,
+          ((mem_t *)mem)->page[value].read, PPU_SIZE_SPRITE_RAM);
+        HEATMAP_CPU_RANGE(read, value * 256, PPU_SIZE_SPRITE_RAM)
+      } else {
+        for (int i = 0; i < PPU_SIZE_SPRITE_RAM; i++) {
+          ((ppu_t *)((mem_t *)mem)->ppu)->sprite_ram[i] =
+            mem_read(mem, (value * 256) + i);
+        }
+      }
+      ((ppu_t *)((mem_t *)mem)->ppu)->sprite_ram_changed = true;
+      HEATMAP_PPU_RANGE(write, HEATMAP_PPU_SPRITE_RAM, PPU_SIZE_SPRITE_RAM)
+      ((mem_t *)mem)->stall_cycles += MEM_OAM_DMA_CYCLES;
     } else {
-      panic("PPU read hook not installed! Address: 0x%04x\n", address);
+      panic("PPU reference not installed!\n");
     }
 
   } else if (address <= 0x401F) {
-    if (mem->apu_read != NULL && mem->apu != NULL) {
-      return (mem->apu_read)(mem->apu, address);
+    mem_end_run(mem);
+    if (((mem_t *)mem)->apu_write != NULL && ((mem_t *)mem)->apu != NULL) {
+      (((mem_t *)mem)->apu_write)(((mem_t *)mem)->apu, address, value);
     } else {
-      panic("APU read hook not installed! Address: 0x%04x\n", address);
+      panic("APU write hook not installed! Address: 0x%04x\n", address);
     }
 
-  } else if (address <= 0x403F && mem->fds_read != NULL && mem->fds != NULL) {
-    return (mem->fds_read)(mem->fds, address);
+  } else if (address <= 0x403F && ((mem_t *)mem)->fds_write != NULL &&
+    ((mem_t *)mem)->fds != NULL) {
+    mem_end_run(mem);
+    (((mem_t *)mem)->fds_write)(((mem_t *)mem)->fds, address, value);
 
+  } else {
+    mem_cart_write(mem, address, value);
   }
+}
+
+
 
-  return mem->cart[address - 0x4020];
+/* Only the first watchpoint hit is kept, the run ends after the current
+   instruction anyway. */
+static void mem_watch_hit(mem_t *mem, uint16_t address, uint8_t type,
+  uint8_t value)
+{
+  if (mem->watch_hit == 0) {
+    mem->watch_hit = type;
+    mem->watch_address = address;
+    mem->watch_value = value;
+  }
+  mem_end_run(mem);
 }
 
 
 
-void mem_write(mem_t *mem, uint16_t address, uint8_t value)
+/* Pages with watchpoints, checking them before passing the access on to
+   the page as it would be mapped otherwise. */
+static uint8_t mem_watch_read(void *mem, uint16_t address)
 {
-  if (address <= 0x07FF) {
-    mem->ram[address] = value;
+  mem_page_t *page;
+  uint8_t value;
 
-  } else if (address <= 0x0FFF) {
-    if (mem->fds_write != NULL && mem->fds != NULL) {
-      (mem->fds_write)(mem->fds, address, value);
-    } else {
-      mem->ram[address - 0x800] = value; /* Mirror */
-    }
+  page = &((mem_t *)mem)->unwatched[address / 256];
+  if (page->read != NULL) {
+    value = page->read[address % 256];
+  } else {
+    value = (page->read_hook)(page->context, address);
+  }
 
-  } else if (address <= 0x17FF) {
-    if (mem->fds_write != NULL && mem->fds != NULL) {
-      (mem->fds_write)(mem->fds, address, value);
-    } else {
-      mem->ram[address - 0x1000] = value; /* Mirror */
-    }
+  if (mem_watch_map[address] & MEM_WATCH_READ) {
+    mem_watch_hit(mem, address, MEM_WATCH_READ, value);
+  }
+  return value;
+}
 
-  } else if (address <= 0x1FFF) {
-    if (mem->fds_write != NULL && mem->fds != NULL) {
-      (mem->fds_write)(mem->fds, address, value);
-    } else {
-      mem->ram[address - 0x1800] = value; /* Mirror */
+
+
+static void mem_watch_write(void *mem, uint16_t address, uint8_t value)
+{
+  mem_page_t *page;
+  uint8_t types;
+
+  page = &((mem_t *)mem)->unwatched[address / 256];
+  types = mem_watch_map[address];
+  if (types & MEM_WATCH_WRITE) {
+    mem_watch_hit(mem, address, MEM_WATCH_WRITE, value);
+  } else if (types & MEM_WATCH_CHANGE) {
+    /* Registers can not be read back, so every write is a change. */
+    if (page->read == NULL || page->read[address % 256] != value) {
+      mem_watch_hit(mem, address, MEM_WATCH_CHANGE, value);
     }
+  }
 
-  } else if (address <= 0x3FFF) {
-    if (mem->ppu_write != NULL && mem->ppu != NULL) {
-      (mem->ppu_write)(mem->ppu, (address % 0x8) + 0x2000, value);
-    } else {
-      panic("PPU write hook not installed! Address: 0x%04x\n", address);
+  if (page->write != NULL) {
+    page->write[address % 256] = value;
+  } else {
+    (page->write_hook)(page->context, address, value);
+  }
+}
+
+
+
+/* Puts the watch hooks in front of a page with watchpoints. */
+static void mem_map_watch(mem_t *mem, int page)
+{
+  if (! mem->watch_page[page]) {
+    return;
+  }
+
+  mem->unwatched[page] = mem->page[page];
+  mem->page[page].read = NULL;
+  mem->page[page].write = NULL;
+  mem->page[page].read_hook = mem_watch_read;
+  mem->page[page].write_hook = mem_watch_write;
+  mem->page[page].context = mem;
+}
+
+
+
+static void mem_map_hook(mem_t *mem, int page, mem_read_hook_t read_hook,
+  mem_write_hook_t write_hook)
+{
+  mem->page[page].read = NULL;
+  mem->page[page].write = NULL;
+  mem->page[page].read_hook = read_hook;
+  mem->page[page].write_hook = write_hook;
+  mem->page[page].context = mem;
+}
+
+
+
+/* Sets the pointers of a cartridge page, where writes are only direct to
+   cartridge memory with no code watched for changes there. */
+static void mem_map_cart(mem_t *mem, int page)
+{
+  mem_map_hook(mem, page, NULL, mem_cart_write);
+  if (mem->cart_bank[page] != NULL) {
+    mem->page[page].read = mem->cart_bank[page];
+  } else {
+    mem->page[page].read = &mem->cart[(page * 256) - 0x4020];
+    if (! mem->code_page[page]) {
+      mem->page[page].write = mem->page[page].read;
     }
+  }
+  mem_map_watch(mem, page);
+}
 
-  } else if (address == APU_OAM_DMA) {
-    /* Special sprite data DMA transfer. */
-    if (mem->ppu != NULL) {
-      for (int i = 0; i < PPU_SIZE_SPRITE_RAM; i++) {
-        ((ppu_t *)mem->ppu)->sprite_ram[i] = mem_read(mem, (value * 256) + i);
-      }
+
+
+/* Rebuilds the page table, needed when device hooks are installed and
+   after copying the memory. */
+void mem_map_update(mem_t *mem)
+{
+  int page;
+
+  memcpy(mem->watch_page, mem_watch_page, sizeof(mem->watch_page));
+
+  for (page = 0x00; page <= 0x1F; page++) {
+    if (page >= 0x08 && mem->fds_read != NULL && mem->fds != NULL) {
+      mem_map_hook(mem, page, mem_fds_read, mem_fds_write);
     } else {
-      panic("PPU reference not installed!\n");
+      mem_map_hook(mem, page, NULL, NULL);
+      mem->page[page].read = &mem->ram[(page % 0x08) * 256];
+      mem->page[page].write = mem->page[page].read;
     }
+  }
 
-  } else if (address <= 0x401F) {
-    if (mem->apu_write != NULL && mem->apu != NULL) {
-      (mem->apu_write)(mem->apu, address, value);
-    } else {
-      panic("APU write hook not installed! Address: 0x%04x\n", address);
+  for (page = 0x20; page <= 0x3F; page++) {
+    mem_map_hook(mem, page, mem_ppu_read, mem_ppu_write);
+  }
+
+  mem_map_hook(mem, 0x40, mem_io_read, mem_io_write);
+
+  for (page = 0x00; page <= 0x40; page++) {
+    mem_map_watch(mem, page);
+  }
+
+  for (page = 0x41; page <= 0xFF; page++) {
+    mem_map_cart(mem, page);
+  }
+}
+
+
+
+void mem_code_page_set(mem_t *mem, uint8_t page, bool code)
+{
+  mem->code_page[page] = code;
+  if (page > 0x40) {
+    mem_map_cart(mem, page);
+  }
+}
+
+
+
+/* Points a cartridge page at a ROM bank, or back at cartridge memory with
+   NULL. Code decoded or translated from the page is dropped when the bank
+   changes, ending the run since it may be running from there. */
+void mem_map_bank(mem_t *mem, uint8_t page, uint8_t *data)
+{
+  if (mem->cart_bank[page] == data || page <= 0x40) {
+    return;
+  }
+
+  mem->cart_bank[page] = data;
+  if (mem->code_page[page] && mem->code_bank != NULL) {
+    mem_end_run(mem);
+    (mem->code_bank)(mem, page * 256);
+  }
+  mem_map_cart(mem, page);
+}
+
+
+
+/* Replaces the watchpoint types at the address, none clears it. Accesses
+   through other mirrors of the address are not caught. */
+void mem_watch_set(mem_t *mem, uint16_t address, uint8_t types)
+{
+  int page;
+  int i;
+
+  mem_watch_map[address] = types;
+
+  page = address / 256;
+  mem_watch_page[page] = false;
+  for (i = 0; i < 256; i++) {
+    if (mem_watch_map[(page * 256) + i] != 0) {
+      mem_watch_page[page] = true;
+      break;
     }
+  }
+  mem_map_update(mem);
+}
 
-  } else if (address <= 0x403F && mem->fds_write != NULL && mem->fds != NULL) {
-    (mem->fds_write)(mem->fds, address, value);
-  
-  } else {
-    mem->cart[address - 0x4020] = value;
+
+
+uint8_t mem_watch_get(uint16_t address)
+{
+  return mem_watch_map[address];
+}
+
+
+
+void mem_watch_dump(FILE *fh)
+{
+  int i;
+
+  for (i = 0; i <= UINT16_MAX; i++) {
+    if (mem_watch_map[i] != 0) {
+      fprintf(fh, "Watchpoint: $%04x %c%c%c\n", i,
+        (mem_watch_map[i] & MEM_WATCH_READ)   ? 'r' : '-',
+        (mem_watch_map[i] & MEM_WATCH_WRITE)  ? 'w' : '-',
+        (mem_watch_map[i] & MEM_WATCH_CHANGE) ? 'c' : '-');
+    }
   }
 }
 
@@ -164,7 +435,11 @@ void mem_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end)
       if (i % 16 == 0) {
         fprintf(fh, "$%04x   ", i);
       }
-      fprintf(fh, "%02x ", mem->cart[i - 0x4020]);
+      if (mem->cart_bank[i / 256] != NULL) {
+        fprintf(fh, "%02x ", mem->cart_bank[i / 256][i % 256]);
+      } else {
+        fprintf(fh, "%02x ", mem->cart[i - 0x4020]);
+      }
       if (i % 16 == 15) {
         fprintf(fh, "\n");
       }
@@ -5,12 +5,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "heatmap.h"
+
 typedef uint8_t (*mem_read_hook_t)(void *, uint16_t);
 typedef void (*mem_write_hook_t)(void *, uint16_t, uint8_t);
+typedef void (*mem_sync_hook_t)(void);
+typedef void (*mem_code_hook_t)(void *, uint16_t);
 
 #define MEM_SIZE_RAM  0x800
 #define MEM_SIZE_CART 0xBFE0
 
+#define MEM_WATCH_READ   0x1
+#define MEM_WATCH_WRITE  0x2
+#define MEM_WATCH_CHANGE 0x4 /* Writes of another value than the current. */
+
+/* Every 256 byte page of the address space is either plain memory, read
+   or written through a pointer to the host memory of the page, or handled
+   by a hook called with the context and the full address. */
+typedef struct mem_page_s {
+  uint8_t *read; /* NULL when the hook is used. */
+  uint8_t *write;
+  mem_read_hook_t read_hook;
+  mem_write_hook_t write_hook;
+  void *context;
+} mem_page_t;
+
 typedef struct mem_s {
   uint8_t ram[MEM_SIZE_RAM];   /* 0x0000 -> 0x07FF */
   uint8_t cart[MEM_SIZE_CART]; /* 0x4020 -> 0xFFFF */
@@ -23,10 +42,27 @@ typedef struct mem_s {
   void *ppu;
   void *apu;
   void *fds;
+  mem_sync_hook_t sync; /* Brings devices up to date with the CPU. */
+  mem_code_hook_t code_write; /* Called on writes to pages in code_page. */
+  mem_code_hook_t code_bank; /* Called when pages in code_page switch bank. */
+  bool code_page[256]; /* Pages holding translated code. */
+  uint8_t *cart_bank[256]; /* ROM banked in by a mapper, or NULL for cart. */
+  mem_write_hook_t mapper_write; /* Writes to banked ROM. */
+  void *mapper;
+  bool break_run; /* Cleared during a CPU run, set to end it. */
+  uint32_t stall_cycles; /* CPU cycles lost to DMA during the run. */
+  mem_page_t page[256]; /* Rebuilt by mem_map_update(). */
+  mem_page_t unwatched[256]; /* Pages behind the watch hooks. */
+  bool watch_page[256]; /* Pages with any watchpoint, as last mapped. */
+  uint8_t watch_hit; /* Type of the first watchpoint hit, or 0. */
+  uint16_t watch_address;
+  uint8_t watch_value;
 } mem_t;
 
 #define MEM_PAGE_STACK 0x100
 
+#define MEM_OAM_DMA_CYCLES 513 /* And one more when started on odd cycles. */
+
 #define MEM_VECTOR_NMI_LOW    0xFFFA
 #define MEM_VECTOR_NMI_HIGH   0xFFFB
 #define MEM_VECTOR_RESET_LOW  0xFFFC
@@ -34,9 +70,83 @@ typedef struct mem_s {
 #define MEM_VECTOR_IRQ_LOW    0xFFFE
 #define MEM_VECTOR_IRQ_HIGH   0xFFFF
 
+/* Zero page and stack are always internal RAM, so no hooks apply there.
+   The CPU uses mem_read() and mem_write() instead while they are watched. */
+static inline uint8_t mem_read_zp(mem_t *mem, uint8_t address)
+{
+  HEATMAP_CPU(read, address)
+  return mem->ram[address];
+}
+
+static inline void mem_write_zp(mem_t *mem, uint8_t address, uint8_t value)
+{
+  HEATMAP_CPU(write, address)
+  mem->ram[address] = value;
+}
+
+static inline uint8_t mem_read_stack(mem_t *mem, uint8_t sp)
+{
+  HEATMAP_CPU(read, MEM_PAGE_STACK + sp)
+  return mem->ram[MEM_PAGE_STACK + sp];
+}
+
+static inline void mem_write_stack(mem_t *mem, uint8_t sp, uint8_t value)
+{
+  HEATMAP_CPU(write, MEM_PAGE_STACK + sp)
+  mem->ram[MEM_PAGE_STACK + sp] = value;
+}
+
+static inline uint8_t mem_read(mem_t *mem, uint16_t address)
+{
+  mem_page_t *page = &mem->page[address >> 8];
+
+  HEATMAP_CPU(read, address)
+  if (page->read != NULL) {
+    return page->read[address & 0xFF];
+  }
+  return (page->read_hook)(page->context, address);
+}
+
+static inline void mem_write(mem_t *mem, uint16_t address, uint8_t value)
+{
+  mem_page_t *page = &mem->page[address >> 8];
+
+  HEATMAP_CPU(write, address)
+  if (page->write != NULL) {
+    page->write[address & 0xFF] = value;
+    return;
+  }
+  (page->write_hook)(page->context, address, value);
+}
+
+/* The page as mapped for the CPU, without the watch hooks in front. */
+static inline mem_page_t *mem_page_unwatched(mem_t *mem, uint8_t page)
+{
+  if (mem->watch_page[page]) {
+    return &mem->unwatched[page];
+  }
+  return &mem->page[page];
+}
+
+/* Reads like the CPU does, but without hitting watchpoints. For decoding
+   instructions, which are cached and not read every time. */
+static inline uint8_t mem_read_code(mem_t *mem, uint16_t address)
+{
+  mem_page_t *page = mem_page_unwatched(mem, address >> 8);
+
+  if (page->read != NULL) {
+    return page->read[address & 0xFF];
+  }
+  return (page->read_hook)(page->context, address);
+}
+
 void mem_init(mem_t *mem);
-uint8_t mem_read(mem_t *mem, uint16_t address);
-void mem_write(mem_t *mem, uint16_t address, uint8_t value);
+void mem_map_update(mem_t *mem);
+void mem_code_page_set(mem_t *mem, uint8_t page, bool code);
+void mem_map_bank(mem_t *mem, uint8_t page, uint8_t *data);
+void mem_watch_set(mem_t *mem, uint16_t address, uint8_t types);
+uint8_t mem_watch_get(uint16_t address);
+void mem_watch_dump(FILE *fh);
 void mem_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end);
 
 #endif /* _MEM_H */
@@ -2,119 +2,212 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PPU_SIMD
+#include <immintrin.h>
+#endif
 
 #include "mem.h"
+#include "heatmap.h"
 #include "gui.h"
 #include "cli.h"
 #include "panic.h"
 
 #define PPU_PIXEL_UNUSED 255
 
+#define PPU_BENCH_SCANLINES 200000
 
+typedef void (*ppu_line_merge_t)(uint8_t pixels[], const uint8_t line[],
+  const uint8_t palette[]);
 
-static uint8_t ppu_mem_read(ppu_t *ppu, uint16_t address)
-{
-  uint8_t value = ppu->vram_buffer;
+static ppu_line_merge_t ppu_line_merge;
 
-  if (address <= 0x0FFF) {
-    ppu->vram_buffer = ppu->pattern_table[0][address];
-    return value;
 
-  } else if (address <= 0x1FFF) {
-    ppu->vram_buffer = ppu->pattern_table[1][address - 0x1000];
-    return value;
 
-  } else if (address <= 0x2FFF) {
-    ppu->vram_buffer = ppu->name_table[address - 0x2000];
-    return value;
+static inline uint8_t ppu_pattern(ppu_t *ppu, int table_no, uint16_t offset)
+{
+  return ppu->pattern_bank[(table_no * 4) + (offset / PPU_SIZE_PATTERN_BANK)]
+    [offset % PPU_SIZE_PATTERN_BANK];
+}
 
-  } else if (address <= 0x3EFF) {
-    ppu->vram_buffer = ppu->name_table[address - 0x3000]; /* Mirror */
-    return value;
 
-  } else if (address <= 0x3FFF) {
-    return ppu->palette_ram[(address - 0x3F00) % 0x20];
 
-  } else {
-    panic("PPU memory read outside bounds: 0x%04x\n", address);
-    return 0;
+/* Combines the two bitplanes of a tile, the first one holding the low bit
+   of each pixel and the leftmost pixel in the highest bit. */
+static void ppu_tile_decode(ppu_t *ppu, int index)
+{
+  uint8_t *data;
+  uint8_t value;
+  int row, pixel_no;
+
+  data = &ppu->pattern_bank[index / (PPU_SIZE_PATTERN_BANK / PPU_SIZE_TILE)]
+    [(index % (PPU_SIZE_PATTERN_BANK / PPU_SIZE_TILE)) * PPU_SIZE_TILE];
+
+  for (row = 0; row < 8; row++) {
+    for (pixel_no = 0; pixel_no < 8; pixel_no++) {
+      value = ((data[row] >> pixel_no) & 1) +
+             (((data[row + 8] >> pixel_no) & 1) * 2);
+      ppu->tile[index][row][7 - pixel_no] = value;
+      ppu->tile_flip[index][row][pixel_no] = value;
+    }
   }
+  ppu->tile_valid[index] = true;
 }
 
 
 
-static void ppu_mem_write(ppu_t *ppu, uint16_t address, uint8_t value)
+/* Pixel values of a tile row from the cache, decoding the tile first if
+   needed. */
+static inline const uint8_t *ppu_tile_row(ppu_t *ppu, int table_no,
+  uint8_t tile, int row, bool flip)
 {
-  if (address <= 0x0FFF) {
-    ppu->pattern_table[0][address] = value;
+  int index = (table_no * 256) + tile;
 
-  } else if (address <= 0x1FFF) {
-    ppu->pattern_table[1][address - 0x1000] = value;
+  if (! ppu->tile_valid[index]) {
+    ppu_tile_decode(ppu, index);
+  }
+  if (flip) {
+    return ppu->tile_flip[index][row];
+  }
+  return ppu->tile[index][row];
+}
 
-  } else if (address <= 0x23FF) {
-    ppu->name_table[address - 0x2000] = value;
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[(0x800 + address) - 0x2000] = value;
-    } else {
-      ppu->name_table[(0x400 + address) - 0x2000] = value;
-    }
 
-  } else if (address <= 0x27FF) {
-    ppu->name_table[(0x400 + address) - 0x2400] = value;
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[(0xC00 + address) - 0x2400] = value;
-    } else {
-      ppu->name_table[address - 0x2400] = value;
-    }
 
-  } else if (address <= 0x2BFF) {
-    ppu->name_table[(0x800 + address) - 0x2800] = value;
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[address - 0x2800] = value;
-    } else {
-      ppu->name_table[(0xC00 + address) - 0x2800] = value;
-    }
+/* Maps the palette addresses of a background line to colors, leaving
+   pixels where it is transparent and a sprite behind the background was
+   drawn. Address 0 is the backdrop color. */
+static void ppu_line_merge_scalar(uint8_t pixels[], const uint8_t line[],
+  const uint8_t palette[])
+{
+  int x;
 
-  } else if (address <= 0x2FFF) {
-    ppu->name_table[(0xC00 + address) - 0x2C00] = value;
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[(0x400 + address) - 0x2C00] = value;
-    } else {
-      ppu->name_table[(0x800 + address) - 0x2C00] = value;
+  for (x = 0; x < 256; x++) {
+    if (line[x] != 0) {
+      pixels[x] = palette[line[x]];
+    } else if (pixels[x] == PPU_PIXEL_UNUSED) {
+      pixels[x] = palette[0];
     }
+  }
+}
 
-  } else if (address <= 0x33FF) {
-    ppu->name_table[address - 0x3000] = value; /* Mirror */
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[(0x800 + address) - 0x3000] = value;
-    } else {
-      ppu->name_table[(0x400 + address) - 0x3000] = value;
-    }
+#ifdef PPU_SIMD
+/* Without a byte shuffle, each of the 16 palette entries is selected by
+   comparing, 16 pixels at a time. */
+static void ppu_line_merge_sse2(uint8_t pixels[], const uint8_t line[],
+  const uint8_t palette[])
+{
+  __m128i entry[16];
+  __m128i address, pixel, color, keep;
+  int x, i;
 
-  } else if (address <= 0x37FF) {
-    ppu->name_table[(0x400 + address) - 0x3400] = value; /* Mirror */
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[(0xC00 + address) - 0x3400] = value;
-    } else {
-      ppu->name_table[address - 0x3400] = value;
-    }
+  for (i = 0; i < 16; i++) {
+    entry[i] = _mm_set1_epi8(palette[i]);
+  }
 
-  } else if (address <= 0x3BFF) {
-    ppu->name_table[(0x800 + address) - 0x3800] = value; /* Mirror */
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[address - 0x3800] = value;
-    } else {
-      ppu->name_table[(0xC00 + address) - 0x3800] = value;
+  for (x = 0; x < 256; x += 16) {
+    address = _mm_loadu_si128((const __m128i *)&line[x]);
+    pixel = _mm_loadu_si128((const __m128i *)&pixels[x]);
+    color = _mm_setzero_si128();
+    for (i = 0; i < 16; i++) {
+      color = _mm_or_si128(color, _mm_and_si128(entry[i],
+        _mm_cmpeq_epi8(address, _mm_set1_epi8(i))));
     }
+    keep = _mm_andnot_si128(
+      _mm_cmpeq_epi8(pixel, _mm_set1_epi8((char)PPU_PIXEL_UNUSED)),
+      _mm_cmpeq_epi8(address, _mm_setzero_si128()));
+    pixel = _mm_or_si128(_mm_and_si128(keep, pixel),
+      _mm_andnot_si128(keep, color));
+    _mm_storeu_si128((__m128i *)&pixels[x], pixel);
+  }
+}
 
-  } else if (address <= 0x3EFF) {
-    ppu->name_table[(0xC00 + address) - 0x3C00] = value; /* Mirror */
-    if (ppu->vertical_mirroring) {
-      ppu->name_table[(0x400 + address) - 0x3C00] = value;
-    } else {
-      ppu->name_table[(0x800 + address) - 0x3C00] = value;
+/* The 16 palette entries fit a byte shuffle, 32 pixels at a time. */
+__attribute__((target("avx2")))
+static void ppu_line_merge_avx2(uint8_t pixels[], const uint8_t line[],
+  const uint8_t palette[])
+{
+  __m256i table, address, pixel, color, keep;
+  int x;
+
+  table = _mm256_broadcastsi128_si256(
+    _mm_loadu_si128((const __m128i *)palette));
+
+  for (x = 0; x < 256; x += 32) {
+    address = _mm256_loadu_si256((const __m256i *)&line[x]);
+    pixel = _mm256_loadu_si256((const __m256i *)&pixels[x]);
+    color = _mm256_shuffle_epi8(table, address);
+    keep = _mm256_andnot_si256(
+      _mm256_cmpeq_epi8(pixel, _mm256_set1_epi8((char)PPU_PIXEL_UNUSED)),
+      _mm256_cmpeq_epi8(address, _mm256_setzero_si256()));
+    pixel = _mm256_blendv_epi8(color, pixel, keep);
+    _mm256_storeu_si256((__m256i *)&pixels[x], pixel);
+  }
+}
+#endif /* PPU_SIMD */
+
+
+
+/* The widest kernel the host supports. */
+static ppu_line_merge_t ppu_line_merge_best(void)
+{
+#ifdef PPU_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return ppu_line_merge_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return ppu_line_merge_sse2;
+  }
+#endif
+  return ppu_line_merge_scalar;
+}
+
+
+
+static uint8_t ppu_mem_read(ppu_t *ppu, uint16_t address)
+{
+  uint8_t value = ppu->vram_buffer;
+
+  HEATMAP_PPU(read, address % 0x4000)
+  if (address <= 0x1FFF) {
+    ppu->vram_buffer = ppu_pattern(ppu, 0, address);
+    return value;
+
+  } else if (address <= 0x3EFF) { /* Mirrored above 0x2FFF. */
+    ppu->vram_buffer = ppu->name_table
+      [((address - 0x2000) / PPU_SIZE_NAME_TABLE) % PPU_NAME_TABLES]
+      [address % PPU_SIZE_NAME_TABLE];
+    return value;
+
+  } else if (address <= 0x3FFF) {
+    return ppu->palette_ram[(address - 0x3F00) % 0x20];
+
+  } else {
+    panic("PPU memory read outside bounds: 0x%04x\n", address);
+    return 0;
+  }
+}
+
+
+
+static void ppu_mem_write(ppu_t *ppu, uint16_t address, uint8_t value)
+{
+  HEATMAP_PPU(write, address % 0x4000)
+  if (address <= 0x1FFF) {
+    if (! ppu->pattern_rom) {
+      ppu->pattern_bank[address / PPU_SIZE_PATTERN_BANK]
+        [address % PPU_SIZE_PATTERN_BANK] = value;
+      ppu->tile_valid[address / PPU_SIZE_TILE] = false;
     }
 
+  } else if (address <= 0x3EFF) { /* Mirrored above 0x2FFF. */
+    ppu->name_table
+      [((address - 0x2000) / PPU_SIZE_NAME_TABLE) % PPU_NAME_TABLES]
+      [address % PPU_SIZE_NAME_TABLE] = value;
+
   } else if (address <= 0x3FFF) {
     value &= ~0b11000000; /* Filter out the two upper bytes. */
     ppu->palette_ram[(address - 0x3F00) % 0x20] = value;
@@ -226,7 +319,7 @@ static void ppu_write_hook(void *ppu, uint16_t address, uint8_t value)
 
 
 
-void ppu_init(ppu_t *ppu, mem_t *mem)
+void ppu_init(ppu_t *ppu, mem_t *mem, cpu_t *cpu)
 {
   int i, j;
 
@@ -234,6 +327,19 @@ void ppu_init(ppu_t *ppu, mem_t *mem)
   mem->ppu = ppu;
   mem->ppu_read  = ppu_read_hook;
   mem->ppu_write = ppu_write_hook;
+  mem_map_update(mem);
+
+  /* The NMI line goes to the CPU: */
+  ppu->cpu = cpu;
+
+  /* Cartridge connections, changed by mappers: */
+  ppu->scanline_hook = NULL;
+  ppu->scanline_context = NULL;
+  ppu->pattern_rom = false;
+  for (i = 0; i < PPU_PATTERN_BANKS; i++) {
+    ppu->pattern_bank[i] = &ppu->pattern_table[i / 4]
+      [(i % 4) * PPU_SIZE_PATTERN_BANK];
+  }
 
   /* Registers: */
   ppu->ctrl     = 0;
@@ -255,9 +361,8 @@ void ppu_init(ppu_t *ppu, mem_t *mem)
   ppu->status_was_accessed = false;
   ppu->data_was_accessed   = false;
   ppu->addr_latch  = false;
-  ppu->trigger_nmi = false;
   ppu->vram_buffer = 0;
-  ppu->vertical_mirroring = false;
+  ppu_mirroring_set(ppu, PPU_MIRRORING_HORIZONTAL);
 
   /* PPU memory: */
   for (i = 0; i < PPU_PATTERN_TABLES; i++) {
@@ -265,8 +370,8 @@ void ppu_init(ppu_t *ppu, mem_t *mem)
       ppu->pattern_table[i][j] = 0xee + i; /* Value for easier debugging. */
     }
   }
-  for (i = 0; i < PPU_NAME_TABLES * PPU_SIZE_NAME_TABLE; i++) {
-    ppu->name_table[i] = 0xdd; /* Value for easier debugging. */
+  for (i = 0; i < PPU_SIZE_VRAM; i++) {
+    ppu->vram[i] = 0xdd; /* Value for easier debugging. */
   }
   for (i = 0; i < PPU_SIZE_PALETTE_RAM; i++) {
     ppu->palette_ram[i] = 0x0;
@@ -274,50 +379,129 @@ void ppu_init(ppu_t *ppu, mem_t *mem)
   for (i = 0; i < PPU_SIZE_SPRITE_RAM; i++) {
     ppu->sprite_ram[i] = 0x0;
   }
+  ppu_tile_cache_flush(ppu);
+  ppu->sprite_ram_changed = true;
+
+  ppu_line_merge = ppu_line_merge_best();
 }
 
 
 
-static void ppu_draw_background(ppu_t *ppu, uint8_t pixels[])
+/* Points a 1K pattern bank at other memory, for mappers switching CHR. */
+void ppu_pattern_bank_set(ppu_t *ppu, int slot, uint8_t *data)
+{
+  int i;
+
+  if (ppu->pattern_bank[slot] == data) {
+    return;
+  }
+  ppu->pattern_bank[slot] = data;
+  for (i = 0; i < PPU_SIZE_PATTERN_BANK / PPU_SIZE_TILE; i++) {
+    ppu->tile_valid[(slot * PPU_SIZE_PATTERN_BANK / PPU_SIZE_TILE) + i] =
+      false;
+  }
+}
+
+
+
+/* Points the four logical name tables at the two physical ones. Changing
+   the mirroring leaves the contents as they are, like on hardware. */
+void ppu_mirroring_set(ppu_t *ppu, int mirroring)
+{
+  static const uint8_t page[4][PPU_NAME_TABLES] = {
+    {0, 0, 1, 1}, /* Horizontal */
+    {0, 1, 0, 1}, /* Vertical */
+    {0, 0, 0, 0}, /* Single-screen, lower */
+    {1, 1, 1, 1}, /* Single-screen, upper */
+  };
+  int i;
+
+  for (i = 0; i < PPU_NAME_TABLES; i++) {
+    ppu->name_table[i] =
+      &ppu->vram[page[mirroring & 0x3][i] * PPU_SIZE_NAME_TABLE];
+  }
+}
+
+
+
+/* For pattern table contents changed other than by a PPU write. */
+void ppu_tile_cache_flush(ppu_t *ppu)
+{
+  int i;
+
+  for (i = 0; i < PPU_TILES; i++) {
+    ppu->tile_valid[i] = false;
+  }
+}
+
+
+
+/* Finds the tile at a position on the scanline, along with its palette
+   group from the attribute table. */
+static inline uint8_t ppu_background_tile(ppu_t *ppu, uint8_t base_htile,
+  uint8_t *palette_group)
 {
   uint8_t nt, at;
-  uint8_t base_htile, htile, vtile;
-  uint8_t plane1, plane2;
-  uint8_t color, palette_index, palette_group;
-  uint8_t pixel_no;
-  uint8_t x_pixel;
-  uint16_t nt_offset;
+  uint8_t htile, vtile;
+  uint8_t table;
 
   vtile = (ppu->scanline / 8);
-
-  for (base_htile = 0; base_htile < 32; base_htile++) {
-    htile = base_htile + (ppu->scroll_x / 8);
-    if (htile >= 32) {
-      if (ppu->nametable_sel == 0) {
-        nt_offset = PPU_SIZE_NAME_TABLE; /* Use nametable 1 instead. */
-      } else {
-        nt_offset = 0; /* Use nametable 0 instead. */
-      }
+  htile = base_htile + (ppu->scroll_x / 8);
+  if (htile >= 32) {
+    if (ppu->nametable_sel == 0) {
+      table = 1; /* Use nametable 1 instead. */
     } else {
-      nt_offset = ppu->nametable_sel * PPU_SIZE_NAME_TABLE;
+      table = 0; /* Use nametable 0 instead. */
     }
-    htile %= 32;
+  } else {
+    table = ppu->nametable_sel;
+  }
+  htile %= 32;
+
+  nt = ppu->name_table[table][htile + (vtile * 32)];
+  at = ppu->name_table[table][0x3C0 + (htile / 4) + ((vtile / 4) * 8)];
+  HEATMAP_PPU(read, 0x2000 + (table * PPU_SIZE_NAME_TABLE) + htile +
+    (vtile * 32))
+  HEATMAP_PPU(read, 0x2000 + (table * PPU_SIZE_NAME_TABLE) + 0x3C0 +
+    (htile / 4) + ((vtile / 4) * 8))
+
+  if (((htile % 4) <= 1) && ((vtile % 4) <= 1)) {
+    *palette_group = at & 0x3;
+  } else if (((htile % 4) >= 2) && ((vtile % 4) <= 1)) {
+    *palette_group = (at >> 2) & 0x3;
+  } else if (((htile % 4) <= 1) && ((vtile % 4) >= 2)) {
+    *palette_group = (at >> 4) & 0x3;
+  } else {
+    *palette_group = (at >> 6) & 0x3;
+  }
+
+  HEATMAP_PPU(read, (ppu->bg_tile_sel * PPU_SIZE_PATTERN_TABLE) +
+    (nt << 4) + (ppu->scanline % 8))
+  HEATMAP_PPU(read, (ppu->bg_tile_sel * PPU_SIZE_PATTERN_TABLE) +
+    (nt << 4) + (ppu->scanline % 8) + 8)
+  return nt;
+}
 
-    nt = ppu->name_table[nt_offset + htile + (vtile * 32)];
-    at = ppu->name_table[nt_offset + 0x3C0 + (htile / 4) + ((vtile / 4) * 8)];
 
-    if (((htile % 4) <= 1) && ((vtile % 4) <= 1)) {
-      palette_group = at & 0x3;
-    } else if (((htile % 4) >= 2) && ((vtile % 4) <= 1)) {
-      palette_group = (at >> 2) & 0x3;
-    } else if (((htile % 4) <= 1) && ((vtile % 4) >= 2)) {
-      palette_group = (at >> 4) & 0x3;
-    } else {
-      palette_group = (at >> 6) & 0x3;
-    }
+
+/* Builds the palette addresses of the whole line from the decoded tile
+   rows, then maps them to colors in one go. The group is added to the
+   pixel values of a row 8 at a time, only where they are not 0. The line
+   has the first tile again at the end, since the fine scroll wraps it
+   around to the right edge. */
+static void ppu_draw_background(ppu_t *ppu, uint8_t pixels[])
+{
+  static uint8_t line[(32 + 1) * 8];
+  uint8_t nt;
+  uint8_t base_htile;
+  uint8_t palette_group;
+  uint64_t row;
+
+  for (base_htile = 0; base_htile < 32; base_htile++) {
+    nt = ppu_background_tile(ppu, base_htile, &palette_group);
 
     if (ppu->scanline % 8 == 0) {
-      cli_draw_tile(vtile, base_htile, ppu->bg_tile_sel, nt,
+      cli_draw_tile(ppu->scanline / 8, base_htile, ppu->bg_tile_sel, nt,
         ppu->palette_ram[0],
         ppu->palette_ram[(palette_group * 4)],
         ppu->palette_ram[(palette_group * 4) + 1],
@@ -325,20 +509,47 @@ static void ppu_draw_background(ppu_t *ppu, uint8_t pixels[])
         ppu->palette_ram[(palette_group * 4) + 3]);
     }
 
-    plane1 = ppu->pattern_table[ppu->bg_tile_sel]
-      [(nt << 4) + (ppu->scanline % 8)];
-    plane2 = ppu->pattern_table[ppu->bg_tile_sel]
-      [(nt << 4) + (ppu->scanline % 8) + 8];
+    memcpy(&row, ppu_tile_row(ppu, ppu->bg_tile_sel, nt, ppu->scanline % 8,
+      false), sizeof(row));
+    row |= ((row | (row >> 1)) & 0x0101010101010101ULL) *
+      (palette_group * 4);
+    memcpy(&line[base_htile * 8], &row, sizeof(row));
+  }
+  memcpy(&line[32 * 8], &line[0], 8);
+
+#ifdef HEATMAP
+  for (int x = 0; x < 256; x++) {
+    HEATMAP_PPU(read, 0x3F00 + line[(ppu->scroll_x % 8) + x])
+  }
+#endif
+  (ppu_line_merge)(pixels, &line[ppu->scroll_x % 8], ppu->palette_ram);
+}
+
+
+
+/* Draws the background a pixel at a time, as a reference for the line
+   merge kernels. Does not draw to the terminal. */
+static void ppu_draw_background_reference(ppu_t *ppu, uint8_t pixels[])
+{
+  uint8_t nt;
+  uint8_t base_htile;
+  const uint8_t *row;
+  uint8_t color, palette_index, palette_group;
+  uint8_t pixel_no;
+  uint8_t x_pixel;
+
+  for (base_htile = 0; base_htile < 32; base_htile++) {
+    nt = ppu_background_tile(ppu, base_htile, &palette_group);
+    row = ppu_tile_row(ppu, ppu->bg_tile_sel, nt, ppu->scanline % 8, false);
 
     for (pixel_no = 0; pixel_no < 8; pixel_no++) {
-      palette_index = ((plane1 >> pixel_no) & 1) +
-                     (((plane2 >> pixel_no) & 1) * 2);
+      palette_index = row[pixel_no];
       if (palette_index == 0) {
         color = ppu->palette_ram[palette_index]; /* Always read 0x3F00. */
       } else {
         color = ppu->palette_ram[(palette_group * 4) + palette_index];
       }
-      x_pixel = ((base_htile * 8) + (7 - pixel_no)) - (ppu->scroll_x % 8);
+      x_pixel = ((base_htile * 8) + pixel_no) - (ppu->scroll_x % 8);
       if (palette_index == 0 && pixels[x_pixel % 256] != PPU_PIXEL_UNUSED) {
         /* Do not overwrite background sprite! */
       } else {
@@ -350,70 +561,102 @@ static void ppu_draw_background(ppu_t *ppu, uint8_t pixels[])
 
 
 
+/* Builds the sprite lists of all visible scanlines at once, instead of
+   going through the whole sprite RAM on every scanline. */
+static void ppu_sprite_evaluate(ppu_t *ppu)
+{
+  ppu_sprite_line_t *line;
+  int scanline;
+  int sprite;
+  int prio;
+
+  for (scanline = 0; scanline < PPU_VISIBLE_SCANLINES; scanline++) {
+    ppu->sprite_line[scanline].count[0] = 0;
+    ppu->sprite_line[scanline].count[1] = 0;
+    ppu->sprite_line[scanline].overflow = false;
+  }
+
+  for (sprite = 0; sprite < PPU_SIZE_SPRITE_RAM; sprite += 4) {
+    HEATMAP_PPU(read, HEATMAP_PPU_SPRITE_RAM + sprite)
+    prio = (ppu->sprite_ram[sprite+2] >> 5) & 0x1;
+    for (scanline = ppu->sprite_ram[sprite] + 1;
+         scanline <= ppu->sprite_ram[sprite] + 8 &&
+         scanline < PPU_VISIBLE_SCANLINES; scanline++) {
+      line = &ppu->sprite_line[scanline];
+      if (line->count[0] + line->count[1] >= PPU_SPRITES_PER_LINE) {
+        line->overflow = true;
+        continue;
+      }
+      line->sprite[prio][line->count[prio]] = sprite;
+      line->count[prio]++;
+    }
+  }
+
+  ppu->sprite_ram_changed = false;
+}
+
+
+
 static void ppu_draw_sprites(ppu_t *ppu, uint8_t pixels[], int prio)
 {
+  ppu_sprite_line_t *line;
   uint8_t nt;
-  uint8_t plane1, plane2;
+  const uint8_t *row;
   uint8_t color, palette_index, palette_group;
   uint8_t pixel_no;
   uint8_t y_offset;
   uint16_t x_pixel;
-  int sprite;
+  uint8_t sprite;
+  int i;
 
-  for (sprite = 0; sprite < PPU_SIZE_SPRITE_RAM; sprite += 4) {
-    if (ppu->scanline >= ppu->sprite_ram[sprite] + 1 &&
-        ppu->scanline <= ppu->sprite_ram[sprite] + 8) {
+  line = &ppu->sprite_line[ppu->scanline];
+  for (i = 0; i < line->count[prio]; i++) {
+    sprite = line->sprite[prio][i];
+    HEATMAP_PPU_RANGE(read, HEATMAP_PPU_SPRITE_RAM + sprite + 1, 3)
 
-      if (((ppu->sprite_ram[sprite+2] >> 5) & 0x1) != prio) {
-        continue;
-      }
-
-      nt = ppu->sprite_ram[sprite+1];
-      palette_group = (ppu->sprite_ram[sprite+2] & 0x3) + 4;
-
-      if (ppu->scanline % 8 == 0) {
-        cli_draw_tile(ppu->sprite_ram[sprite] / 8,
-                     (ppu->sprite_ram[sprite+3] + 4) / 8,
-                      ppu->sprite_tile_sel, nt,
-                      ppu->palette_ram[0],
-                      ppu->palette_ram[(palette_group * 4)],
-                      ppu->palette_ram[(palette_group * 4) + 1],
-                      ppu->palette_ram[(palette_group * 4) + 2],
-                      ppu->palette_ram[(palette_group * 4) + 3]);
-      }
+    nt = ppu->sprite_ram[sprite+1];
+    palette_group = (ppu->sprite_ram[sprite+2] & 0x3) + 4;
 
-      if ((ppu->sprite_ram[sprite+2] >> 7) & 0x1) { /* Flip vertically. */
-        y_offset = 7 - (ppu->scanline - ppu->sprite_ram[sprite] - 1);
-      } else { /* Do not flip vertically. */
-        y_offset = ppu->scanline - ppu->sprite_ram[sprite] - 1;
-      }
+    if (ppu->scanline % 8 == 0) {
+      cli_draw_tile(ppu->sprite_ram[sprite] / 8,
+                   (ppu->sprite_ram[sprite+3] + 4) / 8,
+                    ppu->sprite_tile_sel, nt,
+                    ppu->palette_ram[0],
+                    ppu->palette_ram[(palette_group * 4)],
+                    ppu->palette_ram[(palette_group * 4) + 1],
+                    ppu->palette_ram[(palette_group * 4) + 2],
+                    ppu->palette_ram[(palette_group * 4) + 3]);
+    }
 
-      plane1 = ppu->pattern_table[ppu->sprite_tile_sel]
-        [(nt << 4) + (y_offset % 8)];
-      plane2 = ppu->pattern_table[ppu->sprite_tile_sel]
-        [(nt << 4) + (y_offset % 8) + 8];
+    if ((ppu->sprite_ram[sprite+2] >> 7) & 0x1) { /* Flip vertically. */
+      y_offset = 7 - (ppu->scanline - ppu->sprite_ram[sprite] - 1);
+    } else { /* Do not flip vertically. */
+      y_offset = ppu->scanline - ppu->sprite_ram[sprite] - 1;
+    }
 
-      for (pixel_no = 0; pixel_no < 8; pixel_no++) {
-        palette_index = ((plane1 >> pixel_no) & 1) +
-                       (((plane2 >> pixel_no) & 1) * 2);
+    /* Flip horizontally with the mirrored tile. */
+    row = ppu_tile_row(ppu, ppu->sprite_tile_sel, nt, y_offset % 8,
+      (ppu->sprite_ram[sprite+2] >> 6) & 0x1);
+    HEATMAP_PPU(read, (ppu->sprite_tile_sel * PPU_SIZE_PATTERN_TABLE) +
+      (nt << 4) + (y_offset % 8))
+    HEATMAP_PPU(read, (ppu->sprite_tile_sel * PPU_SIZE_PATTERN_TABLE) +
+      (nt << 4) + (y_offset % 8) + 8)
 
-        if ((ppu->sprite_ram[sprite+2] >> 6) & 0x1) { /* Flip horizontally. */
-          x_pixel = ppu->sprite_ram[sprite+3] + pixel_no;
-        } else { /* Do not flip horizontally. */
-          x_pixel = ppu->sprite_ram[sprite+3] + (7 - pixel_no);
-        }
-        if (x_pixel > 0xFF) {
-          continue; /* Out of bounds, do not render. */
-        }
+    for (pixel_no = 0; pixel_no < 8; pixel_no++) {
+      palette_index = row[pixel_no];
+      x_pixel = ppu->sprite_ram[sprite+3] + pixel_no;
+      if (x_pixel > 0xFF) {
+        continue; /* Out of bounds, do not render. */
+      }
 
-        if (palette_index != 0) { /* Not transparent. */
-          if (sprite == 0 &&
-            pixels[x_pixel] > 0) {
-            ppu->sprite_0_hit = 1;
-          }
-          color = ppu->palette_ram[(palette_group * 4) + palette_index];
-          pixels[x_pixel] = color;
+      if (palette_index != 0) { /* Not transparent. */
+        if (sprite == 0 &&
+          pixels[x_pixel] > 0) {
+          ppu->sprite_0_hit = 1;
         }
+        color = ppu->palette_ram[(palette_group * 4) + palette_index];
+        HEATMAP_PPU(read, 0x3F00 + (palette_group * 4) + palette_index)
+        pixels[x_pixel] = color;
       }
     }
   }
@@ -421,33 +664,73 @@ static void ppu_draw_sprites(ppu_t *ppu, uint8_t pixels[], int prio)
 
 
 
-void ppu_execute(ppu_t *ppu)
+/* Lets the mapper count scanlines with rendering enabled, on dots that
+   are already events instead of checking on every dot. */
+static inline void ppu_scanline_clock(ppu_t *ppu)
 {
-  static uint8_t pixels[256]; /* On 1 scanline. */
-  int i;
+  if (ppu->scanline_hook != NULL && (ppu->bg_enable || ppu->sprite_enable)) {
+    (ppu->scanline_hook)(ppu->scanline_context);
+  }
+}
 
-  if (ppu->status_was_accessed) {
-    ppu->status_was_accessed = false;
-    ppu->vblank = 0;
-    ppu->addr_latch = false;
+
+
+/* Dots until the next one where the PPU changes state visible to the CPU:
+   vblank/sprite 0 clear, scanline render or vblank set with NMI. */
+static int ppu_dots_until_event(ppu_t *ppu)
+{
+  if (ppu->scanline == -1 && ppu->dot <= 1) {
+    return 1 - ppu->dot;
+  } else if (ppu->scanline == -1) {
+    return 341 - ppu->dot;
+  } else if (ppu->scanline <= 239 && ppu->dot == 0) {
+    return 0;
+  } else if (ppu->scanline <= 238) {
+    return 341 - ppu->dot;
+  } else if (ppu->scanline < 243 || (ppu->scanline == 243 && ppu->dot <= 1)) {
+    return ((243 - ppu->scanline) * 341) - ppu->dot + 1;
+  } else {
+    return ((261 - ppu->scanline) * 341) + (341 - ppu->dot) + 1;
   }
+}
 
-  if (ppu->data_was_accessed) {
-    ppu->data_was_accessed = false;
-    if (ppu->vram_increment == 1) {
-      ppu->addr += 32;
-    } else {
-      ppu->addr += 1;
-    }
-    ppu->addr &= 0x7FFF; /* VRAM address register can only be 15 bits. */
+
+
+static inline void ppu_advance(ppu_t *ppu, int dots)
+{
+  int position;
+
+  position = ppu->dot + dots;
+  ppu->dot = position % 341;
+  ppu->scanline += position / 341;
+  while (ppu->scanline >= 262) { /* NTSC */
+    ppu->scanline -= 263;
+    ppu->frame_no++;
   }
+}
+
+
+
+static void ppu_event(ppu_t *ppu)
+{
+  static uint8_t pixels[256]; /* On 1 scanline. */
+  int i;
 
   if (ppu->scanline == -1 && ppu->dot == 1) {
     ppu->vblank = 0;
     ppu->sprite_0_hit = 0;
+    ppu->sprite_overflow = 0;
     ppu->nametable_sel = 0;
+    ppu_scanline_clock(ppu);
 
   } else if (ppu->scanline >= 0 && ppu->scanline <= 239 && ppu->dot == 0) {
+    ppu_scanline_clock(ppu);
+    if (ppu->sprite_ram_changed) {
+      ppu_sprite_evaluate(ppu);
+    }
+    if (ppu->sprite_line[ppu->scanline].overflow) {
+      ppu->sprite_overflow = 1;
+    }
     for (i = 0; i < 256; i++) {
       pixels[i] = PPU_PIXEL_UNUSED;
     }
@@ -462,23 +745,63 @@ void ppu_execute(ppu_t *ppu)
     ppu->vblank = 1;
 
     if (ppu->nmi_enable) {
-      ppu->trigger_nmi = true;
+      cpu_interrupt(ppu->cpu, CPU_INTERRUPT_NMI);
+    }
+  }
+}
+
+
+
+/* Catches up by a number of dots, going straight from one event to the
+   next. Register accesses by the CPU take effect on the first dot. */
+void ppu_run(ppu_t *ppu, uint32_t dots)
+{
+  uint32_t until;
+
+  if (dots == 0) {
+    return;
+  }
+
+  if (ppu->status_was_accessed) {
+    ppu->status_was_accessed = false;
+    ppu->vblank = 0;
+    ppu->addr_latch = false;
+  }
+
+  if (ppu->data_was_accessed) {
+    ppu->data_was_accessed = false;
+    if (ppu->vram_increment == 1) {
+      ppu->addr += 32;
+    } else {
+      ppu->addr += 1;
     }
+    ppu->addr &= 0x7FFF; /* VRAM address register can only be 15 bits. */
   }
 
-  ppu->dot++;
-  if (ppu->dot >= 341) {
-    ppu->dot = 0;
-    ppu->scanline++;
-    if (ppu->scanline >= 262) { /* NTSC */
-      ppu->scanline = -1;
-      ppu->frame_no++;
+  while (dots > 0) {
+    until = ppu_dots_until_event(ppu);
+    if (until >= dots) {
+      ppu_advance(ppu, dots);
+      return;
     }
+    ppu_advance(ppu, until);
+    ppu_event(ppu);
+    ppu_advance(ppu, 1);
+    dots -= until + 1;
   }
 }
 
 
 
+/* CPU cycles that can pass before the next event dot. Three dots are
+   executed per CPU cycle. */
+uint32_t ppu_cycles_until_event(ppu_t *ppu)
+{
+  return (ppu_dots_until_event(ppu) + 3) / 3;
+}
+
+
+
 void ppu_dump(FILE *fh, ppu_t *ppu)
 {
   fprintf(fh, "Frame Number: %u\n", ppu->frame_no);
@@ -508,8 +831,8 @@ void ppu_pattern_table_dump(FILE *fh, ppu_t *ppu, int table_no, int pattern_no)
   }
 
   for (vpixel = 0; vpixel < 8; vpixel++) {
-    plane1 = ppu->pattern_table[table_no][(pattern_no * 16) + vpixel];
-    plane2 = ppu->pattern_table[table_no][(pattern_no * 16) + vpixel + 8];
+    plane1 = ppu_pattern(ppu, table_no, (pattern_no * 16) + vpixel);
+    plane2 = ppu_pattern(ppu, table_no, (pattern_no * 16) + vpixel + 8);
     for (hpixel = 7; hpixel > 0; hpixel--) {
       pixel = ((plane1 >> hpixel) & 1) + (((plane2 >> hpixel) & 1) * 2);
       if (pixel == 0) fprintf(fh, " ");
@@ -532,12 +855,12 @@ void ppu_name_table_dump(FILE *fh, ppu_t *ppu, int table_no)
     fprintf(fh, "Invalid name table number: %d\n", table_no);
     return;
   }
-  table_no *= PPU_SIZE_NAME_TABLE;
 
   for (vtile = 0; vtile < 30; vtile++) {
-    fprintf(fh, "$%04x  ", 0x2000 + table_no + (vtile * 32));
+    fprintf(fh, "$%04x  ",
+      0x2000 + (table_no * PPU_SIZE_NAME_TABLE) + (vtile * 32));
     for (htile = 0; htile < 32; htile++) {
-      nt = ppu->name_table[table_no + htile + (vtile * 32)];
+      nt = ppu->name_table[table_no][htile + (vtile * 32)];
       fprintf(fh, "%02x", nt);
     }
     fprintf(fh, "\n");
@@ -555,14 +878,13 @@ void ppu_attribute_table_dump(FILE *fh, ppu_t *ppu, int table_no)
     fprintf(fh, "Invalid attribute table number: %d\n", table_no);
     return;
   }
-  table_no *= PPU_SIZE_NAME_TABLE;
 
   fprintf(fh, " | 0| 1| 2| 3| 4| 5| 6| 7|\n");
   fprintf(fh, " |--+--+--+--+--+--+--+--|\n");
   for (vtile = 0; vtile < 30; vtile += 4) {
     fprintf(fh, "%d|", vtile / 4);
     for (htile = 0; htile < 32; htile += 4) {
-      at = ppu->name_table[table_no + 0x3C0 + (htile / 4) + ((vtile / 4) * 8)];
+      at = ppu->name_table[table_no][0x3C0 + (htile / 4) + ((vtile / 4) * 8)];
       fprintf(fh, "%02x|", at);
     }
     fprintf(fh, "\n |--+--+--+--+--+--+--+--|\n");
@@ -600,3 +922,114 @@ void ppu_sprite_ram_dump(FILE *fh, ppu_t *ppu)
 
 
 
+
+
+
+static double ppu_bench_time(ppu_t *ppu, ppu_line_merge_t merge)
+{
+  static uint8_t pixels[256];
+  clock_t start;
+  int i;
+
+  start = clock();
+  for (i = 0; i < PPU_BENCH_SCANLINES; i++) {
+    ppu->scanline = i % 240;
+    ppu->scroll_x = i % 256;
+    memset(pixels, PPU_PIXEL_UNUSED, sizeof(pixels));
+    pixels[(i * 7) % 256] = 0x21; /* A sprite behind the background. */
+    if (merge == NULL) {
+      ppu_draw_background_reference(ppu, pixels);
+    } else {
+      ppu_line_merge = merge;
+      ppu_draw_background(ppu, pixels);
+    }
+  }
+  return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 /
+    PPU_BENCH_SCANLINES;
+}
+
+
+
+static bool ppu_bench_verify(ppu_t *ppu, ppu_line_merge_t merge)
+{
+  uint8_t expected[256];
+  uint8_t pixels[256];
+  int i;
+
+  ppu_line_merge = merge;
+  for (i = 0; i < 240 * 8; i++) {
+    ppu->scanline = i % 240;
+    ppu->scroll_x = (i / 240) * 37;
+    memset(expected, PPU_PIXEL_UNUSED, sizeof(expected));
+    expected[(i * 7) % 256] = 0x21;
+    memcpy(pixels, expected, sizeof(pixels));
+    ppu_draw_background_reference(ppu, expected);
+    ppu_draw_background(ppu, pixels);
+    if (memcmp(pixels, expected, sizeof(pixels)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+/* Times drawing the background of a scanline from random tiles, with the
+   reference loop and each line merge kernel. */
+void ppu_render_bench(FILE *fh)
+{
+  struct {
+    const char *name;
+    ppu_line_merge_t merge;
+    bool supported;
+  } kernel[] = {
+    { "scalar", ppu_line_merge_scalar, true },
+#ifdef PPU_SIMD
+    { "sse2", ppu_line_merge_sse2, __builtin_cpu_supports("sse2") },
+    { "avx2", ppu_line_merge_avx2, __builtin_cpu_supports("avx2") },
+#endif
+  };
+  ppu_t *ppu;
+  mem_t *mem;
+  cpu_t cpu;
+  size_t i;
+
+  ppu = malloc(sizeof(ppu_t));
+  mem = malloc(sizeof(mem_t));
+  if (ppu == NULL || mem == NULL) {
+    free(ppu);
+    free(mem);
+    return;
+  }
+  mem_init(mem);
+  ppu_init(ppu, mem, &cpu);
+
+  srand(1);
+  for (i = 0; i < PPU_PATTERN_TABLES * PPU_SIZE_PATTERN_TABLE; i++) {
+    ppu->pattern_table[i / PPU_SIZE_PATTERN_TABLE]
+      [i % PPU_SIZE_PATTERN_TABLE] = rand();
+  }
+  for (i = 0; i < PPU_SIZE_VRAM; i++) {
+    ppu->vram[i] = rand();
+  }
+  for (i = 0; i < PPU_SIZE_PALETTE_RAM; i++) {
+    ppu->palette_ram[i] = rand() & 0x3F;
+  }
+  ppu_tile_cache_flush(ppu);
+
+  fprintf(fh, "Background scanline, average of %d:\n", PPU_BENCH_SCANLINES);
+  fprintf(fh, "  %-9s %8.1f ns\n", "reference", ppu_bench_time(ppu, NULL));
+  for (i = 0; i < sizeof(kernel) / sizeof(kernel[0]); i++) {
+    if (! kernel[i].supported) {
+      fprintf(fh, "  %-9s      n/a\n", kernel[i].name);
+      continue;
+    }
+    fprintf(fh, "  %-9s %8.1f ns%s\n", kernel[i].name,
+      ppu_bench_time(ppu, kernel[i].merge),
+      ppu_bench_verify(ppu, kernel[i].merge) ? "" : " (MISMATCH)");
+  }
+
+  ppu_line_merge = ppu_line_merge_best();
+  free(ppu);
+  free(mem);
+}
@@ -5,14 +5,39 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "mem.h"
+#include "cpu.h"
 
 #define PPU_PATTERN_TABLES 2
+#define PPU_PATTERN_BANKS 8 /* 1K each, the smallest mapper CHR bank. */
 #define PPU_NAME_TABLES 4
 
 #define PPU_SIZE_PATTERN_TABLE 0x1000
+#define PPU_SIZE_PATTERN_BANK  0x400
 #define PPU_SIZE_NAME_TABLE    0x400
+#define PPU_SIZE_VRAM          0x800
 #define PPU_SIZE_PALETTE_RAM   0x20
 #define PPU_SIZE_SPRITE_RAM    0x100
+#define PPU_SIZE_TILE          0x10
+
+#define PPU_TILES (PPU_PATTERN_BANKS * PPU_SIZE_PATTERN_BANK / PPU_SIZE_TILE)
+
+#define PPU_MIRRORING_HORIZONTAL  0
+#define PPU_MIRRORING_VERTICAL    1
+#define PPU_MIRRORING_SINGLE_LOW  2
+#define PPU_MIRRORING_SINGLE_HIGH 3
+
+#define PPU_VISIBLE_SCANLINES 240
+#define PPU_SPRITES_PER_LINE 8
+
+typedef void (*ppu_scanline_hook_t)(void *);
+
+/* The first sprites in OAM order on a scanline, as offsets into sprite
+   RAM, by priority: 0 in front of the background and 1 behind it. */
+typedef struct ppu_sprite_line_s {
+  uint8_t count[2];
+  uint8_t sprite[2][PPU_SPRITES_PER_LINE];
+  bool overflow; /* More sprites than drawn. */
+} ppu_sprite_line_t;
 
 typedef struct ppu_s {
   union {
@@ -63,14 +88,28 @@ typedef struct ppu_s {
   bool status_was_accessed;
   bool data_was_accessed;
   bool addr_latch;
-  bool trigger_nmi;
   uint8_t vram_buffer;
-  bool vertical_mirroring;
 
   uint8_t pattern_table[PPU_PATTERN_TABLES][PPU_SIZE_PATTERN_TABLE];
-  uint8_t name_table[PPU_NAME_TABLES * PPU_SIZE_NAME_TABLE];
+  uint8_t *pattern_bank[PPU_PATTERN_BANKS]; /* Into the above or CHR ROM. */
+  bool pattern_rom; /* Writes to the pattern tables are ignored. */
+  uint8_t vram[PPU_SIZE_VRAM]; /* Physical memory of two name tables. */
+  uint8_t *name_table[PPU_NAME_TABLES]; /* Into the above by mirroring. */
   uint8_t palette_ram[PPU_SIZE_PALETTE_RAM];
   uint8_t sprite_ram[PPU_SIZE_SPRITE_RAM];
+
+  /* Tiles of the mapped pattern banks with the bitplanes combined into
+     one pixel value per byte, from left to right or mirrored. */
+  uint8_t tile[PPU_TILES][8][8];
+  uint8_t tile_flip[PPU_TILES][8][8];
+  bool tile_valid[PPU_TILES]; /* Decoded again on use when cleared. */
+
+  ppu_sprite_line_t sprite_line[PPU_VISIBLE_SCANLINES];
+  bool sprite_ram_changed; /* Lines evaluated again before the next use. */
+
+  cpu_t *cpu;
+  ppu_scanline_hook_t scanline_hook; /* Once per rendered scanline. */
+  void *scanline_context;
 } ppu_t;
 
 #define PPU_CTRL     0x2000
@@ -82,13 +121,18 @@ typedef struct ppu_s {
 #define PPU_ADDR     0x2006
 #define PPU_DATA     0x2007
 
-void ppu_init(ppu_t *ppu, mem_t *mem);
-void ppu_execute(ppu_t *ppu);
+void ppu_init(ppu_t *ppu, mem_t *mem, cpu_t *cpu);
+void ppu_pattern_bank_set(ppu_t *ppu, int slot, uint8_t *data);
+void ppu_tile_cache_flush(ppu_t *ppu);
+void ppu_mirroring_set(ppu_t *ppu, int mirroring);
+void ppu_run(ppu_t *ppu, uint32_t dots);
+uint32_t ppu_cycles_until_event(ppu_t *ppu);
 void ppu_dump(FILE *fh, ppu_t *ppu);
 void ppu_pattern_table_dump(FILE *fh, ppu_t *ppu, int table_no, int pattern_no);
 void ppu_name_table_dump(FILE *fh, ppu_t *ppu, int table_no);
 void ppu_attribute_table_dump(FILE *fh, ppu_t *ppu, int table_no);
 void ppu_palette_ram_dump(FILE *fh, ppu_t *ppu);
 void ppu_sprite_ram_dump(FILE *fh, ppu_t *ppu);
+void ppu_render_bench(FILE *fh);
 
 #endif /* _PPU_H */
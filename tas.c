@@ -12,6 +12,7 @@
 
 static uint8_t tas_controller_state[TAS_DATA_MAX];
 static unsigned int tas_data_index = 0;
+static unsigned int tas_data_length = 0;
 static bool tas_active = false;
 
 
@@ -58,6 +59,7 @@ int tas_init(const char *filename)
     }
   }
 
+  tas_data_length = n;
   fclose(fh);
   return 0;
 }
@@ -98,3 +100,11 @@ bool tas_is_active(void)
 
 
 
+/* Number of frames in the movie. */
+uint32_t tas_length(void)
+{
+  return tas_data_length;
+}
+
+
+
@@ -8,5 +8,6 @@ int tas_init(const char *filename);
 uint8_t tas_get_controller_state(void);
 void tas_update(uint32_t frame_no);
 bool tas_is_active(void);
+uint32_t tas_length(void);
 
 #endif /* _TAS_H */
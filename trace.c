@@ -0,0 +1,302 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cpu.h"
+
+/* Streams every executed instruction to a binary file. The emulation
+   thread only adds records to a single producer, single consumer ring, and
+   a writer thread moves them to disk. Neither ever waits for the other: if
+   the writer falls behind and the ring is full, records are dropped and
+   counted instead. Records are written in host byte order after a header
+   giving the format version and record size. */
+
+#define TRACE_MAGIC "LZBT"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE 0x40000 /* Records, a power of two. */
+#define TRACE_WRITE_MAX 4096 /* Records per write. */
+#define TRACE_IDLE_NS 1000000 /* Writer sleep when the ring is empty. */
+
+typedef struct trace_header_s {
+  char magic[4];
+  uint16_t version;
+  uint16_t record_size;
+} trace_header_t;
+
+typedef struct trace_record_s {
+  uint64_t cycles; /* Since reset. */
+  uint32_t frame_no;
+  uint16_t pc;
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t sp;
+  uint8_t p; /* Status register as pushed, with N and Z. */
+  uint8_t mc[3];
+  uint8_t reserved[2];
+} trace_record_t;
+
+static trace_record_t *trace_buffer = NULL;
+static atomic_uint trace_head; /* Next record to add. */
+static atomic_uint trace_tail; /* Next record to write. */
+static atomic_bool trace_running;
+static pthread_t trace_thread;
+static FILE *trace_fh = NULL;
+static bool trace_active = false;
+static uint64_t trace_dropped = 0;
+
+static const uint32_t *trace_frame_no;
+static uint64_t trace_cycle_base = 0;
+
+static uint16_t trace_pc_start = 0;
+static uint16_t trace_pc_end = UINT16_MAX;
+static uint32_t trace_frame_start = 0;
+static uint32_t trace_frame_end = UINT32_MAX;
+
+
+
+/* Writes the records in the ring up to the end of the buffer at most,
+   returns the number written. */
+static unsigned int trace_flush(void)
+{
+  unsigned int head;
+  unsigned int tail;
+  unsigned int count;
+
+  head = atomic_load_explicit(&trace_head, memory_order_acquire);
+  tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+  count = head - tail;
+  if (count == 0) {
+    return 0;
+  }
+
+  if (count > TRACE_BUFFER_SIZE - (tail % TRACE_BUFFER_SIZE)) {
+    count = TRACE_BUFFER_SIZE - (tail % TRACE_BUFFER_SIZE);
+  }
+  if (count > TRACE_WRITE_MAX) {
+    count = TRACE_WRITE_MAX;
+  }
+
+  fwrite(&trace_buffer[tail % TRACE_BUFFER_SIZE], sizeof(trace_record_t),
+    count, trace_fh);
+  atomic_store_explicit(&trace_tail, tail + count, memory_order_release);
+  return count;
+}
+
+
+
+static void *trace_writer(void *arg)
+{
+  struct timespec idle;
+
+  (void)arg;
+  idle.tv_sec = 0;
+  idle.tv_nsec = TRACE_IDLE_NS;
+
+  while (atomic_load_explicit(&trace_running, memory_order_acquire)) {
+    if (trace_flush() == 0) {
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  while (trace_flush() > 0) {
+    ; /* Drain what was added before stopping. */
+  }
+  return NULL;
+}
+
+
+
+int trace_open(const char *filename, const uint32_t *frame_no)
+{
+  trace_header_t header;
+
+  trace_buffer = malloc(TRACE_BUFFER_SIZE * sizeof(trace_record_t));
+  if (trace_buffer == NULL) {
+    return -1;
+  }
+
+  trace_fh = fopen(filename, "wb");
+  if (trace_fh == NULL) {
+    free(trace_buffer);
+    trace_buffer = NULL;
+    return -1;
+  }
+
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(trace_record_t);
+  if (fwrite(&header, sizeof(trace_header_t), 1, trace_fh) != 1) {
+    fclose(trace_fh);
+    trace_fh = NULL;
+    free(trace_buffer);
+    trace_buffer = NULL;
+    return -1;
+  }
+
+  atomic_init(&trace_head, 0);
+  atomic_init(&trace_tail, 0);
+  atomic_init(&trace_running, true);
+  if (pthread_create(&trace_thread, NULL, trace_writer, NULL) != 0) {
+    fclose(trace_fh);
+    trace_fh = NULL;
+    free(trace_buffer);
+    trace_buffer = NULL;
+    return -1;
+  }
+
+  trace_frame_no = frame_no;
+  trace_dropped = 0;
+  trace_active = true;
+  atexit(trace_close);
+  return 0;
+}
+
+
+
+void trace_close(void)
+{
+  if (! trace_active) {
+    return;
+  }
+  trace_active = false;
+
+  atomic_store_explicit(&trace_running, false, memory_order_release);
+  pthread_join(trace_thread, NULL);
+  fclose(trace_fh);
+  trace_fh = NULL;
+  free(trace_buffer);
+  trace_buffer = NULL;
+
+  if (trace_dropped > 0) {
+    fprintf(stderr, "Trace records dropped: %llu\n",
+      (unsigned long long)trace_dropped);
+  }
+}
+
+
+
+void trace_filter_pc(uint16_t start, uint16_t end)
+{
+  trace_pc_start = start;
+  trace_pc_end = end;
+}
+
+
+
+void trace_filter_frame(uint32_t start, uint32_t end)
+{
+  trace_frame_start = start;
+  trace_frame_end = end;
+}
+
+
+
+void trace_write(cpu_t *cpu, const uint8_t mc[3])
+{
+  trace_record_t *record;
+  unsigned int head;
+  uint32_t frame_no;
+
+  if (! trace_active) {
+    return;
+  }
+
+  frame_no = *trace_frame_no;
+  if (cpu->pc < trace_pc_start || cpu->pc > trace_pc_end ||
+      frame_no < trace_frame_start || frame_no > trace_frame_end) {
+    return;
+  }
+
+  head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&trace_tail, memory_order_acquire) >=
+      TRACE_BUFFER_SIZE) {
+    trace_dropped++;
+    return;
+  }
+
+  record = &trace_buffer[head % TRACE_BUFFER_SIZE];
+  record->cycles = trace_cycle_base + cpu->cycles;
+  record->frame_no = frame_no;
+  record->pc = cpu->pc;
+  record->a = cpu->a;
+  record->x = cpu->x;
+  record->y = cpu->y;
+  record->sp = cpu->sp;
+  record->p = cpu->sr | 0x20;
+  if (cpu->n_result & CPU_FLAG_N) {
+    record->p |= CPU_FLAG_N;
+  }
+  if (cpu->z_result == 0) {
+    record->p |= CPU_FLAG_Z;
+  }
+  record->mc[0] = mc[0];
+  record->mc[1] = mc[1];
+  record->mc[2] = mc[2];
+  record->reserved[0] = 0;
+  record->reserved[1] = 0;
+  atomic_store_explicit(&trace_head, head + 1, memory_order_release);
+}
+
+
+
+/* Called with the cycles run before the CPU counter is reset, to keep the
+   cycles in the records counting from reset. */
+void trace_cycles(uint32_t cycles)
+{
+  trace_cycle_base += cycles;
+}
+
+
+
+/* Prints a trace file in the format of the CPU trace dump, with a line
+   for the start of every frame. */
+int trace_decode(const char *filename, FILE *fh)
+{
+  trace_header_t header;
+  trace_record_t record;
+  FILE *in;
+  cpu_t cpu;
+  uint32_t frame_no = 0;
+  bool first = true;
+
+  in = fopen(filename, "rb");
+  if (in == NULL) {
+    return -1;
+  }
+
+  if (fread(&header, sizeof(trace_header_t), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(trace_record_t)) {
+    fclose(in);
+    return -1;
+  }
+
+  memset(&cpu, 0, sizeof(cpu_t));
+  while (fread(&record, sizeof(trace_record_t), 1, in) == 1) {
+    if (first || record.frame_no != frame_no) {
+      frame_no = record.frame_no;
+      first = false;
+      fprintf(fh, "Frame %u:\n", frame_no);
+    }
+    cpu.pc = record.pc;
+    cpu.a = record.a;
+    cpu.x = record.x;
+    cpu.y = record.y;
+    cpu.sp = record.sp;
+    cpu.sr = record.p;
+    cpu.n_result = record.p;
+    cpu.z_result = (record.p & CPU_FLAG_Z) ? 0 : 1;
+    cpu_register_dump(fh, &cpu, record.mc);
+  }
+
+  fclose(in);
+  return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "cpu.h"
+
+int trace_open(const char *filename, const uint32_t *frame_no);
+void trace_close(void);
+void trace_filter_pc(uint16_t start, uint16_t end);
+void trace_filter_frame(uint32_t start, uint32_t end);
+void trace_write(cpu_t *cpu, const uint8_t mc[3]);
+void trace_cycles(uint32_t cycles);
+int trace_decode(const char *filename, FILE *fh);
+
+#endif /* _TRACE_H */